@@ -0,0 +1,501 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <process.h>
+#include <sddl.h>
+
+#include "Agent.h"
+#include "Batch.h"
+#include "DeviceId.h"
+#include "DeviceInventory.h"
+#include "Dlgcode.h"
+#include "Inventory.h"
+
+#define AGENT_PIPE_BUFFER_SIZE		(64 * 1024)
+#define AGENT_REFRESH_TIMER			2
+
+// Local system and administrators, except through a network logon
+#define AGENT_PIPE_SECURITY			L"D:P(D;;GA;;;NU)(A;;GA;;;SY)(A;;GA;;;BA)"
+
+#define AGENT_WINDOW_CLASS			L"ConcealDriveAgent"
+
+struct AgentWorker
+{
+	HANDLE Pipe;
+	DWORD DosDeviceCounter;
+};
+
+// The inventory and the window belong to the thread running the agent. The workers use the copy
+// of the devices published by that thread, and all the state below is protected by AgentLock.
+// The workers are never stopped: they and the options they use are allocated once and never
+// freed, so that they remain valid after RunAgent returns, until the process exits.
+static CRITICAL_SECTION AgentLock;
+static DWORD AgentThreadId = 0;
+static const AgentOptions *Options = NULL;
+static DeviceInventory *Inventory = NULL;
+static vector <HostDevice> Devices;
+static DeviceIdResolver Resolver;
+static map <wstring, CRITICAL_SECTION *> DeviceLocks;		// By canonical path, never freed, there is one per device ever used
+static bool Stopping = false;
+static LONG ActiveRequests = 0;
+static HANDLE Idle = NULL;									// Set while no request is processed
+
+static const wchar_t *GetAgentDeviceTypeName (const HostDevice &device)
+{
+	if (device.DynamicVolume)
+		return L"dynamic_volume";
+	else if (device.IsPartition)
+		return L"partition";
+	else
+		return L"disk";
+}
+
+static void PublishDevices ()
+{
+	EnterCriticalSection (&AgentLock);
+	Devices = Inventory->GetDevices ();
+	Resolver.SetDevices (Devices);
+	LeaveCriticalSection (&AgentLock);
+}
+
+// Paths naming the same device, whatever their case or the leading zeros of their numbers, share a lock
+static CRITICAL_SECTION *GetDeviceLock (const wstring &path)
+{
+	CRITICAL_SECTION *lock;
+	DWORD diskNumber, partitionNumber;
+	wchar_t canonicalPath[MAX_PATH];
+	wstring key;
+
+	if (ParsePartitionPath (path.c_str(), diskNumber, partitionNumber))
+	{
+		StringCchPrintfW (canonicalPath, ARRAYSIZE (canonicalPath), L"\\DEVICE\\HARDDISK%u\\PARTITION%u", diskNumber, partitionNumber);
+		key = canonicalPath;
+	}
+	else
+	{
+		key = path;
+
+		for (size_t i = 0; i < key.size(); i++)
+			key[i] = towupper (key[i]);
+	}
+
+	EnterCriticalSection (&AgentLock);
+
+	map <wstring, CRITICAL_SECTION *>::const_iterator It = DeviceLocks.find (key);
+	if (It != DeviceLocks.end())
+		lock = It->second;
+	else
+	{
+		lock = new CRITICAL_SECTION;
+		InitializeCriticalSection (lock);
+		DeviceLocks[key] = lock;
+	}
+
+	LeaveCriticalSection (&AgentLock);
+	return lock;
+}
+
+static void AppendResponse (wstring &response, const wchar_t *format, ...)
+{
+	wchar_t line[2048];
+	va_list args;
+
+	va_start (args, format);
+	StringCchVPrintfW (line, ARRAYSIZE (line), format, args);
+	va_end (args);
+
+	response += line;
+}
+
+static void SetErrorResponse (wstring &response, DWORD dwError, const ConcealError *error)
+{
+	wchar_t message[1024];
+
+	if (error)
+		FormatConcealError (*error, message, ARRAYSIZE (message));
+	else
+		GetWin32ErrorMessage (dwError, message, ARRAYSIZE (message));
+
+	response.clear();
+	AppendResponse (response, L"error\t0x%.8X\t%s\n", dwError, message);
+}
+
+static void ListDevices (wstring &response)
+{
+	response = L"ok\n";
+
+	EnterCriticalSection (&AgentLock);
+
+	for (vector <HostDevice>::const_iterator It = Devices.begin(); It != Devices.end(); It++)
+	{
+		AppendResponse (response, L"%s\t%s\t%I64u\t%s", It->Path.c_str(), GetAgentDeviceTypeName (*It), It->Size,
+			It->MountPoint.empty() ? L"-" : It->MountPoint.c_str());
+
+		for (vector <wstring>::const_iterator id = It->Ids.begin(); id != It->Ids.end(); id++)
+			AppendResponse (response, L"\t%s", id->c_str());
+
+		response += L"\n";
+	}
+
+	LeaveCriticalSection (&AgentLock);
+}
+
+// Locates a device given as a path or as a stable identity
+static bool ResolveAgentDevice (const wstring &device, wstring &path)
+{
+	if (IsHarddiskDevicePath (device.c_str()))
+	{
+		path = device;
+		return true;
+	}
+
+	if (!IsDeviceId (device.c_str()))
+	{
+		SetLastError (ERROR_INVALID_PARAMETER);
+		return false;
+	}
+
+	EnterCriticalSection (&AgentLock);
+
+	const HostDevice *resolved = Resolver.Resolve (device);
+	if (resolved)
+		path = resolved->Path;
+
+	DWORD dwError = GetLastError ();
+	LeaveCriticalSection (&AgentLock);
+
+	SetLastError (dwError);
+	return resolved != NULL;
+}
+
+static void ProcessAgentRequest (const wstring &request, DWORD dosDeviceCounter, wstring &response)
+{
+	size_t sep = request.find (L'\t');
+	wstring command = request.substr (0, sep);
+	wstring device = (sep == wstring::npos) ? wstring() : request.substr (sep + 1);
+	wstring path;
+
+	if (_wcsicmp (command.c_str(), L"list") == 0 && device.empty())
+	{
+		ListDevices (response);
+		return;
+	}
+
+	if (_wcsicmp (command.c_str(), L"stop") == 0 && device.empty())
+	{
+		EnterCriticalSection (&AgentLock);
+		Stopping = true;
+		LeaveCriticalSection (&AgentLock);
+
+		PostThreadMessage (AgentThreadId, WM_QUIT, 0, 0);
+		response = L"ok\n";
+		return;
+	}
+
+	bool bStatus = _wcsicmp (command.c_str(), L"status") == 0;
+	bool bConceal = _wcsicmp (command.c_str(), L"conceal") == 0;
+	bool bReveal = _wcsicmp (command.c_str(), L"reveal") == 0;
+
+	if (!bStatus && !bConceal && !bReveal)
+	{
+		SetErrorResponse (response, ERROR_INVALID_FUNCTION, NULL);
+		return;
+	}
+
+	if (!ResolveAgentDevice (device, path))
+	{
+		SetErrorResponse (response, GetLastError (), NULL);
+		return;
+	}
+
+	// Requests on different devices run concurrently, those on the same device one after the other
+	CRITICAL_SECTION *deviceLock = GetDeviceLock (path);
+	EnterCriticalSection (deviceLock);
+
+	if (bStatus)
+	{
+		ConcealState state;
+		const wchar_t *fileSystemName;
+
+		if (GetDeviceConcealState (path.c_str(), dosDeviceCounter, Options->Transform, state, &fileSystemName))
+		{
+			response.clear();
+			AppendResponse (response, L"ok\t%s\t%s\t%s\n", path.c_str(), GetConcealStateName (state), fileSystemName ? fileSystemName : L"-");
+		}
+		else
+			SetErrorResponse (response, GetLastError (), NULL);
+	}
+	else
+	{
+		BatchTarget target;
+
+		target.Target = device;
+		target.Path = path;
+		target.IsDevice = true;
+		target.AnyState = false;
+		target.ExpectedState = bConceal ? CONCEAL_STATE_VISIBLE : CONCEAL_STATE_CONCEALED;
+
+		RunBatchTarget (target, dosDeviceCounter, Options->Transform);
+
+		if (target.Result == BATCH_RESULT_FAILED)
+			SetErrorResponse (response, target.LastError, target.Errors.empty() ? NULL : &target.Errors.front());
+		else
+		{
+			response.clear();
+			AppendResponse (response, L"ok\t%s\t%s\t%s\t%s\n", path.c_str(), GetBatchResultName (target.Result),
+				GetConcealStateName (target.StateBefore),
+				target.Result == BATCH_RESULT_DONE ? GetConcealStateName (target.StateAfter) : L"-");
+		}
+	}
+
+	LeaveCriticalSection (deviceLock);
+}
+
+static bool WriteAgentResponse (HANDLE hPipe, const wstring &response)
+{
+	int len = WideCharToMultiByte (CP_UTF8, 0, response.c_str(), (int) response.size(), NULL, 0, NULL, NULL);
+	vector <char> utf8 (len > 0 ? len : 1);
+	DWORD written;
+
+	len = WideCharToMultiByte (CP_UTF8, 0, response.c_str(), (int) response.size(), &utf8[0], (int) utf8.size(), NULL, NULL);
+
+	return len > 0 && WriteFile (hPipe, &utf8[0], (DWORD) len, &written, NULL) && written == (DWORD) len;
+}
+
+// Processes the requests of a connected client until it disconnects
+static void ServeAgentClient (HANDLE hPipe, DWORD dosDeviceCounter)
+{
+	char request[AGENT_MAX_REQUEST_SIZE];
+	wchar_t wideRequest[AGENT_MAX_REQUEST_SIZE + 1];
+
+	for (;;)
+	{
+		DWORD bytesRead;
+		wstring response;
+		bool bTooLarge = false;
+		bool bStopping;
+		bool bWritten;
+		int len;
+
+		if (!ReadFile (hPipe, request, sizeof (request), &bytesRead, NULL))
+		{
+			if (GetLastError () != ERROR_MORE_DATA)
+				return;
+
+			// The rest of the message is discarded
+			char discarded[AGENT_MAX_REQUEST_SIZE];
+			while (!ReadFile (hPipe, discarded, sizeof (discarded), &bytesRead, NULL))
+			{
+				if (GetLastError () != ERROR_MORE_DATA)
+					return;
+			}
+
+			bTooLarge = true;
+		}
+
+		EnterCriticalSection (&AgentLock);
+
+		bStopping = Stopping;
+		if (!bStopping && ActiveRequests++ == 0)
+			ResetEvent (Idle);
+
+		LeaveCriticalSection (&AgentLock);
+
+		if (bStopping)
+			SetErrorResponse (response, ERROR_SHUTDOWN_IN_PROGRESS, NULL);
+		else
+		{
+			len = bTooLarge ? 0 : MultiByteToWideChar (CP_UTF8, 0, request, (int) bytesRead, wideRequest, AGENT_MAX_REQUEST_SIZE);
+
+			while (len > 0 && (wideRequest[len - 1] == L'\n' || wideRequest[len - 1] == L'\r'))
+				len--;
+
+			if (len <= 0)
+				SetErrorResponse (response, ERROR_INVALID_DATA, NULL);
+			else
+				ProcessAgentRequest (wstring (wideRequest, len), dosDeviceCounter, response);
+		}
+
+		// A request is only complete once its response has been read by the client, so that the
+		// agent does not exit before the clients know the outcome of their requests
+		bWritten = WriteAgentResponse (hPipe, response) && FlushFileBuffers (hPipe);
+
+		if (!bStopping)
+		{
+			EnterCriticalSection (&AgentLock);
+
+			if (--ActiveRequests == 0)
+				SetEvent (Idle);
+
+			LeaveCriticalSection (&AgentLock);
+		}
+
+		if (!bWritten)
+			return;
+	}
+}
+
+static unsigned __stdcall AgentWorkerProc (void *param)
+{
+	AgentWorker *worker = (AgentWorker *) param;
+
+	for (;;)
+	{
+		if (ConnectNamedPipe (worker->Pipe, NULL) || GetLastError () == ERROR_PIPE_CONNECTED)
+			ServeAgentClient (worker->Pipe, worker->DosDeviceCounter);
+
+		DisconnectNamedPipe (worker->Pipe);
+	}
+}
+
+static HANDLE CreateAgentPipe (SECURITY_ATTRIBUTES *security, bool bFirstInstance)
+{
+	// The first instance fails if another process owns the pipe name
+	return CreateNamedPipeW (AGENT_PIPE_NAME,
+		PIPE_ACCESS_DUPLEX | (bFirstInstance ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+		PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+		PIPE_UNLIMITED_INSTANCES, AGENT_PIPE_BUFFER_SIZE, AGENT_MAX_REQUEST_SIZE, 0, security);
+}
+
+static LRESULT CALLBACK AgentWindowProc (HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+	switch (msg)
+	{
+	case WM_DEVICECHANGE:
+		if (Inventory->OnDeviceChange (wParam, lParam))
+			SetTimer (hwnd, DEVICE_INVENTORY_UPDATE_TIMER, DEVICE_INVENTORY_UPDATE_DELAY, NULL);
+		return TRUE;
+
+	case WM_TIMER:
+		if (wParam == DEVICE_INVENTORY_UPDATE_TIMER)
+		{
+			KillTimer (hwnd, DEVICE_INVENTORY_UPDATE_TIMER);
+
+			if (Inventory->Update ())
+				PublishDevices ();
+		}
+		else if (wParam == AGENT_REFRESH_TIMER)
+		{
+			Inventory->Refresh ();
+			PublishDevices ();
+		}
+		return 0;
+	}
+
+	return DefWindowProcW (hwnd, msg, wParam, lParam);
+}
+
+static BOOL WINAPI AgentConsoleCtrlHandler (DWORD ctrlType)
+{
+	PostThreadMessage (AgentThreadId, WM_QUIT, 0, 0);
+	return TRUE;
+}
+
+bool RunAgent (const AgentOptions &options)
+{
+	SECURITY_ATTRIBUTES security;
+	PSECURITY_DESCRIPTOR securityDescriptor = NULL;
+	AgentWorker *workers;
+	AgentOptions *workerOptions;
+	DeviceInventory inventory;
+	WNDCLASSW windowClass;
+	HWND hwnd;
+	MSG msg;
+
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorW (AGENT_PIPE_SECURITY, SDDL_REVISION_1, &securityDescriptor, NULL))
+		return false;
+
+	security.nLength = sizeof (security);
+	security.lpSecurityDescriptor = securityDescriptor;
+	security.bInheritHandle = FALSE;
+
+	workers = new AgentWorker[options.WorkerCount];
+
+	// All the instances are created first, so that a running agent is detected before anything else
+	for (size_t i = 0; i < options.WorkerCount; i++)
+	{
+		workers[i].Pipe = CreateAgentPipe (&security, i == 0);
+		workers[i].DosDeviceCounter = options.DosDeviceCounterBase + (DWORD) i;
+
+		if (workers[i].Pipe == INVALID_HANDLE_VALUE)
+		{
+			DWORD dwError = GetLastError ();
+
+			while (i-- > 0)
+				CloseHandle (workers[i].Pipe);
+
+			delete [] workers;
+			LocalFree (securityDescriptor);
+			SetLastError (dwError);
+			return false;
+		}
+	}
+
+	LocalFree (securityDescriptor);
+
+	InitializeCriticalSection (&AgentLock);
+	Idle = CreateEvent (NULL, TRUE, TRUE, NULL);
+	AgentThreadId = GetCurrentThreadId ();
+	workerOptions = new AgentOptions (options);
+	if (options.Transform)
+		workerOptions->Transform = new ConcealTransform (*options.Transform);
+
+	Options = workerOptions;
+	Inventory = &inventory;
+
+	// Device notifications are received by a message-only window
+	memset (&windowClass, 0, sizeof (windowClass));
+	windowClass.lpfnWndProc = AgentWindowProc;
+	windowClass.hInstance = GetModuleHandle (NULL);
+	windowClass.lpszClassName = AGENT_WINDOW_CLASS;
+	RegisterClassW (&windowClass);
+
+	hwnd = CreateWindowW (AGENT_WINDOW_CLASS, L"", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, windowClass.hInstance, NULL);
+
+	if (!hwnd || !inventory.Watch (hwnd))
+	{
+		// Without notifications, the devices are enumerated periodically
+		if (hwnd)
+			SetTimer (hwnd, AGENT_REFRESH_TIMER, AGENT_REFRESH_INTERVAL, NULL);
+	}
+
+	inventory.Refresh ();
+	PublishDevices ();
+
+	for (size_t i = 0; i < options.WorkerCount; i++)
+	{
+		HANDLE hThread = (HANDLE) _beginthreadex (NULL, 0, AgentWorkerProc, &workers[i], 0, NULL);
+		if (hThread)
+			CloseHandle (hThread);
+	}
+
+	SetConsoleCtrlHandler (AgentConsoleCtrlHandler, TRUE);
+
+	while (GetMessageW (&msg, NULL, 0, 0) > 0)
+	{
+		TranslateMessage (&msg);
+		DispatchMessageW (&msg);
+	}
+
+	// No request is started from now on, and those in progress are completed and answered. The workers
+	// keep answering that the agent is stopping until the process exits.
+	EnterCriticalSection (&AgentLock);
+	Stopping = true;
+	LeaveCriticalSection (&AgentLock);
+
+	WaitForSingleObject (Idle, INFINITE);
+
+	SetConsoleCtrlHandler (AgentConsoleCtrlHandler, FALSE);
+	inventory.StopWatching ();
+
+	if (hwnd)
+		DestroyWindow (hwnd);
+
+	return true;
+}
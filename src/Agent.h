@@ -0,0 +1,55 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Agent.h : resident process serving requests on a local named pipe
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Conceal.h"
+
+#define AGENT_PIPE_NAME				L"\\\\.\\pipe\\ConcealDriveAgent"
+#define AGENT_DEFAULT_WORKERS		8
+#define AGENT_MAX_WORKERS			16
+#define AGENT_MAX_REQUEST_SIZE		4096			// bytes
+#define AGENT_REFRESH_INTERVAL		30000			// ms, full enumerations when device notifications are not available
+
+// Requests and responses are UTF-8 messages (the pipe is in message mode), one response per request.
+// A request is a command, optionally followed by a tab and a device (\Device\HarddiskN\PartitionM or
+// a stable identity, see DeviceId.h):
+//
+//   list                   ok, then one line per device: path, type, size, mount point and identities
+//   status <device>        ok <path> <state> <filesystem>
+//   conceal <device>       ok <path> <done|skipped> <state before> <state after>, applying the
+//   reveal <device>        transformation only if the device is visible (conceal) or concealed (reveal)
+//   stop                   ok, then the agent exits once the requests in progress are complete and answered
+//
+// Fields are separated by tabs. A failed request gets: error <code> <message>.
+
+struct AgentOptions
+{
+	AgentOptions ()
+		:
+		WorkerCount (AGENT_DEFAULT_WORKERS),
+		Transform (NULL),
+		DosDeviceCounterBase (0)
+	{
+	}
+
+	unsigned int WorkerCount;			// Pipe instances, hence requests processed at a time
+	const ConcealTransform *Transform;
+	DWORD DosDeviceCounterBase;			// One DOS device name is created per worker
+};
+
+// Serves the requests until a stop request or a console control event (Ctrl+C...). The devices are
+// enumerated once and kept up to date from the device notifications, and the requests on a device
+// are processed one at a time. Only local administrators and the system may connect. Returns false
+// if the pipe cannot be created, which happens when an agent is already running (ERROR_ACCESS_DENIED).
+bool RunAgent (const AgentOptions &options);
@@ -0,0 +1,628 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <process.h>
+
+#include "Batch.h"
+#include "Cancellation.h"
+#include "DeviceId.h"
+#include "Devices.h"
+#include "Dlgcode.h"
+
+#define BATCH_MAX_MANIFEST_SIZE		(64 * 1024 * 1024)
+
+const wchar_t *GetBatchResultName (BatchResultCode result)
+{
+	switch (result)
+	{
+	case BATCH_RESULT_DONE:		return L"done";
+	case BATCH_RESULT_SKIPPED:	return L"skipped";
+	case BATCH_RESULT_FAILED:	return L"failed";
+	case BATCH_RESULT_CANCELLED:	return L"cancelled";
+	default:					return L"pending";
+	}
+}
+
+static wstring TrimString (const wstring &str)
+{
+	size_t begin = str.find_first_not_of (L" \t");
+	size_t end = str.find_last_not_of (L" \t");
+
+	return (begin == wstring::npos) ? wstring() : str.substr (begin, end - begin + 1);
+}
+
+static bool ParseExpectedState (const wstring &str, BatchTarget &target)
+{
+	target.AnyState = false;
+
+	if (str.empty() || _wcsicmp (str.c_str(), L"any") == 0)
+		target.AnyState = true;
+	else if (_wcsicmp (str.c_str(), L"visible") == 0)
+		target.ExpectedState = CONCEAL_STATE_VISIBLE;
+	else if (_wcsicmp (str.c_str(), L"concealed") == 0)
+		target.ExpectedState = CONCEAL_STATE_CONCEALED;
+	else if (_wcsicmp (str.c_str(), L"unknown") == 0)
+		target.ExpectedState = CONCEAL_STATE_UNKNOWN;
+	else
+		return false;
+
+	return true;
+}
+
+bool LoadBatchManifest (const wchar_t *path, vector <BatchTarget> &targets, size_t &errorLine)
+{
+	HANDLE hFile;
+	LARGE_INTEGER size;
+	DWORD nbrBytesRead;
+	vector <char> data;
+	bool bResult = false;
+
+	errorLine = 0;
+	targets.clear();
+
+	hFile = CreateFileW (path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (GetFileSizeEx (hFile, &size))
+	{
+		if (size.QuadPart > BATCH_MAX_MANIFEST_SIZE)
+			SetLastError (ERROR_FILE_TOO_LARGE);
+		else
+		{
+			data.resize ((size_t) size.QuadPart + 1);
+			bResult = ReadFile (hFile, &data[0], (DWORD) size.QuadPart, &nbrBytesRead, NULL) && nbrBytesRead == size.QuadPart;
+		}
+	}
+
+	CloseHandle (hFile);
+
+	if (!bResult)
+		return false;
+
+	// UTF-8, with or without byte order mark
+	const char *text = &data[0];
+	int textSize = (int) size.QuadPart;
+
+	if (textSize >= 3 && memcmp (text, "\xEF\xBB\xBF", 3) == 0)
+	{
+		text += 3;
+		textSize -= 3;
+	}
+
+	wstring content;
+	if (textSize > 0)
+	{
+		int len = MultiByteToWideChar (CP_UTF8, 0, text, textSize, NULL, 0);
+		if (len <= 0)
+			return false;
+
+		content.resize (len);
+		MultiByteToWideChar (CP_UTF8, 0, text, textSize, &content[0], len);
+	}
+
+	size_t lineStart = 0;
+	size_t lineNumber = 0;
+
+	while (lineStart < content.size())
+	{
+		size_t lineEnd = content.find (L'\n', lineStart);
+		if (lineEnd == wstring::npos)
+			lineEnd = content.size();
+
+		wstring line = content.substr (lineStart, lineEnd - lineStart);
+		lineStart = lineEnd + 1;
+		lineNumber++;
+
+		if (!line.empty() && line[line.size() - 1] == L'\r')
+			line.erase (line.size() - 1);
+
+		if (TrimString (line).empty() || TrimString (line)[0] == L'#')
+			continue;
+
+		BatchTarget target;
+		size_t tab = line.find (L'\t');
+
+		target.Target = TrimString (line.substr (0, tab));
+
+		if (target.Target.empty()
+			|| !ParseExpectedState (tab == wstring::npos ? wstring() : TrimString (line.substr (tab + 1)), target))
+		{
+			errorLine = lineNumber;
+			SetLastError (ERROR_INVALID_DATA);
+			return false;
+		}
+
+		targets.push_back (target);
+	}
+
+	return true;
+}
+
+static wstring GetDiskKey (const HostDevice &device)
+{
+	wchar_t key[64];
+
+	// A dynamic volume is assigned to the disk holding its first extent
+	if (!device.Extents.empty())
+		StringCchPrintfW (key, ARRAYSIZE (key), L"disk:%u", device.Extents[0].DiskNumber);
+	else if (!device.IsPartition)
+		StringCchPrintfW (key, ARRAYSIZE (key), L"disk:%u", device.SystemNumber);
+	else
+		return device.Path;
+
+	return key;
+}
+
+// Returns the key of the disk holding the volume mounted at volumePath, the first one for a volume
+// spanning several disks, like the key of the devices of that disk
+static bool GetVolumeDiskKey (const wchar_t *volumePath, wstring &key)
+{
+	wchar_t volumeName[MAX_PATH];
+	vector <HostDeviceExtent> extents;
+	IoctlBuffer buffer (sizeof (VOLUME_DISK_EXTENTS) + 8 * sizeof (DISK_EXTENT));
+	wchar_t diskKey[64];
+	HANDLE hVolume;
+	size_t len;
+	bool bResult;
+
+	if (!GetVolumeNameForVolumeMountPointW (volumePath, volumeName, ARRAYSIZE (volumeName)))
+		return false;
+
+	// The volume device is opened without its trailing backslash, which would open its root directory
+	len = wcslen (volumeName);
+	if (len > 0 && volumeName[len - 1] == L'\\')
+		volumeName[len - 1] = 0;
+
+	hVolume = CreateFileW (volumeName, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hVolume == INVALID_HANDLE_VALUE)
+		return false;
+
+	bResult = GetVolumeExtents (hVolume, extents, buffer) && !extents.empty();
+	CloseHandle (hVolume);
+
+	if (!bResult)
+		return false;
+
+	StringCchPrintfW (diskKey, ARRAYSIZE (diskKey), L"disk:%u", extents[0].DiskNumber);
+	key = diskKey;
+	return true;
+}
+
+bool ResolveBatchTargets (vector <BatchTarget> &targets, size_t &errorTarget)
+{
+	DeviceIdResolver resolver;
+	vector <HostDevice> devices;
+	bool bDevicesListed = false;
+
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		BatchTarget &target = targets[i];
+		const wchar_t *str = target.Target.c_str();
+
+		errorTarget = i;
+
+		if (IsDeviceId (str) || _wcsnicmp (str, L"\\Device\\", 8) == 0)
+		{
+			if (!bDevicesListed)
+			{
+				devices = GetAvailableHostDevices ();
+				resolver.SetDevices (devices);
+				bDevicesListed = true;
+			}
+
+			target.IsDevice = true;
+
+			if (IsDeviceId (str))
+			{
+				const HostDevice *device = resolver.Resolve (target.Target);
+				if (!device)
+					return false;
+
+				target.Path = device->Path;
+				target.DiskKey = GetDiskKey (*device);
+			}
+			else
+			{
+				target.Path = target.Target;
+				target.DiskKey = target.Path;
+
+				for (vector <HostDevice>::const_iterator It = devices.begin(); It != devices.end(); It++)
+				{
+					if (_wcsicmp (It->Path.c_str(), str) == 0)
+					{
+						target.DiskKey = GetDiskKey (*It);
+						break;
+					}
+				}
+			}
+		}
+		else
+		{
+			wchar_t fullPath[MAX_PATH];
+			wchar_t volumePath[MAX_PATH];
+			DWORD attributes;
+
+			if (GetFullPathNameW (str, ARRAYSIZE (fullPath), fullPath, NULL) == 0)
+				return false;
+
+			attributes = GetFileAttributesW (fullPath);
+			if (attributes == INVALID_FILE_ATTRIBUTES)
+				return false;
+
+			if (attributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				SetLastError (ERROR_DIRECTORY);
+				return false;
+			}
+
+			target.Path = fullPath;
+
+			// Image files share the disk of the volume storing them with the devices of that disk. When the
+			// disk cannot be determined, the files of the same volume are still assigned to the same disk.
+			if (!GetVolumePathNameW (fullPath, volumePath, ARRAYSIZE (volumePath)))
+				volumePath[0] = 0;
+
+			if (!volumePath[0] || !GetVolumeDiskKey (volumePath, target.DiskKey))
+			{
+				if (volumePath[0])
+				{
+					target.DiskKey = L"volume:";
+					target.DiskKey += volumePath;
+				}
+				else
+					target.DiskKey = fullPath;
+
+				for (size_t c = 0; c < target.DiskKey.size(); c++)
+					target.DiskKey[c] = towupper (target.DiskKey[c]);
+			}
+		}
+	}
+
+	return true;
+}
+
+struct BatchRun
+{
+	vector <BatchTarget> *Targets;
+	const BatchOptions *Options;
+	CRITICAL_SECTION Lock;
+	HANDLE SlotFreed;					// Auto-reset event set when a job ends or a worker exits
+	vector <bool> Started;
+	size_t FirstUnstarted;
+	map <wstring, unsigned int> ActiveJobsPerDisk;
+	HANDLE Log;
+	bool LogFailed;
+	DWORD LogError;
+};
+
+static bool ReadHeaderState (HANDLE dev, const ConcealTransform *transform, ConcealState &state, const wchar_t **fileSystemName)
+{
+	__declspec(align(TC_MAX_VOLUME_SECTOR_SIZE)) BYTE buf [TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE];
+	DWORD nbrBytesRead;
+	LARGE_INTEGER offset;
+
+	offset.QuadPart = 0;
+	state = CONCEAL_STATE_UNKNOWN;
+	*fileSystemName = NULL;
+
+	if (SetFilePointerEx (dev, offset, NULL, FILE_BEGIN) == 0
+		|| ReadFile (dev, buf, sizeof (buf), &nbrBytesRead, NULL) == 0)
+	{
+		return false;
+	}
+
+	if (nbrBytesRead >= CONCEAL_SIGNATURE_SIZE)
+		state = GetConcealState (buf, fileSystemName, transform);
+
+	return true;
+}
+
+void RunBatchTarget (BatchTarget &target, DWORD dosDeviceCounter, const ConcealTransform *transform,
+	IoThrottle *throttle, bool bLowPriority)
+{
+	WCHAR dosDev[MAX_PATH] = {0};
+	WCHAR devName[MAX_PATH] = {0};
+	LARGE_INTEGER frequency, start, end;
+	HANDLE dev = INVALID_HANDLE_VALUE;
+	ErrorCollector errors (target.Path.c_str());
+	ConcealTransform deviceTransform;
+
+	QueryPerformanceFrequency (&frequency);
+	QueryPerformanceCounter (&start);
+
+	target.Result = BATCH_RESULT_FAILED;
+
+	if (!GetDeviceTransform (target.Path.c_str(), transform, deviceTransform))
+		ReportLastError (&errors, L"identify", NULL);
+	else if (!target.IsDevice)
+	{
+		dev = CreateFileW (target.Path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if (dev == INVALID_HANDLE_VALUE)
+			ReportLastError (&errors, L"open", NULL);
+	}
+	else if (FakeDosNameForDevice (dosDeviceCounter, target.Path.c_str(), dosDev, sizeof (dosDev), devName, sizeof (devName), FALSE))
+		dev = OpenPartitionVolume (&errors, devName, true, false);
+	else
+		ReportLastError (&errors, L"define device name", NULL);
+
+	if (dev != INVALID_HANDLE_VALUE)
+	{
+		HandleBlockDevice device (dev);
+		ThrottledBlockDevice throttledDevice (device, throttle);
+		const wchar_t *fileSystemAfter;
+		bool bHadFileSystemBefore, bHasFileSystemNow;
+
+		// Only a hint, which older systems do not support
+		if (bLowPriority)
+			SetLowIoPriority (dev);
+
+		// The target is opened exclusively, so its state cannot change between the check and the write
+		if (!ReadHeaderState (dev, &deviceTransform, target.StateBefore, &target.FileSystem))
+			ReportLastError (&errors, L"read", NULL, 0);
+		else
+		{
+			if (!target.AnyState && target.StateBefore != target.ExpectedState)
+			{
+				target.Result = BATCH_RESULT_SKIPPED;
+				SetLastError (ERROR_SUCCESS);
+			}
+			else if (ConcealNTFS (throttledDevice, bHadFileSystemBefore, bHasFileSystemNow, NULL, &deviceTransform, &errors))
+			{
+				// The target is only logged as done once its header is stable
+				if (!FlushFileBuffers (dev))
+					ReportLastError (&errors, L"flush", NULL);
+				else if (!ReadHeaderState (dev, &deviceTransform, target.StateAfter, &fileSystemAfter))
+					ReportLastError (&errors, L"read back", NULL, 0);
+				else
+				{
+					target.Result = BATCH_RESULT_DONE;
+					if (!target.FileSystem)
+						target.FileSystem = fileSystemAfter;
+				}
+			}
+		}
+
+		target.LastError = (target.Result == BATCH_RESULT_FAILED) ? GetLastError () : ERROR_SUCCESS;
+		CloseHandle (dev);
+	}
+	else
+		target.LastError = GetLastError ();
+
+	if (target.IsDevice && dosDev[0])
+		DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, target.Path.c_str());
+
+	target.Errors = errors.GetErrors ();
+
+	QueryPerformanceCounter (&end);
+	target.DurationMs = (double) (end.QuadPart - start.QuadPart) * 1000.0 / (double) frequency.QuadPart;
+}
+
+// Appends one line to the log with a single write, so that lines written by concurrent batches do not mix.
+// The line is built to its full length, the target and its path having no length limit.
+static bool AppendBatchLog (HANDLE hLog, const BatchTarget &target)
+{
+	wstring line;
+	wchar_t field[256];
+	wchar_t message[1024] = L"-";
+	vector <char> utf8;
+	SYSTEMTIME now;
+	DWORD written;
+	int len;
+
+	GetSystemTime (&now);
+
+	if (!target.Errors.empty())
+		FormatConcealError (target.Errors.front(), message, ARRAYSIZE (message));
+	else if (target.LastError != ERROR_SUCCESS)
+		GetWin32ErrorMessage (target.LastError, message, ARRAYSIZE (message));
+
+	StringCchPrintfW (field, ARRAYSIZE (field), L"%04d-%02d-%02dT%02d:%02d:%02dZ\t",
+		now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond);
+	line = field;
+	line += target.Target + L"\t" + target.Path + L"\t";
+
+	StringCchPrintfW (field, ARRAYSIZE (field), L"%s\t%s\t%s\t%s\t%s\t0x%.8X\t",
+		target.AnyState ? L"any" : GetConcealStateName (target.ExpectedState),
+		GetConcealStateName (target.StateBefore),
+		target.Result == BATCH_RESULT_DONE ? GetConcealStateName (target.StateAfter) : L"-",
+		target.FileSystem ? target.FileSystem : L"-",
+		GetBatchResultName (target.Result), target.LastError);
+	line += field;
+	line += message;
+
+	StringCchPrintfW (field, ARRAYSIZE (field), L"\t%.3f\n", target.DurationMs);
+	line += field;
+
+	len = WideCharToMultiByte (CP_UTF8, 0, line.c_str(), (int) line.size(), NULL, 0, NULL, NULL);
+	if (len <= 0)
+		return false;
+
+	utf8.resize (len);
+	len = WideCharToMultiByte (CP_UTF8, 0, line.c_str(), (int) line.size(), &utf8[0], len, NULL, NULL);
+
+	return len > 0 && WriteFile (hLog, &utf8[0], len, &written, NULL) && written == (DWORD) len;
+}
+
+// Picks the first target not started yet whose disk has a free slot, or returns false. Called with the lock held.
+static bool TakeBatchTarget (BatchRun &run, size_t &index, bool &bAllStarted)
+{
+	vector <BatchTarget> &targets = *run.Targets;
+
+	while (run.FirstUnstarted < targets.size() && run.Started[run.FirstUnstarted])
+		run.FirstUnstarted++;
+
+	bAllStarted = (run.FirstUnstarted == targets.size());
+
+	for (size_t i = run.FirstUnstarted; i < targets.size(); i++)
+	{
+		if (!run.Started[i] && run.ActiveJobsPerDisk[targets[i].DiskKey] < run.Options->MaxJobsPerDisk)
+		{
+			run.Started[i] = true;
+			run.ActiveJobsPerDisk[targets[i].DiskKey]++;
+			index = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Logs all the targets not started yet as cancelled, with the last error set by the token. Called with the lock held.
+static void CancelBatchTargets (BatchRun &run)
+{
+	vector <BatchTarget> &targets = *run.Targets;
+	DWORD dwError = GetLastError ();
+
+	for (size_t i = run.FirstUnstarted; i < targets.size() && !run.LogFailed; i++)
+	{
+		if (run.Started[i])
+			continue;
+
+		run.Started[i] = true;
+		targets[i].Result = BATCH_RESULT_CANCELLED;
+		targets[i].LastError = dwError;
+
+		if (!AppendBatchLog (run.Log, targets[i]))
+		{
+			run.LogError = GetLastError ();
+			run.LogFailed = true;
+		}
+	}
+}
+
+static unsigned __stdcall BatchWorkerProc (void *param)
+{
+	BatchRun &run = *(BatchRun *) param;
+
+	for (;;)
+	{
+		size_t index;
+		bool bAllStarted;
+		bool bTaken;
+
+		EnterCriticalSection (&run.Lock);
+
+		// The targets in progress are completed, as they cannot be stopped halfway
+		if (!run.LogFailed && IsCancelled (run.Options->Cancel))
+			CancelBatchTargets (run);
+
+		bTaken = !run.LogFailed && TakeBatchTarget (run, index, bAllStarted);
+		LeaveCriticalSection (&run.Lock);
+
+		if (!bTaken)
+		{
+			if (run.LogFailed || bAllStarted)
+				break;
+
+			// All the disks of the remaining targets are busy
+			WaitForSingleObject (run.SlotFreed, INFINITE);
+			continue;
+		}
+
+		BatchTarget &target = (*run.Targets)[index];
+		IoThrottle throttle (run.Options->DeviceLimits, run.Options->GlobalThrottle);
+		bool bThrottled = run.Options->DeviceLimits.IsLimited() || run.Options->GlobalThrottle;
+
+		RunBatchTarget (target, run.Options->DosDeviceCounterBase + (DWORD) index, run.Options->Transform,
+			bThrottled ? &throttle : NULL, run.Options->LowPriority);
+
+		EnterCriticalSection (&run.Lock);
+
+		run.ActiveJobsPerDisk[target.DiskKey]--;
+
+		if (!run.LogFailed && !AppendBatchLog (run.Log, target))
+		{
+			run.LogError = GetLastError ();
+			run.LogFailed = true;
+		}
+
+		LeaveCriticalSection (&run.Lock);
+
+		SetEvent (run.SlotFreed);
+	}
+
+	// Wakes another waiting worker, which in turn finds that nothing is left
+	SetEvent (run.SlotFreed);
+	return 0;
+}
+
+bool RunBatch (vector <BatchTarget> &targets, const BatchOptions &options, const wchar_t *logPath)
+{
+	BatchRun run;
+	LARGE_INTEGER size;
+	vector <HANDLE> threads;
+
+	run.Log = CreateFileW (logPath, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_FLAG_WRITE_THROUGH, NULL);
+	if (run.Log == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (GetFileSizeEx (run.Log, &size) && size.QuadPart == 0)
+	{
+		const char header[] = "time\ttarget\tpath\texpected\tbefore\tafter\tfilesystem\tresult\terror\tmessage\tduration_ms\n";
+		DWORD written;
+
+		if (!WriteFile (run.Log, header, sizeof (header) - 1, &written, NULL))
+		{
+			DWORD dwError = GetLastError ();
+			CloseHandle (run.Log);
+			SetLastError (dwError);
+			return false;
+		}
+	}
+
+	run.SlotFreed = CreateEventW (NULL, FALSE, FALSE, NULL);
+	if (!run.SlotFreed)
+	{
+		DWORD dwError = GetLastError ();
+		CloseHandle (run.Log);
+		SetLastError (dwError);
+		return false;
+	}
+
+	InitializeCriticalSection (&run.Lock);
+	run.Targets = &targets;
+	run.Options = &options;
+	run.Started.assign (targets.size(), false);
+	run.FirstUnstarted = 0;
+	run.LogFailed = false;
+	run.LogError = ERROR_SUCCESS;
+
+	unsigned int threadCount = max (1U, options.MaxJobs);
+	if (threadCount > targets.size())
+		threadCount = (unsigned int) targets.size();
+
+	// The calling thread is one of the workers
+	for (unsigned int i = 1; i < threadCount; i++)
+	{
+		HANDLE hThread = (HANDLE) _beginthreadex (NULL, 0, BatchWorkerProc, &run, 0, NULL);
+		if (hThread)
+			threads.push_back (hThread);
+	}
+
+	BatchWorkerProc (&run);
+
+	for (vector <HANDLE>::iterator It = threads.begin(); It != threads.end(); It++)
+	{
+		WaitForSingleObject (*It, INFINITE);
+		CloseHandle (*It);
+	}
+
+	DeleteCriticalSection (&run.Lock);
+	CloseHandle (run.SlotFreed);
+	CloseHandle (run.Log);
+
+	if (run.LogFailed)
+	{
+		SetLastError (run.LogError);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,118 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Batch.h : conceal and reveal of many targets listed in a manifest
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Conceal.h"
+#include "Throttle.h"
+
+class CancellationToken;
+
+#define BATCH_DEFAULT_MAX_JOBS				8
+#define BATCH_DEFAULT_MAX_JOBS_PER_DISK		1
+#define BATCH_MAX_JOBS						64
+
+enum BatchResultCode
+{
+	BATCH_RESULT_PENDING,
+	BATCH_RESULT_DONE,
+	BATCH_RESULT_SKIPPED,			// The state of the target is not the expected one, nothing is written
+	BATCH_RESULT_FAILED,
+	BATCH_RESULT_CANCELLED			// The run was cancelled before the target was started, nothing is written
+};
+
+struct BatchTarget
+{
+	BatchTarget ()
+		:
+		AnyState (true),
+		ExpectedState (CONCEAL_STATE_UNKNOWN),
+		IsDevice (false),
+		Result (BATCH_RESULT_PENDING),
+		LastError (ERROR_SUCCESS),
+		StateBefore (CONCEAL_STATE_UNKNOWN),
+		StateAfter (CONCEAL_STATE_UNKNOWN),
+		FileSystem (NULL),
+		DurationMs (0)
+	{
+	}
+
+	// From the manifest
+	std::wstring Target;			// Device path, device identity or image file
+	bool AnyState;
+	ConcealState ExpectedState;
+
+	// Set by ResolveBatchTargets
+	std::wstring Path;				// Device path or image file
+	bool IsDevice;
+	std::wstring DiskKey;			// Targets with the same key are stored on the same disk
+
+	// Set by RunBatch
+	BatchResultCode Result;
+	DWORD LastError;
+	ConcealState StateBefore;
+	ConcealState StateAfter;
+	const wchar_t *FileSystem;
+	double DurationMs;
+	std::vector <ConcealError> Errors;	// Failed operations, the first one stopped the target
+};
+
+struct BatchOptions
+{
+	BatchOptions ()
+		:
+		MaxJobs (BATCH_DEFAULT_MAX_JOBS),
+		MaxJobsPerDisk (BATCH_DEFAULT_MAX_JOBS_PER_DISK),
+		Transform (NULL),
+		DosDeviceCounterBase (0),
+		GlobalThrottle (NULL),
+		LowPriority (false),
+		Cancel (NULL)
+	{
+	}
+
+	unsigned int MaxJobs;
+	unsigned int MaxJobsPerDisk;
+	const ConcealTransform *Transform;
+	DWORD DosDeviceCounterBase;		// One DOS device name is created per device target
+	IoThrottleLimits DeviceLimits;	// Limits of each target
+	IoThrottle *GlobalThrottle;		// Limits shared by all the targets, or NULL
+	bool LowPriority;				// Low I/O priority for the targets
+	const CancellationToken *Cancel;	// Stops the run when cancelled, or NULL
+};
+
+const wchar_t *GetBatchResultName (BatchResultCode result);
+
+// Reads a UTF-8 manifest with one target per line, optionally followed by a tab and the state expected
+// before the operation (visible, concealed, unknown or any). Empty lines and lines starting with # are
+// ignored. On a syntax error, false is returned with ERROR_INVALID_DATA and errorLine is set.
+bool LoadBatchManifest (const wchar_t *path, std::vector <BatchTarget> &targets, size_t &errorLine);
+
+// Locates the targets and determines the disk of each of them. Device identities are resolved from a
+// single enumeration of the devices. Returns false on the first target that cannot be located, whose
+// index is set in errorTarget.
+bool ResolveBatchTargets (std::vector <BatchTarget> &targets, size_t &errorTarget);
+
+// Applies the transformation to a single resolved target, if its state is the expected one. The target
+// is opened exclusively, with dosDeviceCounter naming its DOS device. Sets the fields set by RunBatch.
+// When throttle is not NULL, the transformation waits until the throttle allows each transfer.
+void RunBatchTarget (BatchTarget &target, DWORD dosDeviceCounter, const ConcealTransform *transform,
+	IoThrottle *throttle = NULL, bool bLowPriority = false);
+
+// Applies the transformation to the targets, running up to MaxJobs of them at a time and up to
+// MaxJobsPerDisk on any disk. A target whose state before the operation is not the expected one is
+// skipped. The result of each target is appended to the log (tab separated) as soon as it is known.
+// Once options.Cancel is cancelled, the targets in progress are completed and all the targets not started
+// yet are logged as cancelled.
+// Returns false if the log cannot be opened or written, in which case nothing more is started.
+bool RunBatch (std::vector <BatchTarget> &targets, const BatchOptions &options, const wchar_t *logPath);
@@ -0,0 +1,36 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "BlockDevice.h"
+
+// The offset is passed with the transfer rather than through the file pointer, so that
+// other threads may transfer through the same handle at the same time
+bool HandleBlockDevice::Read (ULONGLONG offset, void *buffer, DWORD size, DWORD &bytesTransferred)
+{
+	OVERLAPPED pos;
+
+	ZeroMemory (&pos, sizeof (pos));
+	pos.Offset = (DWORD) offset;
+	pos.OffsetHigh = (DWORD) (offset >> 32);
+	bytesTransferred = 0;
+
+	return ReadFile (Handle, buffer, size, &bytesTransferred, &pos) != 0;
+}
+
+bool HandleBlockDevice::Write (ULONGLONG offset, const void *buffer, DWORD size, DWORD &bytesTransferred)
+{
+	OVERLAPPED pos;
+
+	ZeroMemory (&pos, sizeof (pos));
+	pos.Offset = (DWORD) offset;
+	pos.OffsetHigh = (DWORD) (offset >> 32);
+	bytesTransferred = 0;
+
+	return WriteFile (Handle, buffer, size, &bytesTransferred, &pos) != 0;
+}
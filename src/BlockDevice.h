@@ -0,0 +1,41 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// BlockDevice.h : positioned transfers to a device, real or simulated
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+class BlockDevice
+{
+public:
+	virtual ~BlockDevice () { }
+
+	// Transfer size bytes at offset. On failure, the last error is set and bytesTransferred
+	// tells how much of the transfer was done, which may be anything for a write.
+	virtual bool Read (ULONGLONG offset, void *buffer, DWORD size, DWORD &bytesTransferred) = 0;
+	virtual bool Write (ULONGLONG offset, const void *buffer, DWORD size, DWORD &bytesTransferred) = 0;
+
+	// Waits before retrying a failed transfer
+	virtual void Pause (DWORD milliseconds) { Sleep (milliseconds); }
+};
+
+// Device or file opened with CreateFile
+class HandleBlockDevice : public BlockDevice
+{
+public:
+	HandleBlockDevice (HANDLE hDev) : Handle (hDev) { }
+
+	virtual bool Read (ULONGLONG offset, void *buffer, DWORD size, DWORD &bytesTransferred);
+	virtual bool Write (ULONGLONG offset, const void *buffer, DWORD size, DWORD &bytesTransferred);
+
+protected:
+	HANDLE Handle;
+};
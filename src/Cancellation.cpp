@@ -0,0 +1,58 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "Cancellation.h"
+
+CancellationToken::CancellationToken ()
+	:
+	Cancelled (FALSE),
+	HasDeadline (false),
+	Deadline (0)
+{
+}
+
+void CancellationToken::Cancel ()
+{
+	InterlockedExchange (&Cancelled, TRUE);
+}
+
+void CancellationToken::SetDeadline (DWORD timeoutMs)
+{
+	LARGE_INTEGER frequency, now;
+
+	QueryPerformanceFrequency (&frequency);
+	QueryPerformanceCounter (&now);
+
+	Deadline = now.QuadPart + (LONGLONG) timeoutMs * frequency.QuadPart / 1000;
+	HasDeadline = true;
+}
+
+bool CancellationToken::IsCancelled () const
+{
+	if (Cancelled)
+	{
+		SetLastError (ERROR_CANCELLED);
+		return true;
+	}
+
+	if (HasDeadline)
+	{
+		LARGE_INTEGER now;
+
+		QueryPerformanceCounter (&now);
+
+		if (now.QuadPart >= Deadline)
+		{
+			SetLastError (ERROR_TIMEOUT);
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,48 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Cancellation.h : cooperative cancellation of long operations, on request or at a deadline
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Shared by an operation and the threads that may stop it. The operation polls the token at the
+// points where it can stop without leaving a device partially processed, and stops there.
+class CancellationToken
+{
+public:
+	CancellationToken ();
+
+	// Requests the operations observing the token to stop. May be called from any thread,
+	// including a console control handler.
+	void Cancel ();
+
+	// Makes the token cancelled once timeoutMs milliseconds have elapsed from now
+	void SetDeadline (DWORD timeoutMs);
+
+	// Returns true if the operations must stop, in which case the last error is set to ERROR_CANCELLED,
+	// or to ERROR_TIMEOUT if the deadline has passed
+	bool IsCancelled () const;
+
+protected:
+	volatile LONG Cancelled;
+	bool HasDeadline;
+	LONGLONG Deadline;				// QueryPerformanceCounter value
+
+private:
+	CancellationToken (const CancellationToken &);
+	CancellationToken &operator= (const CancellationToken &);
+};
+
+// Returns true if cancel is not NULL and cancelled, setting the last error as IsCancelled does
+inline bool IsCancelled (const CancellationToken *cancel)
+{
+	return cancel && cancel->IsCancelled ();
+}
@@ -0,0 +1,81 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <intrin.h>
+#include <nmmintrin.h>
+
+#include "Checksum.h"
+
+#define CRC32C_POLYNOMIAL	0x82F63B78	// Reversed Castagnoli polynomial
+
+static unsigned __int32 Crc32cTable[256];
+static bool Crc32cHardwareSupported = false;
+static volatile bool Crc32cInitialized = false;
+
+// Concurrent first calls may initialize the table more than once, which is harmless
+static void InitCrc32c ()
+{
+	int cpuInfo[4];
+
+	for (unsigned __int32 i = 0; i < 256; i++)
+	{
+		unsigned __int32 crc = i;
+
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLYNOMIAL : 0);
+
+		Crc32cTable[i] = crc;
+	}
+
+	__cpuid (cpuInfo, 1);
+	Crc32cHardwareSupported = (cpuInfo[2] & (1 << 20)) != 0;	// SSE 4.2
+
+	MemoryBarrier ();
+	Crc32cInitialized = true;
+}
+
+unsigned __int32 Crc32c (unsigned __int32 crc, const void *data, size_t size)
+{
+	const BYTE *p = (const BYTE *) data;
+
+	if (!Crc32cInitialized)
+		InitCrc32c ();
+
+	crc = ~crc;
+
+	if (Crc32cHardwareSupported)
+	{
+		while (size > 0 && ((ULONG_PTR) p & 7))
+		{
+			crc = _mm_crc32_u8 (crc, *p++);
+			size--;
+		}
+
+#ifdef _M_X64
+		unsigned __int64 crc64 = crc;
+
+		for (; size >= 8; size -= 8, p += 8)
+			crc64 = _mm_crc32_u64 (crc64, *(const unsigned __int64 *) p);
+
+		crc = (unsigned __int32) crc64;
+#endif
+		for (; size >= 4; size -= 4, p += 4)
+			crc = _mm_crc32_u32 (crc, *(const unsigned __int32 *) p);
+
+		while (size-- > 0)
+			crc = _mm_crc32_u8 (crc, *p++);
+	}
+	else
+	{
+		while (size-- > 0)
+			crc = Crc32cTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
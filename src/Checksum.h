@@ -0,0 +1,18 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Checksum.h : CRC32C (Castagnoli) digests used to verify transformed regions
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Updates a CRC32C digest with the given data (start with crc = 0). The SSE 4.2 CRC32
+// instruction is used when the processor supports it.
+unsigned __int32 Crc32c (unsigned __int32 crc, const void *data, size_t size);
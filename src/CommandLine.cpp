@@ -0,0 +1,1467 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <errno.h>
+#include <limits.h>
+#include <shellapi.h>
+#include <process.h>
+
+#include "CommandLine.h"
+#include "Agent.h"
+#include "Batch.h"
+#include "Cancellation.h"
+#include "Conceal.h"
+#include "ConcealRange.h"
+#include "DeviceId.h"
+#include "DiskSession.h"
+#include "Devices.h"
+#include "ImageFile.h"
+#include "Instrumentation.h"
+#include "Inventory.h"
+#include "PartitionMetadata.h"
+#include "Plan.h"
+#include "Progress.h"
+#include "Throttle.h"
+
+#define EXIT_CODE_SUCCESS		0
+#define EXIT_CODE_FAILURE		1
+#define EXIT_CODE_USAGE			2
+
+// Keeps the DOS device names created by the command line distinct from the GUI ones
+#define COMMAND_LINE_DOS_DEVICE_COUNTER_BASE		(66 * 33)
+
+// Range size meaning up to the end of the device
+#define APPLY_RANGE_SIZE_ALL		((ULONGLONG) -1)
+
+// Interval between two progress lines of /apply /progress (ms)
+#define APPLY_PROGRESS_INTERVAL		1000
+
+#define COMMAND_LINE_MAX_DEADLINE		(7 * 24 * 3600)		// s
+
+static HANDLE StdOutput = INVALID_HANDLE_VALUE;
+static HANDLE StdError = INVALID_HANDLE_VALUE;
+
+// The application is linked for the Windows subsystem, so it only has a console when
+// its output is redirected or when it is attached to the console of its parent
+static void InitConsoleOutput ()
+{
+	StdOutput = GetStdHandle (STD_OUTPUT_HANDLE);
+	StdError = GetStdHandle (STD_ERROR_HANDLE);
+
+	if (StdOutput == NULL)
+		StdOutput = INVALID_HANDLE_VALUE;
+
+	if (StdError == NULL)
+		StdError = INVALID_HANDLE_VALUE;
+
+	if ((StdOutput == INVALID_HANDLE_VALUE || StdError == INVALID_HANDLE_VALUE) && AttachConsole (ATTACH_PARENT_PROCESS))
+	{
+		if (StdOutput == INVALID_HANDLE_VALUE)
+			StdOutput = CreateFileW (L"CONOUT$", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+
+		if (StdError == INVALID_HANDLE_VALUE)
+			StdError = CreateFileW (L"CONOUT$", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	}
+}
+
+// Writes formatted text encoded in UTF-8
+static void FilePrintfV (HANDLE hFile, const wchar_t *format, va_list args)
+{
+	wchar_t line[2048];
+	char utf8[4 * ARRAYSIZE (line)];
+	DWORD written;
+	int len;
+
+	if (hFile == INVALID_HANDLE_VALUE)
+		return;
+
+	StringCchVPrintfW (line, ARRAYSIZE (line), format, args);
+
+	len = WideCharToMultiByte (CP_UTF8, 0, line, -1, utf8, sizeof (utf8), NULL, NULL);
+	if (len > 1)
+		WriteFile (hFile, utf8, len - 1, &written, NULL);
+}
+
+static void FilePrintf (HANDLE hFile, const wchar_t *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	FilePrintfV (hFile, format, args);
+	va_end (args);
+}
+
+static void ConsolePrintf (const wchar_t *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	FilePrintfV (StdOutput, format, args);
+	va_end (args);
+}
+
+static void PrintUsage ()
+{
+	ConsolePrintf (
+		L"Usage: ConcealDrive [command]\n"
+		L"\n"
+		L"Without a command, the graphical user interface is displayed.\n"
+		L"\n"
+		L"Commands:\n"
+		L"  /status <image> [<image> ...]   Display the conceal state of disk image files.\n"
+		L"                                  Wildcards are accepted in file names.\n"
+		L"  /apply <device> [<device> ...]  Apply the XOR transformation to partitions, given as\n"
+		L"                                  \\Device\\HarddiskN\\PartitionM or as a stable identity\n"
+		L"                                  listed by /export (partition:gpt:{GUID}...). Options:\n"
+		L"      /verify                     Read back each transformed region, bypassing the cache.\n"
+		L"      /manifest <file>            Append the CRC32C digests of the regions to a manifest.\n"
+		L"      /size <bytes>|all           Transform this many bytes (K, M, G and T suffixes are\n"
+		L"                                  accepted) instead of the first 8 KB, or the whole device.\n"
+		L"      /offset <bytes>             Start of the transformed range (0 by default).\n"
+		L"      /checkpoint <file>          Make the transform of a range resumable: an interrupted run\n"
+		L"                                  resumes where it stopped when run again with this file.\n"
+		L"      /interval <bytes>           Amount of data transformed between checkpoints (16M).\n"
+		L"      /progress                   Display the bytes of each range transformed so far and\n"
+		L"                                  the throughput, every second.\n"
+		L"      Throttle options (see below) are accepted.\n"
+		L"  /plan [<target> ...] [/verify]  Display what /apply would do to partitions or image files\n"
+		L"                                  and estimate its cost, without writing anything. All the\n"
+		L"                                  partitions of the system are planned if none is given.\n"
+		L"                                  /size and /offset plan a range as /apply transforms it.\n"
+		L"  /export json|csv [<file>]       Export the disks, partitions and volumes of the system with\n"
+		L"                                  their extents, filesystem and conceal state.\n"
+		L"  /stats                          Enumerate the devices and volumes and display the time,\n"
+		L"                                  allocations and I/O controls of each enumeration.\n"
+		L"  /batch <manifest> /log <file>   Transform the partitions and image files listed in a manifest,\n"
+		L"                                  one per line, optionally followed by a tab and the state\n"
+		L"                                  expected before the transform. Results are appended to the log.\n"
+		L"      /jobs <count>               Number of targets transformed at a time (8).\n"
+		L"      /perdisk <count>            Number of targets of the same disk transformed at a time (1).\n"
+		L"      Throttle options (see below) are accepted.\n"
+		L"  /agent                          Stay resident and serve list, status, conceal, reveal and stop\n"
+		L"                                  requests of local administrators on the named pipe\n"
+		L"                                  \\\\.\\pipe\\ConcealDriveAgent, keeping the device list up to date.\n"
+		L"      /workers <count>            Number of requests processed at a time (8, up to 16).\n"
+		L"  /metadata conceal|reveal <device> [<device> ...]\n"
+		L"                                  Hide or reveal partitions in the partition table of their\n"
+		L"                                  disk (GPT attributes or MBR partition type) without writing\n"
+		L"                                  their data. Each disk table is written once for all its\n"
+		L"                                  partitions; Windows applies it when the volumes are mounted.\n"
+		L"\n"
+		L"Transform options of /status, /apply, /plan, /export, /batch and /agent (XOR with 0xFF by default):\n"
+		L"      /pattern <hex>              XOR with a repeating pattern of 1 to 64 bytes.\n"
+		L"      /key <hex>                  XOR with a ChaCha20 keystream keyed with 32 bytes, each\n"
+		L"                                  partition or image file having its own keystream.\n"
+		L"\n"
+		L"Throttle options of /apply and /batch (no limit by default):\n"
+		L"      /maxbps <bytes>             Bytes read and written per second on each device.\n"
+		L"      /maxiops <count>            Reads and writes per second on each device.\n"
+		L"      /totalbps <bytes>           Bytes read and written per second on all the devices.\n"
+		L"      /totaliops <count>          Reads and writes per second on all the devices.\n"
+		L"      /background                 Low I/O priority, yielding to the other I/O of the disks\n"
+		L"                                  (Windows Vista and later).\n"
+		L"\n"
+		L"Cancellation options of /apply, /plan, /export and /batch:\n"
+		L"      /deadline <seconds>         Stop at the next safe point once this time has elapsed, as\n"
+		L"                                  Ctrl+C does: a range stops between two batches (resumable\n"
+		L"                                  with its checkpoint), a batch after the targets in progress.\n");
+}
+
+// Parses an even number of hexadecimal digits
+static bool ParseHexArgument (const wchar_t *arg, BYTE *data, size_t maxSize, size_t &size)
+{
+	size_t len = wcslen (arg);
+
+	if (len == 0 || (len % 2) != 0 || len / 2 > maxSize)
+		return false;
+
+	for (size = 0; size < len / 2; size++)
+	{
+		int value = 0;
+
+		for (int i = 0; i < 2; i++)
+		{
+			wchar_t c = arg[size * 2 + i];
+
+			if (c >= L'0' && c <= L'9')
+				value = (value << 4) | (c - L'0');
+			else if (c >= L'a' && c <= L'f')
+				value = (value << 4) | (c - L'a' + 10);
+			else if (c >= L'A' && c <= L'F')
+				value = (value << 4) | (c - L'A' + 10);
+			else
+				return false;
+		}
+
+		data[size] = (BYTE) value;
+	}
+
+	return true;
+}
+
+// Parses a number of bytes with an optional binary K, M, G or T suffix
+static bool ParseSizeArgument (const wchar_t *arg, ULONGLONG &size)
+{
+	wchar_t *end;
+	int shift = 0;
+
+	if (*arg < L'0' || *arg > L'9')
+		return false;
+
+	errno = 0;
+	size = _wcstoui64 (arg, &end, 10);
+
+	if (errno == ERANGE)
+		return false;
+
+	switch (towupper (*end))
+	{
+	case L'T': shift += 10;
+		// fall through
+	case L'G': shift += 10;
+		// fall through
+	case L'M': shift += 10;
+		// fall through
+	case L'K': shift += 10; end++; break;
+	}
+
+	// A size that does not fit is rejected rather than wrapped to another range
+	if (size > (ULLONG_MAX >> shift))
+		return false;
+
+	size <<= shift;
+	return *end == 0;
+}
+
+static bool ParseCountArgument (const wchar_t *arg, unsigned int maxCount, unsigned int &count)
+{
+	wchar_t *end;
+
+	if (*arg < L'0' || *arg > L'9')
+		return false;
+
+	unsigned long value = wcstoul (arg, &end, 10);
+	if (*end != 0 || value == 0 || value > maxCount)
+		return false;
+
+	count = (unsigned int) value;
+	return true;
+}
+
+static bool IsTransformOption (const wchar_t *arg)
+{
+	return _wcsicmp (arg, L"/key") == 0 || _wcsicmp (arg, L"/pattern") == 0;
+}
+
+static bool ParseTransformOption (const wchar_t *option, const wchar_t *value, ConcealTransform &transform)
+{
+	size_t size;
+
+	if (_wcsicmp (option, L"/key") == 0)
+	{
+		if (!ParseHexArgument (value, transform.Key, sizeof (transform.Key), size) || size != sizeof (transform.Key))
+			return false;
+
+		transform.Mode = CONCEAL_TRANSFORM_KEYSTREAM;
+		return true;
+	}
+
+	if (!ParseHexArgument (value, transform.Pattern, sizeof (transform.Pattern), size))
+		return false;
+
+	transform.PatternSize = size;
+	transform.Mode = CONCEAL_TRANSFORM_PATTERN;
+	return true;
+}
+
+static bool IsThrottleOption (const wchar_t *arg)
+{
+	return _wcsicmp (arg, L"/maxbps") == 0 || _wcsicmp (arg, L"/maxiops") == 0
+		|| _wcsicmp (arg, L"/totalbps") == 0 || _wcsicmp (arg, L"/totaliops") == 0;
+}
+
+static bool ParseThrottleOption (const wchar_t *option, const wchar_t *value, IoThrottleLimits &deviceLimits, IoThrottleLimits &totalLimits)
+{
+	IoThrottleLimits &limits = (_wcsnicmp (option, L"/max", 4) == 0) ? deviceLimits : totalLimits;
+	ULONGLONG *limit = (_wcsicmp (option + wcslen (option) - 3, L"bps") == 0) ? &limits.BytesPerSecond : &limits.OperationsPerSecond;
+
+	return ParseSizeArgument (value, *limit) && *limit != 0;
+}
+
+// Cancelled by Ctrl+C or at the /deadline of the command, for the commands that can stop at a safe point
+static CancellationToken CommandCancellation;
+
+static BOOL WINAPI CommandConsoleCtrlHandler (DWORD ctrlType)
+{
+	// The process is not terminated, so that the operations in progress stop where they can be resumed
+	CommandCancellation.Cancel ();
+	return TRUE;
+}
+
+static void EnableCommandCancellation ()
+{
+	SetConsoleCtrlHandler (CommandConsoleCtrlHandler, TRUE);
+}
+
+// Parses the number of seconds left to the command from now
+static bool ParseDeadlineArgument (const wchar_t *arg)
+{
+	unsigned int seconds;
+
+	if (!ParseCountArgument (arg, COMMAND_LINE_MAX_DEADLINE, seconds))
+		return false;
+
+	CommandCancellation.SetDeadline (seconds * 1000);
+	return true;
+}
+
+// Appends the files matching a path that may contain wildcards
+static void ExpandPathArgument (const wchar_t *arg, vector <wstring> &paths)
+{
+	WIN32_FIND_DATAW findData;
+	HANDLE hFind;
+
+	if (!wcspbrk (arg, L"*?"))
+	{
+		paths.push_back (arg);
+		return;
+	}
+
+	wstring dir (arg);
+	size_t sep = dir.find_last_of (L"\\/:");
+	dir = (sep == wstring::npos) ? L"" : dir.substr (0, sep + 1);
+
+	hFind = FindFirstFileW (arg, &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			paths.push_back (dir + findData.cFileName);
+	}
+	while (FindNextFileW (hFind, &findData));
+
+	FindClose (hFind);
+}
+
+// Locates the device having a stable identity. The devices are enumerated on the first call
+// only, so that the identities of all the targets are resolved from the same inventory.
+static bool ResolveDeviceArgument (const wchar_t *id, DeviceIdResolver &resolver, bool &bResolverReady, wstring &path)
+{
+	if (!bResolverReady)
+	{
+		resolver.SetDevices (GetAvailableHostDevices ());
+		bResolverReady = true;
+	}
+
+	const HostDevice *device = resolver.Resolve (id);
+	if (!device)
+	{
+		ConsolePrintf (L"%s\terror\t0x%.8X\n", id, GetLastError ());
+		return false;
+	}
+
+	path = device->Path;
+	return true;
+}
+
+static int StatusCommand (int argc, wchar_t **argv)
+{
+	vector <wstring> paths;
+	ConcealTransform transform;
+	int exitCode = EXIT_CODE_SUCCESS;
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (IsTransformOption (argv[i]) && i + 1 < argc)
+		{
+			if (!ParseTransformOption (argv[i], argv[++i], transform))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else
+			ExpandPathArgument (argv[i], paths);
+	}
+
+	if (paths.empty())
+	{
+		PrintUsage ();
+		return EXIT_CODE_USAGE;
+	}
+
+	for (vector <wstring>::const_iterator It = paths.begin(); It != paths.end(); It++)
+	{
+		ConcealState state;
+		const wchar_t *fileSystemName;
+
+		if (GetImageConcealState (It->c_str(), state, &fileSystemName, &transform))
+			ConsolePrintf (L"%s\t%s\t%s\n", It->c_str(), GetConcealStateName (state), fileSystemName ? fileSystemName : L"-");
+		else
+		{
+			ConsolePrintf (L"%s\terror\t0x%.8X\n", It->c_str(), GetLastError ());
+			exitCode = EXIT_CODE_FAILURE;
+		}
+	}
+
+	return exitCode;
+}
+
+// Progress of a range, posted by its job and displayed by the main thread
+struct ApplyProgress
+{
+	ApplyProgress () : Received (false) { }
+
+	ProgressRing Ring;
+	bool Received;
+	ProgressEvent Last;					// Last event read from the ring
+	ProgressEvent Displayed;			// Event of the last progress line
+};
+
+struct ApplyJob
+{
+	wstring Device;
+	DWORD DosDeviceCounter;
+	bool Verify;
+	const ConcealTransform *Transform;
+	ULONGLONG RangeOffset;
+	ULONGLONG RangeSize;				// 0 for the initial NTFS conceal portion
+	const wchar_t *CheckpointPath;
+	ULONGLONG CheckpointInterval;
+	IoThrottleLimits Limits;
+	IoThrottle *GlobalThrottle;
+	bool LowPriority;
+	ApplyProgress *Progress;			// NULL if the progress of the job is not displayed
+	const CancellationToken *Cancel;
+	bool Success;
+	DWORD LastError;
+	bool HadFileSystemBefore;
+	bool HasFileSystemNow;
+	ConcealVerification Verification;
+	ConcealRangeResult RangeResult;
+	vector <ConcealError> Errors;
+};
+
+static const wchar_t *GetApplyActionName (const ApplyJob &job)
+{
+	if (job.HadFileSystemBefore)
+		return L"concealed";
+	else if (job.HasFileSystemNow)
+		return L"restored";
+	else
+		return L"applied";
+}
+
+// Each device is processed by its own thread so that the read, write and read back
+// of one device overlap with those of the others
+static unsigned __stdcall ApplyThreadProc (void *param)
+{
+	ApplyJob *job = (ApplyJob *) param;
+	WCHAR dosDev[MAX_PATH] = {0};
+	WCHAR devName[MAX_PATH] = {0};
+	ErrorCollector errors (job->Device.c_str());
+	IoThrottle deviceThrottle (job->Limits, job->GlobalThrottle);
+	IoThrottle *throttle = (job->Limits.IsLimited() || job->GlobalThrottle) ? &deviceThrottle : NULL;
+	ConcealTransform transform;
+
+	job->Success = false;
+	job->HadFileSystemBefore = false;
+	job->HasFileSystemNow = false;
+	memset (&job->Verification, 0, sizeof (job->Verification));
+
+	if (!GetDeviceTransform (job->Device.c_str(), job->Transform, transform))
+	{
+		ReportLastError (&errors, L"identify", NULL);
+		job->LastError = GetLastError ();
+		job->Errors = errors.GetErrors ();
+		return 0;
+	}
+
+	if (!FakeDosNameForDevice (job->DosDeviceCounter, job->Device.c_str(), dosDev, sizeof (dosDev), devName, sizeof (devName), FALSE))
+	{
+		ReportLastError (&errors, L"define device name", NULL);
+		job->LastError = GetLastError ();
+		job->Errors = errors.GetErrors ();
+		return 0;
+	}
+
+	// Ranges are streamed through page aligned buffers, bypassing the system cache, and made stable
+	// by the flushes of ConcealRange rather than by writing each block through
+	HANDLE dev = OpenPartitionVolume (&errors, devName, job->Verify || job->RangeSize != 0, job->RangeSize == 0);
+	if (dev != INVALID_HANDLE_VALUE)
+	{
+		DISK_GEOMETRY driveGeometry;
+		DWORD dwResult;
+		ULONGLONG deviceLength;
+
+		// Only a hint, which older systems do not support
+		if (job->LowPriority)
+			SetLowIoPriority (dev);
+
+		if (!DeviceIoControl (dev, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &driveGeometry, sizeof (driveGeometry), &dwResult, NULL))
+			ReportLastError (&errors, L"get geometry", NULL);
+		else
+		{
+			if (job->RangeSize == 0)
+			{
+				HandleBlockDevice device (dev);
+				ThrottledBlockDevice throttledDevice (device, throttle);
+
+				job->Success = ConcealNTFS (throttledDevice, job->HadFileSystemBefore, job->HasFileSystemNow, job->Verify ? &job->Verification : NULL, &transform, &errors);
+			}
+			else if (!GetDeviceLength (dev, deviceLength))
+				ReportLastError (&errors, L"get length", NULL);
+			else if (job->RangeOffset > deviceLength
+				|| (job->RangeSize != APPLY_RANGE_SIZE_ALL && job->RangeSize > deviceLength - job->RangeOffset))
+			{
+				// Checked before anything is written, so that the device is not left partly transformed
+				SetLastError (ERROR_HANDLE_EOF);
+				ReportLastError (&errors, L"check range", NULL, job->RangeOffset, L"The range extends beyond the end of the device.");
+			}
+			else
+			{
+				ULONGLONG rangeSize = job->RangeSize;
+
+				if (rangeSize == APPLY_RANGE_SIZE_ALL)
+					rangeSize = (deviceLength - job->RangeOffset) / CONCEAL_RANGE_ALIGNMENT * CONCEAL_RANGE_ALIGNMENT;
+
+				job->Success = ConcealRange (dev, job->RangeOffset, rangeSize, &transform, job->CheckpointPath, job->CheckpointInterval, job->RangeResult, &errors, throttle,
+					job->Progress ? &job->Progress->Ring : NULL, job->Cancel);
+				job->HadFileSystemBefore = job->RangeResult.HadFileSystemBefore;
+				job->HasFileSystemNow = job->RangeResult.HasFileSystemNow;
+			}
+		}
+
+		job->LastError = job->Success ? ERROR_SUCCESS : GetLastError ();
+		CloseHandle (dev);
+	}
+	else
+		job->LastError = GetLastError ();
+
+	DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, job->Device.c_str());
+	job->Errors = errors.GetErrors ();
+	return 0;
+}
+
+// Jobs transforming the headers of several partitions of the same disk
+struct ApplyDiskSession
+{
+	DWORD DiskNumber;
+	DWORD DosDeviceCounter;
+	vector <ApplyJob *> Jobs;
+};
+
+// The partitions are transformed in one session, so that the disk is locked and swept once
+static unsigned __stdcall ApplyDiskSessionThreadProc (void *param)
+{
+	ApplyDiskSession *session = (ApplyDiskSession *) param;
+	const ApplyJob &first = *session->Jobs.front();
+	IoThrottle throttle (first.Limits, first.GlobalThrottle);
+	vector <DiskSessionTarget> targets (session->Jobs.size());
+	size_t i;
+
+	for (i = 0; i < session->Jobs.size(); i++)
+	{
+		targets[i].Path = session->Jobs[i]->Device;
+		targets[i].DosDeviceCounter = session->Jobs[i]->DosDeviceCounter;
+	}
+
+	RunDiskSession (session->DiskNumber, session->DosDeviceCounter, targets, first.Transform, first.Verify,
+		(first.Limits.IsLimited() || first.GlobalThrottle) ? &throttle : NULL, first.LowPriority);
+
+	for (i = 0; i < session->Jobs.size(); i++)
+	{
+		ApplyJob &job = *session->Jobs[i];
+
+		job.Success = targets[i].Success;
+		job.LastError = targets[i].LastError;
+		job.HadFileSystemBefore = targets[i].HadFileSystemBefore;
+		job.HasFileSystemNow = targets[i].HasFileSystemNow;
+		job.Verification = targets[i].Verification;
+		job.Errors = targets[i].Errors;
+	}
+
+	return 0;
+}
+
+static bool AppendManifest (const wchar_t *path, const vector <ApplyJob> &jobs)
+{
+	HANDLE hFile = CreateFileW (path, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+	SYSTEMTIME now;
+
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (GetFileSizeEx (hFile, &size) && size.QuadPart == 0)
+		FilePrintf (hFile, L"time\tdevice\taction\tcrc32c_before\tcrc32c_after\tcrc32c_read_back\tresult\n");
+
+	GetSystemTime (&now);
+
+	for (vector <ApplyJob>::const_iterator It = jobs.begin(); It != jobs.end(); It++)
+	{
+		wchar_t result[32];
+
+		if (It->Success)
+			StringCbCopyW (result, sizeof (result), It->Verify ? L"verified" : L"not verified");
+		else if (It->LastError == ERROR_CRC && It->Verify)
+			StringCbCopyW (result, sizeof (result), L"mismatch");
+		else
+			StringCbPrintfW (result, sizeof (result), L"error 0x%.8X", It->LastError);
+
+		FilePrintf (hFile, L"%04d-%02d-%02dT%02d:%02d:%02dZ\t%s\t%s\t%.8X\t%.8X\t%.8X\t%s\n",
+			now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond,
+			It->Device.c_str(), It->Success || It->LastError == ERROR_CRC ? GetApplyActionName (*It) : L"-",
+			It->Verification.BeforeDigest, It->Verification.AfterDigest, It->Verification.ReadBackDigest, result);
+	}
+
+	CloseHandle (hFile);
+	return true;
+}
+
+// Displays a line for each job that advanced since the last call, with its throughput over that interval.
+// The events are read from the rings of the jobs, so that displaying them never holds up a job.
+static void PrintApplyProgress (vector <ApplyJob> &jobs)
+{
+	for (vector <ApplyJob>::iterator It = jobs.begin(); It != jobs.end(); It++)
+	{
+		ApplyProgress *progress = It->Progress;
+		ProgressEvent event;
+		bool bAdvanced = false;
+
+		if (!progress)
+			continue;
+
+		while (progress->Ring.Read (event))
+		{
+			if (!progress->Received)
+			{
+				progress->Displayed = event;
+				progress->Received = true;
+			}
+
+			progress->Last = event;
+			bAdvanced = true;
+		}
+
+		if (!bAdvanced)
+			continue;
+
+		ConsolePrintf (L"%s\tprogress\t%I64u\t%I64u\t%.1f MB/s\n", It->Device.c_str(), progress->Last.Completed, progress->Last.Total,
+			GetProgressThroughput (progress->Displayed, progress->Last) / (1024 * 1024));
+
+		progress->Displayed = progress->Last;
+	}
+}
+
+static int ApplyCommand (int argc, wchar_t **argv)
+{
+	vector <ApplyJob> jobs;
+	vector <ApplyDiskSession> sessions;
+	map <DWORD, vector <ApplyJob *> > diskJobs;
+	vector <ApplyJob *> singleJobs;
+	vector <HANDLE> threads;
+	DeviceIdResolver resolver;
+	bool bResolverReady = false;
+	ConcealTransform transform;
+	const wchar_t *manifestPath = NULL;
+	const wchar_t *checkpointPath = NULL;
+	ULONGLONG rangeOffset = 0, rangeSize = 0, checkpointInterval = 0;
+	IoThrottleLimits deviceLimits, totalLimits;
+	ApplyProgress *progress = NULL;
+	bool bVerify = false;
+	bool bLowPriority = false;
+	bool bProgress = false;
+	int exitCode = EXIT_CODE_SUCCESS;
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (_wcsicmp (argv[i], L"/verify") == 0)
+			bVerify = true;
+		else if (_wcsicmp (argv[i], L"/background") == 0)
+			bLowPriority = true;
+		else if (_wcsicmp (argv[i], L"/progress") == 0)
+			bProgress = true;
+		else if (_wcsicmp (argv[i], L"/deadline") == 0 && i + 1 < argc)
+		{
+			if (!ParseDeadlineArgument (argv[++i]))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (_wcsicmp (argv[i], L"/manifest") == 0 && i + 1 < argc)
+			manifestPath = argv[++i];
+		else if (_wcsicmp (argv[i], L"/checkpoint") == 0 && i + 1 < argc)
+			checkpointPath = argv[++i];
+		else if (_wcsicmp (argv[i], L"/size") == 0 && i + 1 < argc)
+		{
+			if (_wcsicmp (argv[++i], L"all") == 0)
+				rangeSize = APPLY_RANGE_SIZE_ALL;
+			else if (!ParseSizeArgument (argv[i], rangeSize) || rangeSize == 0 || (rangeSize % CONCEAL_RANGE_ALIGNMENT) != 0)
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if ((_wcsicmp (argv[i], L"/offset") == 0 || _wcsicmp (argv[i], L"/interval") == 0) && i + 1 < argc)
+		{
+			ULONGLONG *value = (_wcsicmp (argv[i], L"/offset") == 0) ? &rangeOffset : &checkpointInterval;
+
+			if (!ParseSizeArgument (argv[++i], *value) || (value == &rangeOffset && (rangeOffset % CONCEAL_RANGE_ALIGNMENT) != 0))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (IsTransformOption (argv[i]) && i + 1 < argc)
+		{
+			if (!ParseTransformOption (argv[i], argv[++i], transform))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (IsThrottleOption (argv[i]) && i + 1 < argc)
+		{
+			if (!ParseThrottleOption (argv[i], argv[++i], deviceLimits, totalLimits))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (IsHarddiskDevicePath (argv[i]) || IsDeviceId (argv[i]))
+		{
+			ApplyJob job;
+
+			// Nothing is written if a target cannot be located
+			if (!IsDeviceId (argv[i]))
+				job.Device = argv[i];
+			else if (!ResolveDeviceArgument (argv[i], resolver, bResolverReady, job.Device))
+				return EXIT_CODE_FAILURE;
+
+			job.DosDeviceCounter = COMMAND_LINE_DOS_DEVICE_COUNTER_BASE + (DWORD) jobs.size();
+			jobs.push_back (job);
+		}
+		else
+		{
+			PrintUsage ();
+			return EXIT_CODE_USAGE;
+		}
+	}
+
+	// Ranges are verified through their checkpoint digests rather than read back, and a
+	// checkpoint file describes the range of a single device
+	if (jobs.empty()
+		|| (rangeSize == 0 && (rangeOffset != 0 || checkpointPath || checkpointInterval != 0))
+		|| (rangeSize != 0 && bVerify)
+		|| (rangeSize == 0 && bProgress)
+		|| (checkpointPath && jobs.size() > 1))
+	{
+		PrintUsage ();
+		return EXIT_CODE_USAGE;
+	}
+
+	IoThrottle globalThrottle (totalLimits);
+
+	EnableCommandCancellation ();
+
+	// Headers are transformed with a single write, so only ranges report their progress
+	if (bProgress)
+		progress = new ApplyProgress[jobs.size()];
+
+	for (vector <ApplyJob>::iterator It = jobs.begin(); It != jobs.end(); It++)
+	{
+		It->Verify = bVerify;
+		It->Transform = &transform;
+		It->RangeOffset = rangeOffset;
+		It->RangeSize = rangeSize;
+		It->CheckpointPath = checkpointPath;
+		It->CheckpointInterval = checkpointInterval;
+		It->Limits = deviceLimits;
+		It->GlobalThrottle = totalLimits.IsLimited() ? &globalThrottle : NULL;
+		It->LowPriority = bLowPriority;
+		It->Progress = progress ? &progress[It - jobs.begin()] : NULL;
+		It->Cancel = &CommandCancellation;
+
+		DWORD diskNumber, partitionNumber;
+
+		if (rangeSize == 0 && ParsePartitionPath (It->Device.c_str(), diskNumber, partitionNumber))
+			diskJobs[diskNumber].push_back (&*It);
+		else
+			singleJobs.push_back (&*It);
+	}
+
+	// The headers of the partitions of a disk are transformed in a single session
+	for (map <DWORD, vector <ApplyJob *> >::const_iterator It = diskJobs.begin(); It != diskJobs.end(); It++)
+	{
+		if (It->second.size() == 1)
+			singleJobs.push_back (It->second.front());
+		else
+		{
+			ApplyDiskSession session;
+
+			session.DiskNumber = It->first;
+			session.DosDeviceCounter = COMMAND_LINE_DOS_DEVICE_COUNTER_BASE + (DWORD) (jobs.size() + sessions.size());
+			session.Jobs = It->second;
+			sessions.push_back (session);
+		}
+	}
+
+	for (vector <ApplyDiskSession>::iterator It = sessions.begin(); It != sessions.end(); It++)
+	{
+		HANDLE hThread = (HANDLE) _beginthreadex (NULL, 0, ApplyDiskSessionThreadProc, &*It, 0, NULL);
+		if (hThread)
+			threads.push_back (hThread);
+		else
+			ApplyDiskSessionThreadProc (&*It);
+	}
+
+	for (vector <ApplyJob *>::iterator It = singleJobs.begin(); It != singleJobs.end(); It++)
+	{
+		HANDLE hThread = (HANDLE) _beginthreadex (NULL, 0, ApplyThreadProc, *It, 0, NULL);
+		if (hThread)
+			threads.push_back (hThread);
+		else
+			ApplyThreadProc (*It);
+	}
+
+	for (vector <HANDLE>::iterator It = threads.begin(); It != threads.end(); It++)
+	{
+		while (WaitForSingleObject (*It, progress ? APPLY_PROGRESS_INTERVAL : INFINITE) == WAIT_TIMEOUT)
+			PrintApplyProgress (jobs);
+
+		CloseHandle (*It);
+	}
+
+	// The events posted after the last wait timed out, up to the completion of each target,
+	// and those of the targets run without a thread of their own
+	if (progress)
+		PrintApplyProgress (jobs);
+
+	for (vector <ApplyJob>::const_iterator It = jobs.begin(); It != jobs.end(); It++)
+	{
+		if (It->Success)
+		{
+			if (It->RangeResult.Resumed)
+				ConsolePrintf (L"%s\t%s\tresumed at %I64u\n", It->Device.c_str(), GetApplyActionName (*It), It->RangeResult.ResumedOffset);
+			else
+				ConsolePrintf (L"%s\t%s\t%s\n", It->Device.c_str(), GetApplyActionName (*It), It->Verify ? L"verified" : L"-");
+		}
+		else
+		{
+			wchar_t errorText[1024] = L"-";
+
+			// The first error reported is the one that stopped the job
+			if (!It->Errors.empty())
+				FormatConcealError (It->Errors.front(), errorText, ARRAYSIZE (errorText));
+
+			// Everything before the completed offset of a range is transformed, the rest is untouched
+			if (It->RangeSize != 0)
+				ConsolePrintf (L"%s\terror\t0x%.8X\tcompleted up to %I64u\t%s\n", It->Device.c_str(), It->LastError, It->RangeResult.CompletedOffset, errorText);
+			else
+				ConsolePrintf (L"%s\terror\t0x%.8X\t%s\n", It->Device.c_str(), It->LastError, errorText);
+
+			exitCode = EXIT_CODE_FAILURE;
+		}
+	}
+
+	if (manifestPath && !AppendManifest (manifestPath, jobs))
+	{
+		ConsolePrintf (L"%s\terror\t0x%.8X\n", manifestPath, GetLastError ());
+		exitCode = EXIT_CODE_FAILURE;
+	}
+
+	delete [] progress;
+	return exitCode;
+}
+
+static int PlanCommand (int argc, wchar_t **argv)
+{
+	vector <wstring> targets;
+	DeviceIdResolver resolver;
+	bool bResolverReady = false;
+	ConcealTransform transform;
+	bool bVerify = false;
+	bool bTargetGiven = false;
+	int exitCode = EXIT_CODE_SUCCESS;
+	ULONGLONG rangeOffset = 0, rangeSize = 0;
+	ULONGLONG totalRead = 0, totalWritten = 0;
+	double totalMs = 0;
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (_wcsicmp (argv[i], L"/verify") == 0)
+			bVerify = true;
+		else if (_wcsicmp (argv[i], L"/size") == 0 && i + 1 < argc)
+		{
+			if (_wcsicmp (argv[++i], L"all") == 0)
+				rangeSize = PLAN_RANGE_SIZE_ALL;
+			else if (!ParseSizeArgument (argv[i], rangeSize) || rangeSize == 0 || (rangeSize % CONCEAL_RANGE_ALIGNMENT) != 0)
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (_wcsicmp (argv[i], L"/offset") == 0 && i + 1 < argc)
+		{
+			if (!ParseSizeArgument (argv[++i], rangeOffset) || (rangeOffset % CONCEAL_RANGE_ALIGNMENT) != 0)
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (_wcsicmp (argv[i], L"/deadline") == 0 && i + 1 < argc)
+		{
+			if (!ParseDeadlineArgument (argv[++i]))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (IsTransformOption (argv[i]) && i + 1 < argc)
+		{
+			if (!ParseTransformOption (argv[i], argv[++i], transform))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else
+		{
+			bTargetGiven = true;
+
+			if (IsHarddiskDevicePath (argv[i]))
+				targets.push_back (argv[i]);
+			else if (IsDeviceId (argv[i]))
+			{
+				wstring path;
+
+				if (!ResolveDeviceArgument (argv[i], resolver, bResolverReady, path))
+					return EXIT_CODE_FAILURE;
+
+				targets.push_back (path);
+			}
+			else
+				ExpandPathArgument (argv[i], targets);
+		}
+	}
+
+	// Planned with the same options as /apply
+	if ((rangeSize == 0 && rangeOffset != 0) || (rangeSize != 0 && bVerify))
+	{
+		PrintUsage ();
+		return EXIT_CODE_USAGE;
+	}
+
+	EnableCommandCancellation ();
+
+	if (!bTargetGiven)
+	{
+		vector <HostDevice> devices = GetAvailableHostDevices (&CommandCancellation);
+
+		// A partial list would be taken for all the partitions of the system
+		if (IsCancelled (&CommandCancellation))
+		{
+			ConsolePrintf (L"devices\terror\t0x%.8X\n", GetLastError ());
+			return EXIT_CODE_FAILURE;
+		}
+
+		for (vector <HostDevice>::const_iterator It = devices.begin(); It != devices.end(); It++)
+		{
+			if (It->IsPartition && It->Size != 0)
+				targets.push_back (It->Path);
+		}
+	}
+
+	ConsolePrintf (L"target\tfilesystem\tstate\taction\tread_bytes\twrite_bytes\tlatency_ms\testimated_ms\n");
+
+	// Targets are probed one after the other so that the measured latencies are not skewed
+	// by concurrent probes of partitions of the same disk
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		PlanEntry entry;
+
+		// The targets left are listed as not planned
+		if (IsCancelled (&CommandCancellation))
+		{
+			ConsolePrintf (L"%s\terror\t0x%.8X\n", targets[i].c_str(), GetLastError ());
+			exitCode = EXIT_CODE_FAILURE;
+			continue;
+		}
+
+		if (PlanConcealTarget (targets[i].c_str(), COMMAND_LINE_DOS_DEVICE_COUNTER_BASE + (DWORD) i, bVerify, rangeOffset, rangeSize, &transform, entry))
+		{
+			ConsolePrintf (L"%s\t%s\t%s\t%s\t%I64u\t%I64u\t%.3f\t%.3f\n", entry.Target.c_str(),
+				entry.FileSystem ? entry.FileSystem : L"-", GetConcealStateName (entry.State), GetConcealActionName (entry.Action),
+				entry.BytesToRead, entry.BytesToWrite, entry.LatencyMs, entry.EstimatedMs);
+
+			totalRead += entry.BytesToRead;
+			totalWritten += entry.BytesToWrite;
+			totalMs += entry.EstimatedMs;
+		}
+		else
+		{
+			ConsolePrintf (L"%s\terror\t0x%.8X\n", entry.Target.c_str(), entry.LastError);
+			exitCode = EXIT_CODE_FAILURE;
+		}
+	}
+
+	ConsolePrintf (L"total\t-\t-\t-\t%I64u\t%I64u\t-\t%.3f\n", totalRead, totalWritten, totalMs);
+
+	return exitCode;
+}
+
+static int ExportCommand (int argc, wchar_t **argv)
+{
+	InventoryFormat format;
+	ConcealTransform transform;
+	const wchar_t *outputPath = NULL;
+	HANDLE hOutput = StdOutput;
+	HANDLE hDiagnostics;
+	int exitCode = EXIT_CODE_SUCCESS;
+
+	if (argc < 1)
+	{
+		PrintUsage ();
+		return EXIT_CODE_USAGE;
+	}
+
+	if (_wcsicmp (argv[0], L"json") == 0)
+		format = INVENTORY_FORMAT_JSON;
+	else if (_wcsicmp (argv[0], L"csv") == 0)
+		format = INVENTORY_FORMAT_CSV;
+	else
+	{
+		PrintUsage ();
+		return EXIT_CODE_USAGE;
+	}
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (_wcsicmp (argv[i], L"/deadline") == 0 && i + 1 < argc)
+		{
+			if (!ParseDeadlineArgument (argv[++i]))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (IsTransformOption (argv[i]) && i + 1 < argc)
+		{
+			if (!ParseTransformOption (argv[i], argv[++i], transform))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (!outputPath)
+			outputPath = argv[i];
+		else
+		{
+			PrintUsage ();
+			return EXIT_CODE_USAGE;
+		}
+	}
+
+	// Errors exported to the standard output would corrupt the JSON or CSV stream
+	hDiagnostics = outputPath ? StdOutput : StdError;
+
+	EnableCommandCancellation ();
+
+	// Nothing is exported from a partial enumeration
+	vector <HostDevice> devices = GetAvailableHostDevices (&CommandCancellation);
+
+	if (IsCancelled (&CommandCancellation))
+	{
+		FilePrintf (hDiagnostics, L"devices\terror\t0x%.8X\n", GetLastError ());
+		return EXIT_CODE_FAILURE;
+	}
+
+	if (outputPath)
+	{
+		hOutput = CreateFileW (outputPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hOutput == INVALID_HANDLE_VALUE)
+		{
+			FilePrintf (hDiagnostics, L"%s\terror\t0x%.8X\n", outputPath, GetLastError ());
+			return EXIT_CODE_FAILURE;
+		}
+	}
+
+	vector <VolumeMetadata> volumes;
+	bool bWritten;
+
+	CollectVolumeMetadata (volumes);
+
+	{
+		InventoryWriter writer (hOutput, format);
+
+		writer.Begin ();
+
+		// Each device is written as soon as it is probed
+		for (size_t i = 0; i < devices.size(); i++)
+		{
+			const HostDevice &device = devices[i];
+			ConcealState state = CONCEAL_STATE_UNKNOWN;
+			const wchar_t *fileSystemName = NULL;
+			DWORD probeError = ERROR_SUCCESS;
+
+			// The devices left are exported with the cancellation as their probe error
+			if (IsCancelled (&CommandCancellation))
+			{
+				probeError = GetLastError ();
+				exitCode = EXIT_CODE_FAILURE;
+			}
+			else if (IsInventoryVolume (device) && device.Size != 0
+				&& !GetDeviceConcealState (device.Path.c_str(), COMMAND_LINE_DOS_DEVICE_COUNTER_BASE + (DWORD) i, &transform, state, &fileSystemName))
+			{
+				probeError = GetLastError ();
+				exitCode = EXIT_CODE_FAILURE;
+			}
+
+			// Also exported as the probe error of the device
+			if (probeError != ERROR_SUCCESS)
+				FilePrintf (hDiagnostics, L"%s\terror\t0x%.8X\n", device.Path.c_str(), probeError);
+
+			writer.WriteDevice (device, state, fileSystemName, probeError, FindVolumeMetadata (volumes, device));
+		}
+
+		writer.End ();
+		bWritten = writer.Flush ();
+	}
+
+	if (!bWritten)
+	{
+		FilePrintf (hDiagnostics, L"%s\terror\t0x%.8X\n", outputPath ? outputPath : L"-", GetLastError ());
+		exitCode = EXIT_CODE_FAILURE;
+	}
+
+	if (outputPath)
+		CloseHandle (hOutput);
+
+	return exitCode;
+}
+
+static void PrintInstrumentation (const wchar_t *phase, const LARGE_INTEGER &start, const LARGE_INTEGER &frequency, size_t itemCount)
+{
+	LARGE_INTEGER end;
+
+	QueryPerformanceCounter (&end);
+
+	ConsolePrintf (L"%s\t%.3f\t%Iu", phase, (double) (end.QuadPart - start.QuadPart) * 1000.0 / (double) frequency.QuadPart, itemCount);
+
+	for (int i = 0; i < INSTRUMENTATION_COUNTER_COUNT; i++)
+		ConsolePrintf (L"\t%d", GetInstrumentationCounter ((InstrumentationCounter) i));
+
+	ConsolePrintf (L"\n");
+}
+
+static int StatsCommand (int argc, wchar_t **argv)
+{
+	LARGE_INTEGER frequency, start;
+	vector <VolumeMetadata> volumes;
+
+	if (argc != 0)
+	{
+		PrintUsage ();
+		return EXIT_CODE_USAGE;
+	}
+
+	QueryPerformanceFrequency (&frequency);
+
+	ConsolePrintf (L"enumeration\tduration_ms\titems");
+	for (int i = 0; i < INSTRUMENTATION_COUNTER_COUNT; i++)
+		ConsolePrintf (L"\t%s", GetInstrumentationCounterName ((InstrumentationCounter) i));
+	ConsolePrintf (L"\n");
+
+	ResetInstrumentationCounters ();
+	QueryPerformanceCounter (&start);
+
+	vector <HostDevice> devices = GetAvailableHostDevices ();
+	PrintInstrumentation (L"devices", start, frequency, devices.size());
+
+	ResetInstrumentationCounters ();
+	QueryPerformanceCounter (&start);
+
+	if (!CollectVolumeMetadata (volumes))
+	{
+		ConsolePrintf (L"volumes\terror\t0x%.8X\n", GetLastError ());
+		return EXIT_CODE_FAILURE;
+	}
+
+	PrintInstrumentation (L"volumes", start, frequency, volumes.size());
+
+	return EXIT_CODE_SUCCESS;
+}
+
+static int BatchCommand (int argc, wchar_t **argv)
+{
+	vector <BatchTarget> targets;
+	BatchOptions options;
+	ConcealTransform transform;
+	const wchar_t *manifestPath = NULL;
+	const wchar_t *logPath = NULL;
+	IoThrottleLimits totalLimits;
+	size_t errorIndex;
+	int exitCode = EXIT_CODE_SUCCESS;
+	size_t counts[BATCH_RESULT_CANCELLED + 1] = {0};
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (_wcsicmp (argv[i], L"/log") == 0 && i + 1 < argc)
+			logPath = argv[++i];
+		else if (_wcsicmp (argv[i], L"/background") == 0)
+			options.LowPriority = true;
+		else if (_wcsicmp (argv[i], L"/deadline") == 0 && i + 1 < argc)
+		{
+			if (!ParseDeadlineArgument (argv[++i]))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if ((_wcsicmp (argv[i], L"/jobs") == 0 || _wcsicmp (argv[i], L"/perdisk") == 0) && i + 1 < argc)
+		{
+			unsigned int *value = (_wcsicmp (argv[i], L"/jobs") == 0) ? &options.MaxJobs : &options.MaxJobsPerDisk;
+
+			if (!ParseCountArgument (argv[++i], BATCH_MAX_JOBS, *value))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (IsTransformOption (argv[i]) && i + 1 < argc)
+		{
+			if (!ParseTransformOption (argv[i], argv[++i], transform))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (IsThrottleOption (argv[i]) && i + 1 < argc)
+		{
+			if (!ParseThrottleOption (argv[i], argv[++i], options.DeviceLimits, totalLimits))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (!manifestPath && argv[i][0] != L'/')
+			manifestPath = argv[i];
+		else
+		{
+			PrintUsage ();
+			return EXIT_CODE_USAGE;
+		}
+	}
+
+	// The log is mandatory, as it is the record of what has been done to each target
+	if (!manifestPath || !logPath)
+	{
+		PrintUsage ();
+		return EXIT_CODE_USAGE;
+	}
+
+	if (!LoadBatchManifest (manifestPath, targets, errorIndex))
+	{
+		if (errorIndex != 0)
+			ConsolePrintf (L"%s\terror\t0x%.8X\tline %Iu\n", manifestPath, GetLastError (), errorIndex);
+		else
+			ConsolePrintf (L"%s\terror\t0x%.8X\n", manifestPath, GetLastError ());
+		return EXIT_CODE_FAILURE;
+	}
+
+	// Nothing is written if a target cannot be located
+	if (!targets.empty() && !ResolveBatchTargets (targets, errorIndex))
+	{
+		ConsolePrintf (L"%s\terror\t0x%.8X\n", targets[errorIndex].Target.c_str(), GetLastError ());
+		return EXIT_CODE_FAILURE;
+	}
+
+	IoThrottle globalThrottle (totalLimits);
+
+	options.Transform = &transform;
+	options.DosDeviceCounterBase = COMMAND_LINE_DOS_DEVICE_COUNTER_BASE;
+	options.GlobalThrottle = totalLimits.IsLimited() ? &globalThrottle : NULL;
+	options.Cancel = &CommandCancellation;
+
+	EnableCommandCancellation ();
+
+	if (!targets.empty() && !RunBatch (targets, options, logPath))
+	{
+		ConsolePrintf (L"%s\terror\t0x%.8X\n", logPath, GetLastError ());
+		exitCode = EXIT_CODE_FAILURE;
+	}
+
+	for (vector <BatchTarget>::const_iterator It = targets.begin(); It != targets.end(); It++)
+	{
+		counts[It->Result]++;
+
+		ConsolePrintf (L"%s\t%s\t%s\t%s\t0x%.8X\n", It->Target.c_str(), GetBatchResultName (It->Result),
+			GetConcealStateName (It->StateBefore),
+			It->Result == BATCH_RESULT_DONE ? GetConcealStateName (It->StateAfter) : L"-",
+			It->LastError);
+	}
+
+	ConsolePrintf (L"total\tdone %Iu\tskipped %Iu\tfailed %Iu\tcancelled %Iu\tnot run %Iu\n",
+		counts[BATCH_RESULT_DONE], counts[BATCH_RESULT_SKIPPED], counts[BATCH_RESULT_FAILED], counts[BATCH_RESULT_CANCELLED],
+		counts[BATCH_RESULT_PENDING]);
+
+	// A skipped target did not reach the state requested either
+	if (counts[BATCH_RESULT_DONE] != targets.size())
+		exitCode = EXIT_CODE_FAILURE;
+
+	return exitCode;
+}
+
+static int AgentCommand (int argc, wchar_t **argv)
+{
+	AgentOptions options;
+	ConcealTransform transform;
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (_wcsicmp (argv[i], L"/workers") == 0 && i + 1 < argc)
+		{
+			if (!ParseCountArgument (argv[++i], AGENT_MAX_WORKERS, options.WorkerCount))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else if (IsTransformOption (argv[i]) && i + 1 < argc)
+		{
+			if (!ParseTransformOption (argv[i], argv[++i], transform))
+			{
+				PrintUsage ();
+				return EXIT_CODE_USAGE;
+			}
+		}
+		else
+		{
+			PrintUsage ();
+			return EXIT_CODE_USAGE;
+		}
+	}
+
+	options.Transform = &transform;
+	options.DosDeviceCounterBase = COMMAND_LINE_DOS_DEVICE_COUNTER_BASE;
+
+	if (!RunAgent (options))
+	{
+		ConsolePrintf (L"%s\terror\t0x%.8X\n", AGENT_PIPE_NAME, GetLastError ());
+		return EXIT_CODE_FAILURE;
+	}
+
+	ConsolePrintf (L"%s\tstopped\n", AGENT_PIPE_NAME);
+	return EXIT_CODE_SUCCESS;
+}
+
+static int MetadataCommand (int argc, wchar_t **argv)
+{
+	vector <MetadataTarget> targets;
+	DeviceIdResolver resolver;
+	bool bResolverReady = false;
+	bool bConceal;
+	int exitCode = EXIT_CODE_SUCCESS;
+
+	if (argc < 2 || (_wcsicmp (argv[0], L"conceal") != 0 && _wcsicmp (argv[0], L"reveal") != 0))
+	{
+		PrintUsage ();
+		return EXIT_CODE_USAGE;
+	}
+
+	bConceal = (_wcsicmp (argv[0], L"conceal") == 0);
+
+	for (int i = 1; i < argc; i++)
+	{
+		MetadataTarget target;
+
+		if (IsHarddiskDevicePath (argv[i]))
+			target.Path = argv[i];
+		else if (!IsDeviceId (argv[i]))
+		{
+			PrintUsage ();
+			return EXIT_CODE_USAGE;
+		}
+		else if (!ResolveDeviceArgument (argv[i], resolver, bResolverReady, target.Path))
+			return EXIT_CODE_FAILURE;
+
+		targets.push_back (target);
+	}
+
+	if (!ApplyPartitionMetadata (targets, bConceal, COMMAND_LINE_DOS_DEVICE_COUNTER_BASE))
+		exitCode = EXIT_CODE_FAILURE;
+
+	for (vector <MetadataTarget>::const_iterator It = targets.begin(); It != targets.end(); It++)
+	{
+		if (It->Success)
+		{
+			ConsolePrintf (L"%s\t%s\t%s\t%s\n", It->Path.c_str(), It->Changed ? L"done" : L"unchanged",
+				GetMetadataStateName (It->StateBefore), GetMetadataStateName (It->StateAfter));
+		}
+		else
+		{
+			wchar_t errorText[1024] = L"-";
+
+			if (!It->Errors.empty())
+				FormatConcealError (It->Errors.front(), errorText, ARRAYSIZE (errorText));
+
+			ConsolePrintf (L"%s\terror\t0x%.8X\t%s\n", It->Path.c_str(), It->LastError, errorText);
+		}
+	}
+
+	return exitCode;
+}
+
+bool ProcessCommandLine (int &exitCode)
+{
+	int argc;
+	wchar_t **argv = CommandLineToArgvW (GetCommandLineW (), &argc);
+
+	if (!argv)
+		return false;
+
+	if (argc < 2 || (argv[1][0] != L'/' && argv[1][0] != L'-'))
+	{
+		LocalFree (argv);
+		return false;
+	}
+
+	InitConsoleOutput ();
+
+	const wchar_t *command = argv[1] + 1;
+
+	if (_wcsicmp (command, L"status") == 0)
+		exitCode = StatusCommand (argc - 2, argv + 2);
+	else if (_wcsicmp (command, L"apply") == 0)
+		exitCode = ApplyCommand (argc - 2, argv + 2);
+	else if (_wcsicmp (command, L"plan") == 0)
+		exitCode = PlanCommand (argc - 2, argv + 2);
+	else if (_wcsicmp (command, L"export") == 0)
+		exitCode = ExportCommand (argc - 2, argv + 2);
+	else if (_wcsicmp (command, L"stats") == 0)
+		exitCode = StatsCommand (argc - 2, argv + 2);
+	else if (_wcsicmp (command, L"batch") == 0)
+		exitCode = BatchCommand (argc - 2, argv + 2);
+	else if (_wcsicmp (command, L"agent") == 0)
+		exitCode = AgentCommand (argc - 2, argv + 2);
+	else if (_wcsicmp (command, L"metadata") == 0)
+		exitCode = MetadataCommand (argc - 2, argv + 2);
+	else
+	{
+		PrintUsage ();
+		exitCode = EXIT_CODE_USAGE;
+	}
+
+	LocalFree (argv);
+	return true;
+}
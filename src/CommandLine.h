@@ -0,0 +1,18 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// CommandLine.h : non-GUI operations requested on the command line
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Performs the operation requested on the command line, if any, and sets the process exit code.
+// Returns false if no operation was requested, in which case the main dialog must be displayed.
+bool ProcessCommandLine (int &exitCode);
@@ -0,0 +1,189 @@
+/*
+ Derived from source code of TrueCrypt 7.1a, which is
+ Copyright (c) 2008-2012 TrueCrypt Developers Association and which is governed
+ by the TrueCrypt License 3.0.
+
+ Modifications and additions to the original source code (contained in this file)
+ and all other portions of this file are Copyright (c) 2013-2016 IDRIX
+ and are governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "Conceal.h"
+#include "BlockDevice.h"
+#include "Checksum.h"
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+#	define BE16(x) MirrorBytes16(x)
+#	define BE32(x) MirrorBytes32(x)
+#	define BE64(x) MirrorBytes64(x)
+#else
+#	define BE16(x) (x)
+#	define BE32(x) (x)
+#	define BE64(x) (x)
+#endif
+
+inline ULONGLONG MirrorBytes64 (ULONGLONG x)
+{
+	ULONGLONG n = (unsigned __int8) x;
+	n <<= 8; n |= (unsigned __int8) (x >> 8);
+	n <<= 8; n |= (unsigned __int8) (x >> 16);
+	n <<= 8; n |= (unsigned __int8) (x >> 24);
+	n <<= 8; n |= (unsigned __int8) (x >> 32);
+	n <<= 8; n |= (unsigned __int8) (x >> 40);
+	n <<= 8; n |= (unsigned __int8) (x >> 48);
+	return (n << 8) | (unsigned __int8) (x >> 56);
+}
+
+static const wchar_t *GetFileSystemSignatureName (ULONGLONG signature)
+{
+	switch (signature)
+	{
+	case 0xEB52904E54465320: return L"NTFS";
+	case 0xEB3C904D53444F53: return L"FAT16";
+	case 0xEB58904D53444F53: return L"FAT32";
+	case 0xEB76904558464154: return L"exFAT";
+	}
+
+	return NULL;
+}
+
+const wchar_t *GetFileSystemSignatureName (const BYTE *header)
+{
+	return GetFileSystemSignatureName (BE64 (*(const ULONGLONG *) header));
+}
+
+ConcealState GetConcealState (const BYTE *header, const wchar_t **fileSystemName, const ConcealTransform *transform)
+{
+	BYTE transformed[CONCEAL_SIGNATURE_SIZE];
+	const wchar_t *name;
+	ConcealState state = CONCEAL_STATE_UNKNOWN;
+
+	// Every transform is self-inverse, so a concealed signature is recognized by
+	// applying the same transform to the eight bytes read
+	memcpy (transformed, header, sizeof (transformed));
+	ApplyConcealTransform (transform, transformed, sizeof (transformed), 0);
+
+	if ((name = GetFileSystemSignatureName (header)) != NULL)
+		state = CONCEAL_STATE_VISIBLE;
+	else if ((name = GetFileSystemSignatureName (transformed)) != NULL)
+		state = CONCEAL_STATE_CONCEALED;
+
+	SecureZeroMemory (transformed, sizeof (transformed));
+
+	if (fileSystemName)
+		*fileSystemName = name;
+
+	return state;
+}
+
+const wchar_t *GetConcealStateName (ConcealState state)
+{
+	switch (state)
+	{
+	case CONCEAL_STATE_VISIBLE:		return L"visible";
+	case CONCEAL_STATE_CONCEALED:	return L"concealed";
+	default:						return L"unknown";
+	}
+}
+
+// Easy-to-undo modification applied to conceal the NTFS filesystem (to prevent Windows and apps from
+// interfering with it until the volume has been fully encrypted). Note that this function will precisely
+// undo any modifications it made to the filesystem automatically if an error occurs when writing (including
+// physical drive defects).
+bool ConcealNTFS (BlockDevice &dev, bool& bHadFileSystemBefore, bool& bHasFilesystemNow, ConcealVerification *verification,
+	const ConcealTransform *transform, ErrorReporter *reporter)
+{
+	// Sector aligned so that the device can be opened with FILE_FLAG_NO_BUFFERING
+	__declspec(align(TC_MAX_VOLUME_SECTOR_SIZE)) char buf [TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE];
+	__declspec(align(TC_MAX_VOLUME_SECTOR_SIZE)) char readBackBuf [TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE];
+	DWORD nbrBytesProcessed, nbrBytesProcessed2;
+	DWORD dwError;
+
+	if (!dev.Read (0, buf, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE, nbrBytesProcessed))
+	{
+		ReportLastError (reporter, L"read", NULL, 0);
+		return false;
+	}
+
+   bHadFileSystemBefore = GetFileSystemSignatureName ((BYTE *) buf) != NULL;
+   bHasFilesystemNow = false;
+
+	if (verification)
+	{
+		verification->Verified = false;
+		verification->BeforeDigest = Crc32c (0, buf, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE);
+	}
+
+	ApplyConcealTransform (transform, buf, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE, 0);
+
+	if (verification)
+		verification->AfterDigest = Crc32c (0, buf, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE);
+
+	if (!dev.Write (0, buf, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE, nbrBytesProcessed))
+	{
+		// One or more of the sectors is/are probably damaged and cause write errors.
+		// We must undo the modifications we made.
+
+		dwError = GetLastError();
+
+		ApplyConcealTransform (transform, buf, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE, 0);
+
+		// A sector that stays unwritable must not hang the caller, so the number of attempts is bounded
+		for (int retry = 0; retry < CONCEAL_ROLLBACK_MAX_RETRIES; retry++)
+		{
+			dev.Pause (CONCEAL_ROLLBACK_RETRY_DELAY);
+
+			if (dev.Write (0, buf, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE, nbrBytesProcessed2))
+			{
+				SetLastError (dwError);
+				ReportLastError (reporter, L"write", NULL, 0, L"The original data has been written back.");
+				return false;
+			}
+		}
+
+		SetLastError (dwError);
+		ReportLastError (reporter, L"write", NULL, 0, L"The original data could not be written back: the beginning of the device may be partially transformed.");
+
+		return false;
+	}
+
+   bHasFilesystemNow = GetFileSystemSignatureName ((BYTE *) buf) != NULL;
+
+	if (verification)
+	{
+		// A single extra read of the region tells whether the device really stored what it acknowledged
+		if (!dev.Read (0, readBackBuf, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE, nbrBytesProcessed))
+		{
+			ReportLastError (reporter, L"read back", NULL, 0);
+			return false;
+		}
+
+		verification->ReadBackDigest = Crc32c (0, readBackBuf, nbrBytesProcessed);
+		verification->Verified = (nbrBytesProcessed == TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE
+			&& verification->ReadBackDigest == verification->AfterDigest);
+
+		if (!verification->Verified)
+		{
+			wchar_t details[256];
+
+			StringCchPrintfW (details, ARRAYSIZE (details), L"The data read back from the device does not match the data written to it (CRC32C expected: %.8X, read: %.8X). The device may be defective.",
+				verification->AfterDigest, verification->ReadBackDigest);
+
+			SetLastError (ERROR_CRC);
+			ReportLastError (reporter, L"verify", NULL, 0, details);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ConcealNTFS (HANDLE dev, bool& bHadFileSystemBefore, bool& bHasFilesystemNow, ConcealVerification *verification,
+	const ConcealTransform *transform, ErrorReporter *reporter)
+{
+	HandleBlockDevice device (dev);
+	return ConcealNTFS (device, bHadFileSystemBefore, bHasFilesystemNow, verification, transform, reporter);
+}
@@ -0,0 +1,66 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Conceal.h : VeraCrypt XOR concealing transformation and filesystem signature detection
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "ErrorReport.h"
+#include "Transform.h"
+
+class BlockDevice;
+
+#define TC_MAX_VOLUME_SECTOR_SIZE				4096
+#define TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE		(2 * TC_MAX_VOLUME_SECTOR_SIZE)
+#define TC_NTFS_CONCEAL_CONSTANT	0xFF
+
+// Minimum number of bytes of a device header needed to identify its filesystem
+#define CONCEAL_SIGNATURE_SIZE		8
+
+// Attempts to write the original data back after a failed write, and delay between them (ms)
+#define CONCEAL_ROLLBACK_MAX_RETRIES	300
+#define CONCEAL_ROLLBACK_RETRY_DELAY	10
+
+enum ConcealState
+{
+	CONCEAL_STATE_UNKNOWN,			// No known filesystem, whether the transformation is applied or not
+	CONCEAL_STATE_VISIBLE,			// A known filesystem is visible to Windows
+	CONCEAL_STATE_CONCEALED			// A known filesystem becomes visible if the transformation is applied again
+};
+
+// Returns the name of the filesystem whose boot sector starts with the given header, or NULL if none is recognized
+const wchar_t *GetFileSystemSignatureName (const BYTE *header);
+
+// Determines the conceal state of a device from its first CONCEAL_SIGNATURE_SIZE bytes.
+// fileSystemName (optional) receives the name of the detected filesystem or NULL.
+// A concealed header is recognized only if it was transformed with the given transform.
+ConcealState GetConcealState (const BYTE *header, const wchar_t **fileSystemName, const ConcealTransform *transform = NULL);
+
+const wchar_t *GetConcealStateName (ConcealState state);
+
+struct ConcealVerification
+{
+	unsigned __int32 BeforeDigest;		// CRC32C of the region before the transformation
+	unsigned __int32 AfterDigest;		// CRC32C of the transformed region written to the device
+	unsigned __int32 ReadBackDigest;	// CRC32C of the region read back from the device after writing
+	bool Verified;
+};
+
+// When verification is not NULL, the transformed region is read back after writing it and
+// the function fails with ERROR_CRC if it does not match. To bypass the system cache when reading
+// back, the device should be opened with FILE_FLAG_NO_BUFFERING.
+// The region is XORed with the keystream of transform, or with TC_NTFS_CONCEAL_CONSTANT if it is NULL.
+// The failed operation is reported to reporter when it is not NULL. If the write fails, the original data
+// is written back, retrying up to CONCEAL_ROLLBACK_MAX_RETRIES times.
+bool ConcealNTFS (BlockDevice &dev, bool& bHadFileSystemBefore, bool& bHasFilesystemNow, ConcealVerification *verification = NULL,
+	const ConcealTransform *transform = NULL, ErrorReporter *reporter = NULL);
+bool ConcealNTFS (HANDLE dev, bool& bHadFileSystemBefore, bool& bHasFilesystemNow, ConcealVerification *verification = NULL,
+	const ConcealTransform *transform = NULL, ErrorReporter *reporter = NULL);
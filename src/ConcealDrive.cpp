@@ -19,75 +19,18 @@
 #include "resource.h"
 
 #include "MainDlg.h"
+#include "CommandLine.h"
 
 CAppModule _Module;
 
-int ScreenDPI = USER_DEFAULT_SCREEN_DPI;
-double DPIScaleFactorX = 1;
-double DPIScaleFactorY = 1;
-double DlgAspectRatio = 1;
-
-// This function currently serves the following purposes:
-// - Determines scaling factors for current screen DPI and GUI aspect ratio.
-// - Determines how Windows skews the GUI aspect ratio (which happens when the user has a non-default DPI).
-// The determined values must be used when performing some GUI operations and calculations.
-BOOL CALLBACK AuxiliaryDlgProc (HWND hwndDlg, UINT msg, WPARAM wParam, LPARAM lParam)
-{
-	switch (msg)
-	{
-	case WM_INITDIALOG:
-		{
-			HDC hDC = GetDC (hwndDlg);
-
-			if (hDC)
-			{
-				ScreenDPI = GetDeviceCaps (hDC, LOGPIXELSY);
-				ReleaseDC (hwndDlg, hDC); 
-			}
-
-			DPIScaleFactorX = 1;
-			DPIScaleFactorY = 1;
-			DlgAspectRatio = 1;
-
-			if (ScreenDPI != USER_DEFAULT_SCREEN_DPI)
-			{
-				// Windows skews the GUI aspect ratio if the user has a non-default DPI. Hence, working with 
-				// actual screen DPI is redundant and leads to incorrect results. What really matters here is
-				// how Windows actually renders our GUI. This is determined by comparing the expected and current
-				// sizes of a hidden calibration text field.
-
-				RECT trec;
-
-				trec.right = 0;
-				trec.bottom = 0;
-
-				GetClientRect (GetDlgItem (hwndDlg, IDC_ASPECT_RATIO_CALIBRATION_BOX), &trec);
-
-				if (trec.right != 0 && trec.bottom != 0)
-				{
-					// The size of the 282x282 IDC_ASPECT_RATIO_CALIBRATION_BOX rendered at the default DPI (96) is 423x458
-					DPIScaleFactorX = (double) trec.right / 423;
-					DPIScaleFactorY = (double) trec.bottom / 458;
-					DlgAspectRatio = DPIScaleFactorX / DPIScaleFactorY;
-				}
-			}
-
-			EndDialog (hwndDlg, 0);
-			return 1;
-		}
-
-	case WM_CLOSE:
-		EndDialog (hwndDlg, 0);
-		return 1;
-	}
-
-	return 0;
-}
-
 RTLINITUNICODESTRING RtlInitUnicodeString = NULL;
 NTOPENSYMBOLICLINKOBJECT NtOpenSymbolicLinkObject = NULL;
 NTQUERYSYMBOLICLINKOBJECT NtQuerySymbolicLinkObject = NULL;
 NTCLOSE NtClose= NULL;
+PREFETCHVIRTUALMEMORY PrefetchVirtualMemory = NULL;
+GETVOLUMEINFORMATIONBYHANDLEW GetVolumeInformationByHandle = NULL;
+SETFILEINFORMATIONBYHANDLE SetFileInformationByHandle = NULL;
+GETLARGEPAGEMINIMUM GetLargePageMinimum = NULL;
 
 
 int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR /*lpstrCmdLine*/, int /*nCmdShow*/)
@@ -101,8 +44,6 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR /*
 	// this resolves ATL window thunking problem when Microsoft Layer for Unicode (MSLU) is used
 	::DefWindowProc(NULL, 0, 0, 0L);
 
-	AtlInitCommonControls(ICC_BAR_CLASSES);	// add flags to support other controls
-
 	hRes = _Module.Init(NULL, hInstance);
 	ATLASSERT(SUCCEEDED(hRes));
 
@@ -113,13 +54,18 @@ int WINAPI _tWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPTSTR /*
    NtQuerySymbolicLinkObject = (NTQUERYSYMBOLICLINKOBJECT)GetProcAddress(_hModule, "NtQuerySymbolicLinkObject");
    NtClose = (NTCLOSE) GetProcAddress(_hModule, "NtClose");
 
-	// DPI and GUI aspect ratio
-	DialogBoxParamW (hInstance, MAKEINTRESOURCEW (IDD_DPI), NULL,
-		(DLGPROC) AuxiliaryDlgProc, (LPARAM) 1);
+   PrefetchVirtualMemory = (PREFETCHVIRTUALMEMORY) GetProcAddress(GetModuleHandle(_T("kernel32.dll")), "PrefetchVirtualMemory");
+   GetVolumeInformationByHandle = (GETVOLUMEINFORMATIONBYHANDLEW) GetProcAddress(GetModuleHandle(_T("kernel32.dll")), "GetVolumeInformationByHandleW");
+   SetFileInformationByHandle = (SETFILEINFORMATIONBYHANDLE) GetProcAddress(GetModuleHandle(_T("kernel32.dll")), "SetFileInformationByHandle");
+   GetLargePageMinimum = (GETLARGEPAGEMINIMUM) GetProcAddress(GetModuleHandle(_T("kernel32.dll")), "GetLargePageMinimum");
 
 	int nRet = 0;
 	// BLOCK: Run application
+	// The command line is processed before any window is created, which only the dialogs need
+	if (!ProcessCommandLine (nRet))
 	{
+		AtlInitCommonControls(ICC_BAR_CLASSES);	// add flags to support other controls
+
 		CMainDlg dlgMain;
 		nRet = dlgMain.DoModal();
 	}
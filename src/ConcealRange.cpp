@@ -0,0 +1,705 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <stddef.h>
+#include <process.h>
+
+#include "ConcealRange.h"
+#include "BlockDevice.h"
+#include "Cancellation.h"
+#include "Checksum.h"
+#include "Devices.h"
+#include "IoBufferPool.h"
+#include "Progress.h"
+#include "Throttle.h"
+
+#define CONCEAL_RANGE_MAX_BLOCK_SIZE		(16 * 1024 * 1024)
+
+// Number of batches in the pipeline: one being read while the others are transformed and written
+#define CONCEAL_RANGE_PIPELINE_DEPTH		2
+
+// Keystream position used to identify a transform in checkpoints. No device is large enough
+// to have data transformed with it, so its digest does not reveal anything about the data.
+#define CONCEAL_TRANSFORM_CHECK_OFFSET		0xFFFFFFFFFFFFFF00ULL
+
+static unsigned __int32 GetTransformCheck (const ConcealTransform *transform)
+{
+	BYTE check[32];
+	unsigned __int32 crc;
+
+	ZeroMemory (check, sizeof (check));
+	check[0] = (BYTE) (transform ? transform->Mode : CONCEAL_TRANSFORM_CONSTANT);
+
+	ApplyConcealTransform (transform, check + 1, sizeof (check) - 1, CONCEAL_TRANSFORM_CHECK_OFFSET);
+	crc = Crc32c (0, check, sizeof (check));
+
+	SecureZeroMemory (check, sizeof (check));
+	return crc;
+}
+
+// Transfers through the devices of the range, failing with ERROR_HANDLE_EOF if the transfer is short
+static bool ReadBlock (BlockDevice &device, ULONGLONG offset, BYTE *buffer, DWORD size)
+{
+	DWORD nbrBytesRead;
+
+	if (!device.Read (offset, buffer, size, nbrBytesRead))
+		return false;
+
+	if (nbrBytesRead != size)
+	{
+		SetLastError (ERROR_HANDLE_EOF);
+		return false;
+	}
+
+	return true;
+}
+
+static bool WriteBlock (BlockDevice &device, ULONGLONG offset, const BYTE *buffer, DWORD size)
+{
+	DWORD nbrBytesWritten;
+
+	if (!device.Write (offset, buffer, size, nbrBytesWritten))
+		return false;
+
+	if (nbrBytesWritten != size)
+	{
+		SetLastError (ERROR_HANDLE_EOF);
+		return false;
+	}
+
+	return true;
+}
+
+// Batch of the pipeline, read by the read stage and then transformed and written by the caller
+struct ConcealRangeSlot
+{
+	BYTE *Buffer;
+	ULONGLONG Offset;
+	DWORD Count;
+	DWORD LastError;			// Of the read of the batch
+};
+
+// Read stage of the pipeline, filling the slots in turn with the next batches of the range
+struct ConcealRangeReader
+{
+	BlockDevice *Device;			// Throttled, shared with the stage writing the batches
+	ULONGLONG Offset;			// Of the next batch to read
+	ULONGLONG EndOffset;
+	DWORD BatchSize;
+	DWORD NextSlot;
+	ConcealRangeSlot Slots[CONCEAL_RANGE_PIPELINE_DEPTH];
+	HANDLE FreeSlots;			// Semaphore counting the slots the read stage may fill
+	HANDLE ReadSlots;			// Semaphore counting the slots read and not consumed yet
+	volatile LONG Stop;
+};
+
+// Returns false if the batch could not be read, in which case the stage stops
+static bool ReadNextBatch (ConcealRangeReader &reader)
+{
+	ConcealRangeSlot &slot = reader.Slots[reader.NextSlot];
+
+	slot.Offset = reader.Offset;
+	slot.Count = (DWORD) min ((ULONGLONG) reader.BatchSize, reader.EndOffset - reader.Offset);
+	slot.LastError = ReadBlock (*reader.Device, slot.Offset, slot.Buffer, slot.Count) ? ERROR_SUCCESS : GetLastError ();
+
+	reader.Offset += slot.Count;
+	reader.NextSlot = (reader.NextSlot + 1) % CONCEAL_RANGE_PIPELINE_DEPTH;
+
+	return slot.LastError == ERROR_SUCCESS;
+}
+
+static unsigned __stdcall ConcealRangeReaderProc (void *param)
+{
+	ConcealRangeReader *reader = (ConcealRangeReader *) param;
+
+	while (reader->Offset < reader->EndOffset)
+	{
+		WaitForSingleObject (reader->FreeSlots, INFINITE);
+
+		if (reader->Stop)
+			break;
+
+		bool bRead = ReadNextBatch (*reader);
+		ReleaseSemaphore (reader->ReadSlots, 1, NULL);
+
+		if (!bRead)
+			break;
+	}
+
+	return 0;
+}
+
+// Waits for the read stage to end, stopping it if batches remain to be read
+static void CloseReader (ConcealRangeReader &reader, HANDLE hReader)
+{
+	if (hReader)
+	{
+		InterlockedExchange (&reader.Stop, TRUE);
+		ReleaseSemaphore (reader.FreeSlots, CONCEAL_RANGE_PIPELINE_DEPTH, NULL);
+
+		WaitForSingleObject (hReader, INFINITE);
+		CloseHandle (hReader);
+	}
+
+	if (reader.FreeSlots)
+		CloseHandle (reader.FreeSlots);
+
+	if (reader.ReadSlots)
+		CloseHandle (reader.ReadSlots);
+}
+
+bool WriteConcealBatch (BlockDevice &device, ULONGLONG offset, BYTE *batch, DWORD count, DWORD blockSize,
+	const ConcealTransform *transform, bool bCheckpoint, ErrorReporter *reporter, IoThrottle *throttle)
+{
+	ThrottledBlockDevice throttledDevice (device, throttle);
+
+	for (DWORD i = 0; i * blockSize < count; i++)
+	{
+		if (!WriteBlock (throttledDevice, offset + i * blockSize, batch + i * blockSize, min (blockSize, count - i * blockSize)))
+		{
+			// Undo the blocks of the batch written so far, the failed one included as it may be
+			// partially written, without waiting for the throttle
+			DWORD restoreSize = min ((i + 1) * blockSize, count);
+			DWORD dwError = GetLastError ();
+			bool bRestored = true;
+
+			ApplyConcealTransform (transform, batch, restoreSize, offset);
+
+			for (DWORD j = 0; j <= i; j++)
+			{
+				if (!WriteBlock (device, offset + j * blockSize, batch + j * blockSize, min (blockSize, restoreSize - j * blockSize)))
+					bRestored = false;
+			}
+
+			SetLastError (dwError);
+
+			if (bRestored)
+				ReportLastError (reporter, L"write", NULL, offset + i * blockSize, L"The blocks of the batch written have been restored.");
+			else if (bCheckpoint)
+				ReportLastError (reporter, L"write", NULL, offset + i * blockSize, L"The blocks of the batch written could not all be restored: run the same command again to resume from the checkpoint.");
+			else
+				ReportLastError (reporter, L"write", NULL, offset + i * blockSize, L"The blocks of the batch written could not all be restored.");
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool IsCheckpointValid (const ConcealCheckpoint &checkpoint)
+{
+	return checkpoint.Signature == CONCEAL_CHECKPOINT_SIGNATURE
+		&& checkpoint.Version == CONCEAL_CHECKPOINT_VERSION
+		&& checkpoint.BlockCount <= CONCEAL_CHECKPOINT_MAX_BLOCKS
+		&& checkpoint.Crc == Crc32c (0, &checkpoint, offsetof (ConcealCheckpoint, Crc));
+}
+
+// Returns the valid slot with the highest sequence number
+static bool LoadCheckpoint (HANDLE hFile, ConcealCheckpoint &checkpoint, bool &bFound)
+{
+	ConcealCheckpoint slots[2];
+	LARGE_INTEGER pos;
+	DWORD nbrBytesRead;
+
+	bFound = false;
+	pos.QuadPart = 0;
+
+	if (SetFilePointerEx (hFile, pos, NULL, FILE_BEGIN) == 0)
+		return false;
+
+	if (ReadFile (hFile, slots, sizeof (slots), &nbrBytesRead, NULL) == 0)
+		return false;
+
+	for (DWORD i = 0; i < ARRAYSIZE (slots); i++)
+	{
+		if (nbrBytesRead >= (i + 1) * sizeof (ConcealCheckpoint)
+			&& IsCheckpointValid (slots[i])
+			&& (!bFound || slots[i].Sequence > checkpoint.Sequence))
+		{
+			checkpoint = slots[i];
+			bFound = true;
+		}
+	}
+
+	return true;
+}
+
+static bool CommitCheckpoint (HANDLE hFile, ConcealCheckpoint &checkpoint)
+{
+	LARGE_INTEGER pos;
+	DWORD nbrBytesWritten;
+
+	checkpoint.Sequence++;
+	checkpoint.Crc = Crc32c (0, &checkpoint, offsetof (ConcealCheckpoint, Crc));
+
+	pos.QuadPart = (checkpoint.Sequence % 2) * sizeof (ConcealCheckpoint);
+
+	if (SetFilePointerEx (hFile, pos, NULL, FILE_BEGIN) == 0)
+		return false;
+
+	if (WriteFile (hFile, &checkpoint, sizeof (checkpoint), &nbrBytesWritten, NULL) == 0)
+		return false;
+
+	// The batch must not be written before its checkpoint is stable
+	return FlushFileBuffers (hFile) != 0;
+}
+
+// Finds the sector boundary of a block whose beginning was written transformed while its end still
+// holds the original data, by looking for the split that restores the digest of the original block
+static bool FindTornBlockSplit (const BYTE *block, DWORD size, DWORD sectorSize, const ConcealTransform *transform,
+	ULONGLONG offset, unsigned __int32 beforeDigest, DWORD &split)
+{
+	BYTE sector[CONCEAL_RANGE_ALIGNMENT];
+	unsigned __int32 prefixCrc = 0;
+	bool bFound = false;
+
+	for (DWORD pos = 0; pos + sectorSize < size; pos += sectorSize)
+	{
+		memcpy (sector, block + pos, sectorSize);
+		ApplyConcealTransform (transform, sector, sectorSize, offset + pos);
+		prefixCrc = Crc32c (prefixCrc, sector, sectorSize);
+
+		if (Crc32c (prefixCrc, block + pos + sectorSize, size - pos - sectorSize) == beforeDigest)
+		{
+			split = pos + sectorSize;
+			bFound = true;
+			break;
+		}
+	}
+
+	SecureZeroMemory (sector, sizeof (sector));
+	return bFound;
+}
+
+// Identifies the partition the range belongs to, so that a checkpoint is not resumed on another device
+static void SetCheckpointDevice (HANDLE dev, ConcealCheckpoint &checkpoint)
+{
+	PARTITION_INFORMATION_EX partition;
+	DWORD dwResult;
+
+	if (DeviceIoControl (dev, IOCTL_DISK_GET_PARTITION_INFO_EX, NULL, 0, &partition, sizeof (partition), &dwResult, NULL))
+	{
+		checkpoint.DeviceOffset = partition.StartingOffset.QuadPart;
+		checkpoint.DeviceLength = partition.PartitionLength.QuadPart;
+
+		if (partition.PartitionStyle == PARTITION_STYLE_GPT)
+			memcpy (checkpoint.DeviceGuid, &partition.Gpt.PartitionId, sizeof (checkpoint.DeviceGuid));
+	}
+	else
+	{
+		ULONGLONG length;
+
+		if (GetDeviceLength (dev, length))
+			checkpoint.DeviceLength = length;
+	}
+}
+
+static bool IsCheckpointDevice (const ConcealCheckpoint &saved, const ConcealCheckpoint &checkpoint)
+{
+	return saved.DeviceOffset == checkpoint.DeviceOffset
+		&& saved.DeviceLength == checkpoint.DeviceLength
+		&& memcmp (saved.DeviceGuid, checkpoint.DeviceGuid, sizeof (saved.DeviceGuid)) == 0;
+}
+
+// Brings every block of the batch recorded by an interrupted run to its transformed state, once the
+// block before it is found transformed as recorded. boundarySize and boundaryDigest receive the size
+// and digest of the last block transformed.
+static bool ResumeBatch (BlockDevice &device, const ConcealCheckpoint &saved, const ConcealTransform *transform,
+	BYTE *buffer, DWORD sectorSize, ConcealRangeResult &result, DWORD &boundarySize, unsigned __int32 &boundaryDigest,
+	ErrorReporter *reporter)
+{
+	ULONGLONG endOffset = saved.RangeStart + saved.RangeSize;
+	ULONGLONG offset = saved.CompletedOffset;
+
+	// The range before the completed offset is not read again: its last block tells that
+	// the device holds the data the checkpoint was written for
+	if (saved.BoundarySize != 0)
+	{
+		ULONGLONG boundaryOffset = offset - saved.BoundarySize;
+
+		if (!ReadBlock (device, boundaryOffset, buffer, saved.BoundarySize))
+		{
+			ReportLastError (reporter, L"read", NULL, boundaryOffset);
+			return false;
+		}
+
+		if (Crc32c (0, buffer, saved.BoundarySize) != saved.BoundaryDigest)
+		{
+			SetLastError (ERROR_CRC);
+			ReportLastError (reporter, L"resume", NULL, boundaryOffset, L"The block before the completed offset does not match the checkpoint.");
+			return false;
+		}
+	}
+
+	boundarySize = saved.BoundarySize;
+	boundaryDigest = saved.BoundaryDigest;
+
+	for (DWORD i = 0; i < saved.BlockCount && offset < endOffset; i++)
+	{
+		DWORD size = (DWORD) min ((ULONGLONG) saved.BlockSize, endOffset - offset);
+		unsigned __int32 crc;
+
+		if (!ReadBlock (device, offset, buffer, size))
+		{
+			ReportLastError (reporter, L"read", NULL, offset);
+			return false;
+		}
+
+		crc = Crc32c (0, buffer, size);
+
+		if (crc != saved.AfterDigests[i])
+		{
+			DWORD split = 0;
+
+			if (crc != saved.BeforeDigests[i])
+			{
+				if (!FindTornBlockSplit (buffer, size, sectorSize, transform, offset, saved.BeforeDigests[i], split))
+				{
+					SetLastError (ERROR_CRC);
+					ReportLastError (reporter, L"resume", NULL, offset, L"The block matches neither its original nor its transformed digest.");
+					return false;
+				}
+
+				result.RepairedBlocks++;
+			}
+
+			ApplyConcealTransform (transform, buffer + split, size - split, offset + split);
+
+			if (Crc32c (0, buffer, size) != saved.AfterDigests[i])
+			{
+				SetLastError (ERROR_CRC);
+				ReportLastError (reporter, L"resume", NULL, offset, L"The repaired block does not match its transformed digest.");
+				return false;
+			}
+
+			if (!WriteBlock (device, offset, buffer, size))
+			{
+				ReportLastError (reporter, L"write", NULL, offset);
+				return false;
+			}
+		}
+
+		boundarySize = size;
+		boundaryDigest = saved.AfterDigests[i];
+		offset += size;
+	}
+
+	result.Resumed = true;
+	result.ResumedOffset = saved.CompletedOffset;
+	result.CompletedOffset = offset;
+	return true;
+}
+
+bool ConcealRange (HANDLE dev, ULONGLONG startOffset, ULONGLONG size, const ConcealTransform *transform,
+	const wchar_t *checkpointPath, ULONGLONG checkpointInterval, ConcealRangeResult &result, ErrorReporter *reporter,
+	IoThrottle *throttle, ProgressRing *progress, const CancellationToken *cancel)
+{
+	ULONGLONG endOffset = startOffset + size;
+	ULONGLONG offset = startOffset;
+	HANDLE hCheckpoint = INVALID_HANDLE_VALUE;
+	ConcealCheckpoint checkpoint;
+	ConcealCheckpoint saved;
+	bool bResumed = false;
+	DISK_GEOMETRY driveGeometry;
+	DWORD sectorSize, blockSize, blockCount, batchSize;
+	BYTE *buffer = NULL;
+	SIZE_T bufferSize = 0;
+	ConcealRangeReader reader;
+	HANDLE hReader = NULL;
+	HandleBlockDevice device (dev);
+	ThrottledBlockDevice throttledDevice (device, throttle);
+	DWORD boundarySize = 0;
+	unsigned __int32 boundaryDigest = 0;
+	DWORD dwError;
+
+	result = ConcealRangeResult ();
+	ZeroMemory (&reader, sizeof (reader));
+	result.CompletedOffset = startOffset;
+
+	if (size == 0 || (startOffset % CONCEAL_RANGE_ALIGNMENT) != 0 || (size % CONCEAL_RANGE_ALIGNMENT) != 0)
+	{
+		SetLastError (ERROR_INVALID_PARAMETER);
+		ReportLastError (reporter, L"check range", NULL, startOffset);
+		return false;
+	}
+
+	sectorSize = GetDriveGeometry (dev, &driveGeometry) ? driveGeometry.BytesPerSector : CONCEAL_RANGE_ALIGNMENT;
+	if (sectorSize > CONCEAL_RANGE_ALIGNMENT || (CONCEAL_RANGE_ALIGNMENT % sectorSize) != 0)
+	{
+		SetLastError (ERROR_INVALID_PARAMETER);
+		ReportLastError (reporter, L"check range", NULL, CONCEAL_ERROR_NO_OFFSET, L"The sector size of the device is not supported.");
+		return false;
+	}
+
+	if (checkpointInterval == 0)
+		checkpointInterval = CONCEAL_DEFAULT_CHECKPOINT_INTERVAL;
+
+	ZeroMemory (&checkpoint, sizeof (checkpoint));
+	checkpoint.Signature = CONCEAL_CHECKPOINT_SIGNATURE;
+	checkpoint.Version = CONCEAL_CHECKPOINT_VERSION;
+	checkpoint.RangeStart = startOffset;
+	checkpoint.RangeSize = size;
+	checkpoint.TransformCheck = GetTransformCheck (transform);
+
+	if (checkpointPath)
+	{
+		SetCheckpointDevice (dev, checkpoint);
+
+		// Not shared, so that two runs cannot use the same checkpoint
+		hCheckpoint = CreateFileW (checkpointPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_FLAG_WRITE_THROUGH, NULL);
+		if (hCheckpoint == INVALID_HANDLE_VALUE)
+		{
+			ReportLastError (reporter, L"open checkpoint", checkpointPath);
+			return false;
+		}
+
+		if (!LoadCheckpoint (hCheckpoint, saved, bResumed))
+		{
+			ReportLastError (reporter, L"read checkpoint", checkpointPath);
+			goto error;
+		}
+
+		if (bResumed && (saved.RangeStart != startOffset || saved.RangeSize != size
+			|| saved.TransformCheck != checkpoint.TransformCheck
+			|| saved.CompletedOffset < startOffset || saved.CompletedOffset > endOffset
+			|| saved.BlockSize == 0 || saved.BlockSize > CONCEAL_RANGE_MAX_BLOCK_SIZE
+			|| saved.BoundarySize > saved.BlockSize || saved.BoundarySize > saved.CompletedOffset - startOffset))
+		{
+			SetLastError (ERROR_INVALID_DATA);
+			ReportLastError (reporter, L"resume", checkpointPath, CONCEAL_ERROR_NO_OFFSET, L"The checkpoint belongs to another range or transform.");
+			goto error;
+		}
+
+		if (bResumed && !IsCheckpointDevice (saved, checkpoint))
+		{
+			SetLastError (ERROR_INVALID_DATA);
+			ReportLastError (reporter, L"resume", checkpointPath, CONCEAL_ERROR_NO_OFFSET, L"The checkpoint belongs to another device.");
+			goto error;
+		}
+	}
+
+	// Each batch is split into blocks written one after the other, so that a block torn by
+	// an interruption can be located and completed when resuming. A resumed run keeps the
+	// block size of the interrupted one.
+	if (bResumed)
+		blockSize = saved.BlockSize;
+	else
+	{
+		ULONGLONG minBlockSize = (checkpointInterval + CONCEAL_CHECKPOINT_MAX_BLOCKS - 1) / CONCEAL_CHECKPOINT_MAX_BLOCKS;
+
+		minBlockSize = (minBlockSize + CONCEAL_RANGE_ALIGNMENT - 1) / CONCEAL_RANGE_ALIGNMENT * CONCEAL_RANGE_ALIGNMENT;
+		blockSize = (DWORD) max ((ULONGLONG) CONCEAL_RANGE_MIN_BLOCK_SIZE, min ((ULONGLONG) CONCEAL_RANGE_MAX_BLOCK_SIZE, minBlockSize));
+	}
+
+	blockCount = (DWORD) min ((ULONGLONG) CONCEAL_CHECKPOINT_MAX_BLOCKS, (checkpointInterval + blockSize - 1) / blockSize);
+	batchSize = blockSize * blockCount;
+	checkpoint.BlockSize = blockSize;
+
+	// One batch per slot of the pipeline. Page aligned, as required when the device is opened with
+	// FILE_FLAG_NO_BUFFERING, the batch size being a multiple of the block size.
+	bufferSize = (SIZE_T) batchSize * CONCEAL_RANGE_PIPELINE_DEPTH;
+	buffer = AcquireIoBuffer (bufferSize);
+	if (!buffer)
+	{
+		ReportLastError (reporter, L"allocate", NULL);
+		goto error;
+	}
+
+	if (bResumed)
+	{
+		if (!ResumeBatch (throttledDevice, saved, transform, buffer, sectorSize, result, boundarySize, boundaryDigest, reporter))
+			goto error;
+
+		checkpoint.Sequence = saved.Sequence;
+		offset = result.CompletedOffset;
+	}
+
+	if (progress)
+		progress->Post (PROGRESS_EVENT_STARTED, offset - startOffset, size);
+
+	// The next batches are read while a batch is transformed and written, so that neither the device
+	// nor the CPU waits for the other. The reads and writes are still serialized on the handle.
+	reader.Device = &throttledDevice;
+	reader.Offset = offset;
+	reader.EndOffset = endOffset;
+	reader.BatchSize = batchSize;
+
+	for (DWORD s = 0; s < CONCEAL_RANGE_PIPELINE_DEPTH; s++)
+		reader.Slots[s].Buffer = buffer + s * batchSize;
+
+	reader.FreeSlots = CreateSemaphore (NULL, CONCEAL_RANGE_PIPELINE_DEPTH, CONCEAL_RANGE_PIPELINE_DEPTH, NULL);
+	reader.ReadSlots = CreateSemaphore (NULL, 0, CONCEAL_RANGE_PIPELINE_DEPTH, NULL);
+
+	// Without a read stage, each batch is read when it is needed
+	if (reader.FreeSlots && reader.ReadSlots && offset < endOffset)
+		hReader = (HANDLE) _beginthreadex (NULL, 0, ConcealRangeReaderProc, &reader, 0, NULL);
+
+	for (DWORD n = 0; offset < endOffset; n++)
+	{
+		ConcealRangeSlot &slot = reader.Slots[n % CONCEAL_RANGE_PIPELINE_DEPTH];
+		BYTE *batch = slot.Buffer;
+		DWORD count, countBlocks;
+		DWORD i;
+
+		// Stops between two batches, once the batches written are stable and recorded as completed
+		if (IsCancelled (cancel))
+		{
+			dwError = GetLastError ();
+
+			if (!FlushFileBuffers (dev))
+			{
+				ReportLastError (reporter, L"flush", NULL, offset);
+				goto error;
+			}
+
+			if (hCheckpoint != INVALID_HANDLE_VALUE)
+			{
+				checkpoint.CompletedOffset = offset;
+				checkpoint.BoundarySize = boundarySize;
+				checkpoint.BoundaryDigest = boundaryDigest;
+				checkpoint.BlockCount = 0;
+
+				if (!CommitCheckpoint (hCheckpoint, checkpoint))
+				{
+					ReportLastError (reporter, L"write checkpoint", checkpointPath);
+					goto error;
+				}
+			}
+
+			SetLastError (dwError);
+			ReportLastError (reporter, L"cancel", NULL, offset);
+			goto error;
+		}
+
+		if (hReader)
+			WaitForSingleObject (reader.ReadSlots, INFINITE);
+		else
+			ReadNextBatch (reader);
+
+		if (slot.LastError != ERROR_SUCCESS)
+		{
+			SetLastError (slot.LastError);
+			ReportLastError (reporter, L"read", NULL, slot.Offset);
+			goto error;
+		}
+
+		count = slot.Count;
+		countBlocks = (count + blockSize - 1) / blockSize;
+
+		if (hCheckpoint != INVALID_HANDLE_VALUE)
+		{
+			for (i = 0; i < countBlocks; i++)
+				checkpoint.BeforeDigests[i] = Crc32c (0, batch + i * blockSize, min (blockSize, count - i * blockSize));
+		}
+
+		ApplyConcealTransform (transform, batch, count, offset);
+
+		if (hCheckpoint != INVALID_HANDLE_VALUE)
+		{
+			for (i = 0; i < countBlocks; i++)
+				checkpoint.AfterDigests[i] = Crc32c (0, batch + i * blockSize, min (blockSize, count - i * blockSize));
+
+			checkpoint.CompletedOffset = offset;
+			checkpoint.BoundarySize = boundarySize;
+			checkpoint.BoundaryDigest = boundaryDigest;
+			checkpoint.BlockCount = countBlocks;
+
+			// The checkpoint stops describing the batch written before, which must be stable first
+			if (!FlushFileBuffers (dev))
+			{
+				ReportLastError (reporter, L"flush", NULL, offset);
+				goto error;
+			}
+
+			if (!CommitCheckpoint (hCheckpoint, checkpoint))
+			{
+				ReportLastError (reporter, L"write checkpoint", checkpointPath);
+				goto error;
+			}
+		}
+
+		if (!WriteConcealBatch (device, offset, batch, count, blockSize, transform, hCheckpoint != INVALID_HANDLE_VALUE, reporter, throttle))
+			goto error;
+
+		// The next commits identify the device by the last block written
+		boundarySize = count - (countBlocks - 1) * blockSize;
+		boundaryDigest = (hCheckpoint != INVALID_HANDLE_VALUE) ? checkpoint.AfterDigests[countBlocks - 1] : 0;
+
+		offset += count;
+		result.CompletedOffset = offset;
+
+		if (progress)
+			progress->Post (PROGRESS_EVENT_ADVANCED, offset - startOffset, size);
+
+		if (hReader)
+			ReleaseSemaphore (reader.FreeSlots, 1, NULL);
+	}
+
+	CloseReader (reader, hReader);
+	ZeroMemory (&reader, sizeof (reader));
+	hReader = NULL;
+
+	if (!FlushFileBuffers (dev))
+	{
+		ReportLastError (reporter, L"flush", NULL, CONCEAL_ERROR_NO_OFFSET);
+		goto error;
+	}
+
+	if (hCheckpoint != INVALID_HANDLE_VALUE)
+	{
+		checkpoint.CompletedOffset = endOffset;
+		checkpoint.BlockCount = 0;
+
+		if (!CommitCheckpoint (hCheckpoint, checkpoint))
+		{
+			ReportLastError (reporter, L"write checkpoint", checkpointPath);
+			goto error;
+		}
+
+		CloseHandle (hCheckpoint);
+		hCheckpoint = INVALID_HANDLE_VALUE;
+
+		DeleteFileW (checkpointPath);
+	}
+
+	// The outcome is determined from the final header, which also works when an interrupted run was resumed
+	if (startOffset == 0 && ReadBlock (device, 0, buffer, CONCEAL_RANGE_ALIGNMENT))
+	{
+		ConcealState state = GetConcealState (buffer, NULL, transform);
+
+		result.HasFileSystemNow = (state == CONCEAL_STATE_VISIBLE);
+		result.HadFileSystemBefore = (state == CONCEAL_STATE_CONCEALED);
+	}
+
+	ReleaseIoBuffer (buffer, bufferSize);
+
+	if (progress)
+		progress->Post (PROGRESS_EVENT_COMPLETED, size, size);
+
+	return true;
+
+error:
+	dwError = GetLastError ();
+
+	// Before its buffers are freed
+	CloseReader (reader, hReader);
+
+	if (buffer)
+		ReleaseIoBuffer (buffer, bufferSize);
+
+	if (hCheckpoint != INVALID_HANDLE_VALUE)
+		CloseHandle (hCheckpoint);
+
+	if (progress)
+		progress->Post (PROGRESS_EVENT_FAILED, result.CompletedOffset - startOffset, size, dwError);
+
+	SetLastError (dwError);
+	return false;
+}
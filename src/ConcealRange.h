@@ -0,0 +1,110 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// ConcealRange.h : resumable transformation of large device regions
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Conceal.h"
+
+class BlockDevice;
+class CancellationToken;
+class IoThrottle;
+class ProgressRing;
+
+// Offsets and sizes of transformed ranges must be multiples of this value
+#define CONCEAL_RANGE_ALIGNMENT					TC_MAX_VOLUME_SECTOR_SIZE
+
+#define CONCEAL_RANGE_MIN_BLOCK_SIZE			(256 * 1024)
+#define CONCEAL_DEFAULT_CHECKPOINT_INTERVAL		(16 * 1024 * 1024)
+#define CONCEAL_CHECKPOINT_MAX_BLOCKS			64
+
+#define CONCEAL_CHECKPOINT_SIGNATURE			0x31304B5043444343ULL	// "CCDCPK01"
+#define CONCEAL_CHECKPOINT_VERSION				2
+
+#pragma pack (push, 1)
+
+// A checkpoint file holds two slots written alternately, so that a torn write of one
+// slot never destroys the last valid record
+struct ConcealCheckpoint
+{
+	unsigned __int64 Signature;
+	unsigned __int32 Version;
+	unsigned __int32 Sequence;
+	unsigned __int64 RangeStart;
+	unsigned __int64 RangeSize;
+	unsigned __int64 CompletedOffset;		// All the bytes of the range before this offset are transformed
+	unsigned __int64 DeviceOffset;			// Identify the device: offset of the partition on its disk,
+	unsigned __int64 DeviceLength;			// its length
+	unsigned __int8 DeviceGuid[16];			// and its GPT partition identifier (zero for other devices)
+	unsigned __int32 BoundarySize;			// Size of the block ending at CompletedOffset, 0 at the start of the range
+	unsigned __int32 BoundaryDigest;		// CRC32C of that block, transformed
+	unsigned __int32 TransformCheck;		// Identifies the transform without revealing its key
+	unsigned __int32 BlockSize;
+	unsigned __int32 BlockCount;			// Number of blocks being written after CompletedOffset
+	unsigned __int32 BeforeDigests[CONCEAL_CHECKPOINT_MAX_BLOCKS];	// CRC32C of the original blocks
+	unsigned __int32 AfterDigests[CONCEAL_CHECKPOINT_MAX_BLOCKS];	// CRC32C of the transformed blocks
+	unsigned __int32 Crc;					// CRC32C of all the preceding fields
+};
+
+#pragma pack (pop)
+
+struct ConcealRangeResult
+{
+	ConcealRangeResult ()
+		:
+		CompletedOffset (0),
+		ResumedOffset (0),
+		Resumed (false),
+		RepairedBlocks (0),
+		HadFileSystemBefore (false),
+		HasFileSystemNow (false)
+	{
+	}
+
+	ULONGLONG CompletedOffset;		// End of the part of the range known to be transformed
+	ULONGLONG ResumedOffset;		// Offset at which an interrupted run was resumed
+	bool Resumed;
+	DWORD RepairedBlocks;			// Blocks found partially written when resuming
+	bool HadFileSystemBefore;
+	bool HasFileSystemNow;
+};
+
+// Applies a transform to size bytes of the device starting at startOffset, streaming the range
+// in batches of checkpointInterval bytes, the next batch being read by a thread of its own while the
+// current one is transformed and written. When checkpointPath is not NULL, a checkpoint identifying
+// the batch being written is committed to that file before the batch is written, the device being flushed
+// before each commit so that it does not need to be opened with FILE_FLAG_WRITE_THROUGH. If the file holds
+// the checkpoint of an interrupted run of the same range and transform on the same device, the block
+// ending at the completed offset and the blocks of its batch are verified against their digests
+// (completing any block torn at a sector boundary) and the run resumes after them. The checkpoint file is deleted once the whole range is transformed. If a block of a batch
+// cannot be written, the blocks of the batch written so far and the failed block are restored.
+// Fails with ERROR_INVALID_DATA if the checkpoint belongs to another range, transform or device, and with
+// ERROR_CRC if the block before the completed offset does not match its digest, or if a block of the
+// interrupted batch matches neither its original nor its transformed digest.
+// The failed operation and its offset are reported to reporter when it is not NULL. When throttle is
+// not NULL, the range is read and written in chunks of up to IO_THROTTLE_MAX_TRANSFER bytes, each
+// waiting until the throttle allows it. When progress is not NULL, an event giving the bytes of the range
+// transformed is posted to it when the transform starts, after each batch, and when it ends or fails.
+// When cancel is not NULL and gets cancelled, the transform stops before the next batch: the batches
+// written are flushed and, with a checkpoint, committed as completed, so that running it again resumes
+// at result.CompletedOffset. It then fails with ERROR_CANCELLED, or ERROR_TIMEOUT at a deadline.
+bool ConcealRange (HANDLE dev, ULONGLONG startOffset, ULONGLONG size, const ConcealTransform *transform,
+	const wchar_t *checkpointPath, ULONGLONG checkpointInterval, ConcealRangeResult &result, ErrorReporter *reporter = NULL,
+	IoThrottle *throttle = NULL, ProgressRing *progress = NULL, const CancellationToken *cancel = NULL);
+
+// Writes the count bytes of batch, already transformed, at offset in blocks of blockSize bytes written one
+// after the other, through throttle when it is not NULL. If a block cannot be written, the blocks written
+// so far and the failed block are written back with their original data, obtained by reverting the transform
+// of batch, without waiting for the throttle. The failure is then reported to reporter, telling whether the
+// blocks could all be restored and, when bCheckpoint is true, that a checkpoint allows resuming otherwise.
+bool WriteConcealBatch (BlockDevice &device, ULONGLONG offset, BYTE *batch, DWORD count, DWORD blockSize,
+	const ConcealTransform *transform, bool bCheckpoint, ErrorReporter *reporter = NULL, IoThrottle *throttle = NULL);
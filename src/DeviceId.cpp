@@ -0,0 +1,137 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "DeviceId.h"
+#include "Transform.h"
+
+// Index of the identities shared by several devices
+#define DEVICE_ID_AMBIGUOUS		((size_t) -1)
+
+static wstring ToUpper (const wstring &str)
+{
+	wstring upper (str);
+
+	for (size_t i = 0; i < upper.size(); i++)
+		upper[i] = towupper (upper[i]);
+
+	return upper;
+}
+
+bool IsDeviceId (const wchar_t *str)
+{
+	return _wcsnicmp (str, L"disk:", 5) == 0
+		|| _wcsnicmp (str, L"partition:", 10) == 0
+		|| _wcsnicmp (str, L"volume:", 7) == 0;
+}
+
+bool GetDeviceTransform (const HostDevice &device, const ConcealTransform *transform, ConcealTransform &deviceTransform)
+{
+	deviceTransform = transform ? *transform : ConcealTransform ();
+
+	if (deviceTransform.Mode != CONCEAL_TRANSFORM_KEYSTREAM)
+		return true;
+
+	// The volume identity is assigned from the partition identity, and the disk identities
+	// are stored in sectors that a transformation of the whole disk would change
+	for (vector <wstring>::const_iterator It = device.Ids.begin(); It != device.Ids.end(); It++)
+	{
+		if (_wcsnicmp (It->c_str(), L"partition:", 10) == 0)
+		{
+			SetConcealTransformDevice (deviceTransform, It->c_str());
+			return true;
+		}
+	}
+
+	SetLastError (ERROR_NOT_SUPPORTED);
+	return false;
+}
+
+bool GetDeviceTransform (const wchar_t *path, const ConcealTransform *transform, ConcealTransform &deviceTransform)
+{
+	vector <HostDevice> devices;
+	DWORD diskNumber, partitionNumber;
+
+	if (!transform || transform->Mode != CONCEAL_TRANSFORM_KEYSTREAM)
+	{
+		deviceTransform = transform ? *transform : ConcealTransform ();
+		return true;
+	}
+
+	if (!IsHarddiskDevicePath (path))
+	{
+		const wchar_t *fileName = path;
+		wstring id (L"image:");
+
+		for (const wchar_t *c = path; *c; c++)
+		{
+			if (*c == L'\\' || *c == L'/' || *c == L':')
+				fileName = c + 1;
+		}
+
+		id += fileName;
+
+		deviceTransform = *transform;
+		SetConcealTransformDevice (deviceTransform, id.c_str());
+		return true;
+	}
+
+	if (!ParsePartitionPath (path, diskNumber, partitionNumber))
+	{
+		SetLastError (ERROR_NOT_SUPPORTED);
+		return false;
+	}
+
+	if (GetHostDiskDevices (diskNumber, devices))
+	{
+		for (vector <HostDevice>::const_iterator It = devices.begin(); It != devices.end(); It++)
+		{
+			if (_wcsicmp (It->Path.c_str(), path) == 0)
+				return GetDeviceTransform (*It, transform, deviceTransform);
+		}
+	}
+
+	SetLastError (ERROR_FILE_NOT_FOUND);
+	return false;
+}
+
+void DeviceIdResolver::SetDevices (const vector <HostDevice> &devices)
+{
+	Devices = devices;
+	Index.clear();
+
+	for (size_t i = 0; i < Devices.size(); i++)
+	{
+		for (vector <wstring>::const_iterator It = Devices[i].Ids.begin(); It != Devices[i].Ids.end(); It++)
+		{
+			pair <unordered_map <wstring, size_t>::iterator, bool> result = Index.insert (make_pair (ToUpper (*It), i));
+
+			if (!result.second && result.first->second != i)
+				result.first->second = DEVICE_ID_AMBIGUOUS;
+		}
+	}
+}
+
+const HostDevice *DeviceIdResolver::Resolve (const wstring &id) const
+{
+	unordered_map <wstring, size_t>::const_iterator It = Index.find (ToUpper (id));
+
+	if (It == Index.end())
+	{
+		SetLastError (ERROR_FILE_NOT_FOUND);
+		return NULL;
+	}
+
+	if (It->second == DEVICE_ID_AMBIGUOUS)
+	{
+		SetLastError (ERROR_AMBIGUOUS_SYSTEM_DEVICE);
+		return NULL;
+	}
+
+	return &Devices[It->second];
+}
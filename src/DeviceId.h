@@ -0,0 +1,62 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// DeviceId.h : stable identities of host devices
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <unordered_map>
+#include "Devices.h"
+
+struct ConcealTransform;
+
+#ifndef ERROR_AMBIGUOUS_SYSTEM_DEVICE
+#define ERROR_AMBIGUOUS_SYSTEM_DEVICE 15250L
+#endif
+
+// Device numbers (\Device\HarddiskN\PartitionM) may change between boots and when disks are
+// plugged in, while the following identities, stored in HostDevice::Ids, do not:
+//
+//   disk:serial:<serial number>                 Serial number reported by the storage device
+//   disk:gpt:{GUID}                             Disk GUID of a GPT disk
+//   disk:mbr:<signature>                        Disk signature of an MBR disk (8 hexadecimal digits)
+//   partition:gpt:{GUID}                        Unique partition GUID of a GPT partition
+//   partition:mbr:<signature>:<offset>          MBR disk signature and byte offset of the partition
+//   volume:{GUID}                               Volume GUID assigned by the mount manager
+//
+// Identities are compared without regard to case.
+
+// Returns true if the string has the form of a device identity
+bool IsDeviceId (const wchar_t *str);
+
+// Sets deviceTransform to the transform applied to a device or an image file. With a key, the keystream is
+// selected by a nonce derived from the partition identity of the device, which the transformation does not
+// change, so that devices transformed with the same key do not share a keystream. An image file has no
+// partition identity and is identified by its file name. Fails with ERROR_FILE_NOT_FOUND if the device
+// does not exist, and with ERROR_NOT_SUPPORTED if it is not a partition with an identity.
+bool GetDeviceTransform (const wchar_t *path, const ConcealTransform *transform, ConcealTransform &deviceTransform);
+bool GetDeviceTransform (const HostDevice &device, const ConcealTransform *transform, ConcealTransform &deviceTransform);
+
+// Maps the identities of an inventory of devices to the devices, so that targets identified
+// before the devices are renumbered can be located without enumerating the devices again
+class DeviceIdResolver
+{
+public:
+	void SetDevices (const std::vector <HostDevice> &devices);
+
+	// Returns NULL if no device has the identity (ERROR_FILE_NOT_FOUND), or if several devices
+	// have it (ERROR_AMBIGUOUS_SYSTEM_DEVICE), which happens with cloned disks
+	const HostDevice *Resolve (const std::wstring &id) const;
+
+protected:
+	std::vector <HostDevice> Devices;
+	std::unordered_map <std::wstring, size_t> Index;	// Upper case identities
+};
@@ -0,0 +1,333 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <dbt.h>
+
+#include "DeviceInventory.h"
+
+// Outside the range of the counters used by the enumeration of the devices
+#define DEVICE_INVENTORY_DOS_DEVICE_COUNTER		(MAX_HOST_DRIVE_NUMBER + 1)
+
+// GUID_DEVINTERFACE_DISK and GUID_DEVINTERFACE_VOLUME, which are only defined by the DDK libraries
+static const GUID DiskInterfaceGuid = { 0x53f56307L, 0xb6bf, 0x11d0, { 0x94, 0xf2, 0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b } };
+static const GUID VolumeInterfaceGuid = { 0x53f5630dL, 0xb6bf, 0x11d0, { 0x94, 0xf2, 0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b } };
+
+// Returns the number of the disk of a \Device\HarddiskN\... path
+static bool GetPathDiskNumber (const wstring &path, DWORD &diskNumber)
+{
+	wchar_t *end;
+
+	if (!IsHarddiskDevicePath (path.c_str()) || !iswdigit (path[16]))
+		return false;
+
+	diskNumber = wcstoul (path.c_str() + 16, &end, 10);
+	return *end == L'\\';
+}
+
+// Returns true if a partition link (\Device\HarddiskN\PartitionM) still exists
+static bool PartitionLinkExists (const wstring &path)
+{
+	wchar_t link[MAX_PATH];
+	wchar_t target[MAX_PATH];
+
+	// The special name of the partitions not recognized by Windows is not a link
+	if (path.size() >= 2 && path.compare (path.size() - 2, 2, L"??") == 0)
+		return true;
+
+	StringCchCopyW (link, ARRAYSIZE (link), path.c_str());
+	return SymbolicLinkToTarget (link, target, sizeof (target) - sizeof (wchar_t));
+}
+
+// Returns true if a volume device (\Device\HarddiskVolumeN) still exists
+static bool VolumeDeviceExists (const wstring &path)
+{
+	WCHAR dosDev[MAX_PATH] = {0};
+	WCHAR devName[MAX_PATH] = {0};
+	bool bExists = false;
+
+	if (!FakeDosNameForDevice (DEVICE_INVENTORY_DOS_DEVICE_COUNTER, path.c_str(), dosDev, sizeof (dosDev), devName, sizeof (devName), FALSE))
+		return true;		// Unknown, so kept
+
+	HANDLE hDev = CreateFileW (devName, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hDev != INVALID_HANDLE_VALUE)
+	{
+		bExists = true;
+		CloseHandle (hDev);
+	}
+	else
+		bExists = (GetLastError () != ERROR_FILE_NOT_FOUND && GetLastError () != ERROR_PATH_NOT_FOUND);
+
+	DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, path.c_str());
+	return bExists;
+}
+
+// Retrieves the number of the disk holding a disk or volume opened by its Win32 name. diskNumber
+// is set to -1 for the devices other than disks (CD-ROM...).
+static bool GetStorageDiskNumber (const wchar_t *devName, DWORD &diskNumber)
+{
+	STORAGE_DEVICE_NUMBER number;
+	DWORD bytesReturned;
+	bool bResult;
+
+	// No access is needed by the I/O control, so that the device is not mounted
+	HANDLE hDev = CreateFileW (devName, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hDev == INVALID_HANDLE_VALUE)
+		return false;
+
+	bResult = DeviceIoControl (hDev, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &number, sizeof (number), &bytesReturned, NULL) != FALSE;
+	CloseHandle (hDev);
+
+	if (bResult)
+		diskNumber = (number.DeviceType == FILE_DEVICE_DISK) ? number.DeviceNumber : (DWORD) -1;
+
+	return bResult;
+}
+
+DeviceInventory::DeviceInventory ()
+	:
+	CheckPending (false),
+	RefreshPending (false),
+	Loaded (false),
+	Watching (false),
+	Generation (0),
+	DiskNotification (NULL),
+	VolumeNotification (NULL)
+{
+}
+
+DeviceInventory::~DeviceInventory ()
+{
+	StopWatching ();
+}
+
+void DeviceInventory::Refresh ()
+{
+	Devices = GetAvailableHostDevices ();
+	PendingDisks.clear();
+	CheckPending = false;
+	RefreshPending = false;
+	Loaded = true;
+	Generation++;
+}
+
+bool DeviceInventory::Watch (HWND hwnd)
+{
+	DEV_BROADCAST_DEVICEINTERFACE_W filter;
+
+	StopWatching ();
+
+	memset (&filter, 0, sizeof (filter));
+	filter.dbcc_size = sizeof (filter);
+	filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+
+	filter.dbcc_classguid = DiskInterfaceGuid;
+	DiskNotification = RegisterDeviceNotificationW (hwnd, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+
+	filter.dbcc_classguid = VolumeInterfaceGuid;
+	VolumeNotification = RegisterDeviceNotificationW (hwnd, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+
+	if (!DiskNotification || !VolumeNotification)
+	{
+		StopWatching ();
+		return false;
+	}
+
+	// Devices enumerated before are not known to be current
+	Loaded = false;
+	Watching = true;
+	return true;
+}
+
+void DeviceInventory::StopWatching ()
+{
+	if (DiskNotification)
+		UnregisterDeviceNotification (DiskNotification);
+
+	if (VolumeNotification)
+		UnregisterDeviceNotification (VolumeNotification);
+
+	DiskNotification = NULL;
+	VolumeNotification = NULL;
+	Watching = false;
+}
+
+bool DeviceInventory::OnDeviceChange (WPARAM wParam, LPARAM lParam)
+{
+	PDEV_BROADCAST_HDR header = (PDEV_BROADCAST_HDR) lParam;
+	bool bArrival = (wParam == DBT_DEVICEARRIVAL);
+
+	// Devices not enumerated yet will be when they are needed
+	if (!Loaded || (wParam != DBT_DEVICEARRIVAL && wParam != DBT_DEVICEREMOVECOMPLETE) || !header)
+		return false;
+
+	if (header->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE)
+	{
+		if (bArrival)
+			AddPendingDevice (((PDEV_BROADCAST_DEVICEINTERFACE_W) lParam)->dbcc_name);
+		else
+			CheckPending = true;		// The device can no longer be opened to find its disk
+	}
+	else if (header->dbch_devicetype == DBT_DEVTYP_VOLUME)
+	{
+		// Drive letters assigned or removed, which are broadcast to all the top-level windows
+		AddPendingDriveLetters (((PDEV_BROADCAST_VOLUME) lParam)->dbcv_unitmask, bArrival);
+	}
+	else
+		return false;
+
+	return CheckPending || RefreshPending || !PendingDisks.empty();
+}
+
+void DeviceInventory::AddPendingDisk (DWORD diskNumber)
+{
+	for (size_t i = 0; i < PendingDisks.size(); i++)
+	{
+		if (PendingDisks[i] == diskNumber)
+			return;
+	}
+
+	PendingDisks.push_back (diskNumber);
+}
+
+void DeviceInventory::AddPendingDevice (const wchar_t *devicePath)
+{
+	DWORD diskNumber;
+
+	if (!GetStorageDiskNumber (devicePath, diskNumber))
+		RefreshPending = true;			// Dynamic volumes span several disks
+	else if (diskNumber < MAX_HOST_DRIVE_NUMBER)
+		AddPendingDisk (diskNumber);
+}
+
+void DeviceInventory::AddPendingDriveLetters (DWORD unitMask, bool bArrival)
+{
+	for (int driveNumber = 0; driveNumber < 26; driveNumber++)
+	{
+		wchar_t mountPoint[3] = { (wchar_t) (L'A' + driveNumber), L':', 0 };
+		wchar_t devName[8];
+
+		if (!(unitMask & (1 << driveNumber)))
+			continue;
+
+		if (bArrival)
+		{
+			StringCchPrintfW (devName, ARRAYSIZE (devName), L"\\\\.\\%s", mountPoint);
+			AddPendingDevice (devName);
+			continue;
+		}
+
+		// The volume is gone, so its disk is found among the known devices
+		for (vector <HostDevice>::const_iterator It = Devices.begin(); It != Devices.end(); It++)
+		{
+			DWORD diskNumber;
+
+			if (It->MountPoint != mountPoint)
+				continue;
+
+			if (GetPathDiskNumber (It->Path, diskNumber))
+				AddPendingDisk (diskNumber);
+			else
+				RefreshPending = true;
+		}
+	}
+}
+
+void DeviceInventory::CheckVanishedDevices ()
+{
+	size_t i = 0;
+
+	while (i < Devices.size())
+	{
+		const HostDevice &device = Devices[i];
+		DWORD diskNumber;
+
+		if (device.DynamicVolume)
+		{
+			if (!VolumeDeviceExists (device.Path))
+			{
+				Devices.erase (Devices.begin() + i);
+				Generation++;
+				continue;
+			}
+		}
+		else if (GetPathDiskNumber (device.Path, diskNumber))
+		{
+			wchar_t diskPath[MAX_PATH];
+
+			// A disk whose partition 0 is gone was removed, and a disk whose partition is gone was repartitioned
+			StringCchPrintfW (diskPath, ARRAYSIZE (diskPath), L"\\Device\\Harddisk%u\\Partition0", diskNumber);
+
+			if (!PartitionLinkExists (diskPath) || (device.IsPartition && !PartitionLinkExists (device.Path)))
+				AddPendingDisk (diskNumber);
+		}
+
+		i++;
+	}
+}
+
+void DeviceInventory::UpdateDisk (DWORD diskNumber)
+{
+	vector <HostDevice> diskDevices;
+	size_t insertPos = Devices.size();
+	size_t i = 0;
+
+	// The devices of a disk are consecutive and the disks are in ascending order, followed by the dynamic volumes
+	while (i < Devices.size())
+	{
+		DWORD number;
+
+		if (!GetPathDiskNumber (Devices[i].Path, number) || Devices[i].DynamicVolume)
+		{
+			insertPos = min (insertPos, i);
+			i++;
+		}
+		else if (number == diskNumber)
+		{
+			Devices.erase (Devices.begin() + i);
+			insertPos = min (insertPos, i);
+		}
+		else
+		{
+			if (number > diskNumber)
+				insertPos = min (insertPos, i);
+			i++;
+		}
+	}
+
+	GetHostDiskDevices (diskNumber, diskDevices);
+	Devices.insert (Devices.begin() + insertPos, diskDevices.begin(), diskDevices.end());
+}
+
+bool DeviceInventory::Update ()
+{
+	DWORD generation = Generation;
+
+	if (!Loaded)
+		return false;
+
+	if (RefreshPending)
+	{
+		Refresh ();
+		return true;
+	}
+
+	if (CheckPending)
+		CheckVanishedDevices ();
+
+	for (size_t i = 0; i < PendingDisks.size(); i++)
+		UpdateDisk (PendingDisks[i]);
+
+	if (!PendingDisks.empty())
+		Generation++;
+
+	PendingDisks.clear();
+	CheckPending = false;
+
+	return Generation != generation;
+}
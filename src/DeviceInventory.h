@@ -0,0 +1,75 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// DeviceInventory.h : host devices kept up to date from the device notifications
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Devices.h"
+
+// Posted to a window displaying the devices of the inventory when they change
+#define WM_HOST_DEVICES_CHANGED				(WM_APP + 2)
+
+#define DEVICE_INVENTORY_UPDATE_TIMER		1
+#define DEVICE_INVENTORY_UPDATE_DELAY		500			// ms, lets a burst of notifications settle before probing
+
+// The devices are enumerated once, then only the disks that arrive, change or vanish are probed again.
+// An instance must be used by the thread of the window receiving the notifications.
+class DeviceInventory
+{
+public:
+	DeviceInventory ();
+	~DeviceInventory ();
+
+	// Enumerates all the devices again
+	void Refresh ();
+
+	const std::vector <HostDevice> &GetDevices () const { return Devices; }
+
+	// Incremented each time the devices change
+	DWORD GetGeneration () const { return Generation; }
+
+	// Returns true if the devices were enumerated and the notifications followed since
+	bool IsCurrent () const { return Loaded && Watching; }
+
+	// Registers hwnd for the notifications of the disks and volumes. The window must pass its
+	// WM_DEVICECHANGE messages to OnDeviceChange.
+	bool Watch (HWND hwnd);
+	void StopWatching ();
+
+	// Records the disks affected by a WM_DEVICECHANGE message. Returns true if an update is needed,
+	// which should be applied by Update once the notifications have settled.
+	bool OnDeviceChange (WPARAM wParam, LPARAM lParam);
+
+	// Probes the disks affected since the previous update. Returns true if the devices changed.
+	bool Update ();
+
+protected:
+	void AddPendingDisk (DWORD diskNumber);
+	void AddPendingDevice (const wchar_t *devicePath);
+	void AddPendingDriveLetters (DWORD unitMask, bool bArrival);
+	void CheckVanishedDevices ();
+	void UpdateDisk (DWORD diskNumber);
+
+	std::vector <HostDevice> Devices;
+	std::vector <DWORD> PendingDisks;
+	bool CheckPending;				// A device was removed
+	bool RefreshPending;			// A device could not be related to a disk
+	bool Loaded;
+	bool Watching;
+	DWORD Generation;
+	HDEVNOTIFY DiskNotification;
+	HDEVNOTIFY VolumeNotification;
+
+private:
+	DeviceInventory (const DeviceInventory &);
+	DeviceInventory &operator= (const DeviceInventory &);
+};
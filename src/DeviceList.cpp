@@ -0,0 +1,289 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <algorithm>
+#include "DeviceList.h"
+#include "Dlgcode.h"
+
+static wstring ToUpper (const wstring &str)
+{
+	wstring upper (str);
+
+	for (size_t i = 0; i < upper.size(); i++)
+		upper[i] = towupper (upper[i]);
+
+	return upper;
+}
+
+static void UpdateSearchText (DeviceListRow &row)
+{
+	row.SearchText.clear();
+
+	for (int column = 0; column < DEVICE_LIST_COLUMN_COUNT; column++)
+	{
+		row.SearchText += ToUpper (row.Text[column]);
+		row.SearchText += L'\n';
+	}
+}
+
+struct DeviceListRowLess
+{
+	DeviceListRowLess (const vector <DeviceListRow> &rows, int column, bool ascending)
+		:
+		Rows (rows),
+		Column (column),
+		Ascending (ascending)
+	{
+	}
+
+	bool operator() (size_t a, size_t b) const
+	{
+		return Ascending ? Less (a, b) : Less (b, a);
+	}
+
+	bool Less (size_t a, size_t b) const
+	{
+		const DeviceListRow &rowA = Rows[a];
+		const DeviceListRow &rowB = Rows[b];
+		int result;
+
+		switch (Column)
+		{
+		case DEVICE_LIST_COLUMN_SIZE:
+			if (rowA.Device.Size != rowB.Device.Size)
+				return rowA.Device.Size < rowB.Device.Size;
+			break;
+
+		case DEVICE_LIST_COLUMN_DRIVE:
+		case DEVICE_LIST_COLUMN_LABEL:
+		case DEVICE_LIST_COLUMN_FILESYSTEM:
+			result = _wcsicmp (rowA.Text[Column].c_str(), rowB.Text[Column].c_str());
+			if (result != 0)
+				return result < 0;
+			break;
+		}
+
+		// Devices are sorted in enumeration order, which lists disk N before disk N + 1
+		return a < b;
+	}
+
+	const vector <DeviceListRow> &Rows;
+	int Column;
+	bool Ascending;
+};
+
+DeviceListModel::DeviceListModel ()
+	:
+	SortColumn (DEVICE_LIST_NATURAL_ORDER),
+	SortAscending (true)
+{
+}
+
+void DeviceListModel::Clear ()
+{
+	Rows.clear();
+	View.clear();
+	RowToView.clear();
+	PathToRow.clear();
+}
+
+void DeviceListModel::SetDevices (const vector <HostDevice> &devices)
+{
+	Clear ();
+
+	for (vector <HostDevice>::const_iterator It = devices.begin(); It != devices.end(); It++)
+	{
+		const HostDevice &device = *It;
+		DeviceListRow row;
+
+		// Path
+		if (!device.IsPartition || device.DynamicVolume)
+		{
+			if (!device.Floppy && (device.Size == 0)
+				&& (device.IsPartition || device.Partitions.empty() || device.Partitions[0].Size == 0)
+				)
+				continue;
+
+			if (!Rows.empty())
+			{
+				DeviceListRow separator;
+				separator.Separator = true;
+				Rows.push_back (separator);
+			}
+
+			if (device.Floppy || device.DynamicVolume)
+				row.Text[DEVICE_LIST_COLUMN_DEVICE] = device.Path;
+			else
+			{
+				wchar_t s[1024];
+				if (device.Removable)
+					StringCbPrintfW (s, sizeof(s), L"%s %d", L"Removable Disk", device.SystemNumber);
+				else
+					StringCbPrintfW (s, sizeof(s), L"%s %d", L"Harddisk", device.SystemNumber);
+
+				if (!device.Partitions.empty())
+					StringCbCatW (s, sizeof(s), L":");
+
+				row.Text[DEVICE_LIST_COLUMN_DEVICE] = s;
+			}
+		}
+		else
+			row.Text[DEVICE_LIST_COLUMN_DEVICE] = device.Path;
+
+		row.Device = device;
+
+		// Size
+		if (device.Size != 0)
+		{
+			wchar_t size[100] = { 0 };
+			GetSizeString (device.Size, size, sizeof(size));
+			row.Text[DEVICE_LIST_COLUMN_SIZE] = size;
+		}
+
+		// Mount point
+		row.Text[DEVICE_LIST_COLUMN_DRIVE] = device.MountPoint;
+
+		// Label
+		row.Text[DEVICE_LIST_COLUMN_LABEL] = device.Name;
+
+		// Whole disks holding partitions are not volumes
+		if (device.IsPartition || device.DynamicVolume || device.Floppy || device.Partitions.empty())
+		{
+			row.LabelState = VOLUME_LABEL_STATE_UNKNOWN;
+			PathToRow[device.Path] = Rows.size();
+		}
+
+		UpdateSearchText (row);
+		Rows.push_back (row);
+	}
+
+	UpdateView ();
+}
+
+const wchar_t *DeviceListModel::GetText (size_t row, int column) const
+{
+	if (row >= View.size() || column < 0 || column >= DEVICE_LIST_COLUMN_COUNT)
+		return L"";
+
+	return Rows[View[row]].Text[column].c_str();
+}
+
+const HostDevice *DeviceListModel::GetDevice (size_t row) const
+{
+	if (row >= View.size() || Rows[View[row]].Separator)
+		return NULL;
+
+	return &Rows[View[row]].Device;
+}
+
+bool DeviceListModel::IsVolumeLabelNeeded (size_t row) const
+{
+	return row < View.size() && Rows[View[row]].LabelState == VOLUME_LABEL_STATE_UNKNOWN;
+}
+
+void DeviceListModel::SetVolumeLabelPending (size_t row)
+{
+	if (row >= View.size())
+		return;
+
+	DeviceListRow &deviceRow = Rows[View[row]];
+
+	deviceRow.LabelState = VOLUME_LABEL_STATE_PENDING;
+
+	if (deviceRow.Device.Name.empty())
+		deviceRow.Text[DEVICE_LIST_COLUMN_LABEL] = L"...";
+
+	deviceRow.Text[DEVICE_LIST_COLUMN_FILESYSTEM] = L"...";
+}
+
+int DeviceListModel::SetVolumeLabel (const VolumeLabelResult &result)
+{
+	map <wstring, size_t>::const_iterator It = PathToRow.find (result.DevicePath);
+	if (It == PathToRow.end())
+		return -1;
+
+	DeviceListRow &deviceRow = Rows[It->second];
+	wstring label, fileSystem;
+
+	switch (result.Status)
+	{
+	case VOLUME_LABEL_RESOLVED:
+		label = result.Label;
+		fileSystem = result.FileSystem;
+		break;
+
+	case VOLUME_LABEL_TIMED_OUT:
+		label = L"(not responding)";
+		break;
+	}
+
+	// A name reported by the device takes precedence over the volume label
+	if (deviceRow.Device.Name.empty())
+		deviceRow.Text[DEVICE_LIST_COLUMN_LABEL] = label;
+
+	deviceRow.Text[DEVICE_LIST_COLUMN_FILESYSTEM] = fileSystem;
+	deviceRow.LabelState = VOLUME_LABEL_STATE_NONE;
+	UpdateSearchText (deviceRow);
+
+	return RowToView[It->second];
+}
+
+void DeviceListModel::Sort (int column, bool ascending)
+{
+	SortColumn = (column >= 0 && column < DEVICE_LIST_COLUMN_COUNT) ? column : DEVICE_LIST_NATURAL_ORDER;
+	SortAscending = ascending;
+	UpdateView ();
+}
+
+void DeviceListModel::SetFilter (const wstring &filter)
+{
+	Filter = ToUpper (filter);
+	UpdateView ();
+}
+
+const wchar_t *DeviceListModel::GetLongestText (int column) const
+{
+	size_t longest = 0;
+
+	for (size_t i = 1; i < Rows.size(); i++)
+	{
+		if (Rows[i].Text[column].size() > Rows[longest].Text[column].size())
+			longest = i;
+	}
+
+	return Rows.empty() ? L"" : Rows[longest].Text[column].c_str();
+}
+
+bool DeviceListModel::MatchesFilter (const DeviceListRow &row) const
+{
+	return Filter.empty() || row.SearchText.find (Filter) != wstring::npos;
+}
+
+void DeviceListModel::UpdateView ()
+{
+	// Separators only make sense between the groups of the natural order
+	bool bSeparators = (SortColumn == DEVICE_LIST_NATURAL_ORDER && Filter.empty());
+
+	View.clear();
+	View.reserve (Rows.size());
+
+	for (size_t i = 0; i < Rows.size(); i++)
+	{
+		if (Rows[i].Separator ? bSeparators : MatchesFilter (Rows[i]))
+			View.push_back (i);
+	}
+
+	if (SortColumn != DEVICE_LIST_NATURAL_ORDER)
+		std::stable_sort (View.begin(), View.end(), DeviceListRowLess (Rows, SortColumn, SortAscending));
+
+	RowToView.assign (Rows.size(), -1);
+
+	for (size_t i = 0; i < View.size(); i++)
+		RowToView[View[i]] = (int) i;
+}
@@ -0,0 +1,102 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// DeviceList.h : model of the device selection list, independent of any window
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Devices.h"
+#include "VolumeLabels.h"
+
+enum DeviceListColumn
+{
+	DEVICE_LIST_COLUMN_DEVICE,
+	DEVICE_LIST_COLUMN_DRIVE,
+	DEVICE_LIST_COLUMN_SIZE,
+	DEVICE_LIST_COLUMN_LABEL,
+	DEVICE_LIST_COLUMN_FILESYSTEM,
+	DEVICE_LIST_COLUMN_COUNT
+};
+
+// No sort column: disks are listed in enumeration order, each followed by its partitions
+#define DEVICE_LIST_NATURAL_ORDER	-1
+
+enum VolumeLabelState
+{
+	VOLUME_LABEL_STATE_NONE,		// Not a volume, or already known
+	VOLUME_LABEL_STATE_UNKNOWN,		// Not requested yet
+	VOLUME_LABEL_STATE_PENDING
+};
+
+struct DeviceListRow
+{
+	DeviceListRow ()
+		:
+		Separator (false),
+		LabelState (VOLUME_LABEL_STATE_NONE)
+	{
+	}
+
+	HostDevice Device;
+	bool Separator;					// Blank line between two disks
+	VolumeLabelState LabelState;
+	std::wstring Text[DEVICE_LIST_COLUMN_COUNT];	// Formatted once, when the row is created
+	std::wstring SearchText;		// Upper case text of all the columns, matched by filters
+};
+
+// The rows displayed are a view of the device rows, sorted and filtered by the model, so that
+// a virtual list view only has to ask for the text of the rows it actually draws
+class DeviceListModel
+{
+public:
+	DeviceListModel ();
+
+	void SetDevices (const std::vector <HostDevice> &devices);
+	void Clear ();
+
+	size_t GetRowCount () const { return View.size(); }
+	const wchar_t *GetText (size_t row, int column) const;
+
+	// Returns NULL for separator rows
+	const HostDevice *GetDevice (size_t row) const;
+
+	// The label and filesystem of a volume are queried only when its row is displayed. Until
+	// the result arrives, a placeholder is displayed.
+	bool IsVolumeLabelNeeded (size_t row) const;
+	void SetVolumeLabelPending (size_t row);
+
+	// Returns the displayed row of the device, or -1 if it is not displayed. The view is not
+	// sorted or filtered again, so that rows do not move while the user is selecting one.
+	int SetVolumeLabel (const VolumeLabelResult &result);
+
+	// Sorts by the given column, or restores the natural order with DEVICE_LIST_NATURAL_ORDER
+	void Sort (int column, bool ascending);
+	int GetSortColumn () const { return SortColumn; }
+	bool IsSortAscending () const { return SortAscending; }
+
+	// Keeps the rows whose text contains the filter (case insensitive) in any column
+	void SetFilter (const std::wstring &filter);
+
+	// Longest text of a column among all the rows, used to size the column once
+	const wchar_t *GetLongestText (int column) const;
+
+protected:
+	void UpdateView ();
+	bool MatchesFilter (const DeviceListRow &row) const;
+
+	std::vector <DeviceListRow> Rows;
+	std::vector <size_t> View;			// Indexes of the displayed rows in Rows
+	std::vector <int> RowToView;		// Displayed row of each row, or -1
+	std::map <std::wstring, size_t> PathToRow;
+	std::wstring Filter;				// Upper case
+	int SortColumn;
+	bool SortAscending;
+};
@@ -0,0 +1,706 @@
+/*
+ Derived from source code of TrueCrypt 7.1a, which is
+ Copyright (c) 2008-2012 TrueCrypt Developers Association and which is governed
+ by the TrueCrypt License 3.0.
+
+ Modifications and additions to the original source code (contained in this file)
+ and all other portions of this file are Copyright (c) 2013-2016 IDRIX
+ and are governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "Dlgcode.h"
+#include "Cancellation.h"
+#include "Devices.h"
+#include "Instrumentation.h"
+
+bool IsHarddiskDevicePath (const wchar_t *path)
+{
+	return lstrlen (path) > 16 && _wcsnicmp (L"\\Device\\Harddisk", path, 16) == 0;
+}
+
+bool ParsePartitionPath (const wchar_t *path, DWORD &diskNumber, DWORD &partitionNumber)
+{
+	wchar_t *end;
+
+	if (!IsHarddiskDevicePath (path) || !iswdigit (path[16]))
+		return false;
+
+	diskNumber = wcstoul (path + 16, &end, 10);
+	if (_wcsnicmp (end, L"\\Partition", 10) != 0 || !iswdigit (end[10]))
+		return false;
+
+	partitionNumber = wcstoul (end + 10, &end, 10);
+	return *end == 0 && partitionNumber != 0;
+}
+
+HANDLE OpenDeviceExclusive (LPCWSTR devName, bool bNoBuffering, bool bWriteThrough)
+{
+	HANDLE dev = INVALID_HANDLE_VALUE;
+	DWORD dwFlags = (bWriteThrough ? FILE_FLAG_WRITE_THROUGH : 0) | (bNoBuffering ? FILE_FLAG_NO_BUFFERING : 0);
+	int retryCount = 0;
+
+	// Exclusive access
+	// Note that when exclusive access is denied, it is worth retrying (usually succeeds after a few tries).
+	while (dev == INVALID_HANDLE_VALUE && retryCount++ < EXCL_ACCESS_MAX_AUTO_RETRIES)
+	{
+		dev = CreateFileW (devName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, dwFlags, NULL);
+
+		if (retryCount > 1)
+			Sleep (EXCL_ACCESS_AUTO_RETRY_DELAY);
+	}
+
+	return dev;
+}
+
+HANDLE OpenPartitionVolume (ErrorReporter *reporter, LPCWSTR devName, bool bNoBuffering, bool bWriteThrough)
+{
+	HANDLE dev = OpenDeviceExclusive (devName, bNoBuffering, bWriteThrough);
+
+	if (dev == INVALID_HANDLE_VALUE)
+	{
+		// devName is a temporary DOS device name, so the reporter names the device
+		ReportLastError (reporter, L"open", NULL, CONCEAL_ERROR_NO_OFFSET,
+			L"Cannot access the volume and/or obtain information about the volume. Make sure that the selected volume exists, that it is not being used by the system or applications, that you have read/write permission for the volume, and that it is not write-protected.");
+	}
+
+	return dev;
+}
+
+bool FakeDosNameForDevice (DWORD counter, const wchar_t *lpszDiskFile , wchar_t *lpszDosDevice , size_t cbDosDevice, wchar_t *lpszCFDevice , size_t cbCFDevice, BOOL bNameOnly)
+{
+	BOOL bDosLinkCreated = TRUE;
+	StringCbPrintfW (lpszDosDevice, cbDosDevice,L"concealdrivevc%lu%lu", GetCurrentProcessId (), counter);
+
+	if (bNameOnly == FALSE)
+		bDosLinkCreated = DefineDosDevice (DDD_RAW_TARGET_PATH, lpszDosDevice, lpszDiskFile);
+
+	if (bDosLinkCreated == FALSE)
+		return false;
+	else
+		StringCbPrintfW (lpszCFDevice, cbCFDevice,L"\\\\.\\%s", lpszDosDevice);
+
+	return true;
+}
+
+BOOL GetDriveGeometry (HANDLE hDev, PDISK_GEOMETRY diskGeometry)
+{
+	BOOL bResult = FALSE;
+	DWORD bytesRead = 0;
+
+	ZeroMemory (diskGeometry, sizeof (DISK_GEOMETRY));
+
+	if (	DeviceIoControl (hDev, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, diskGeometry, sizeof (DISK_GEOMETRY), &bytesRead, NULL)
+		&& (bytesRead == sizeof (DISK_GEOMETRY)) 
+		&& diskGeometry->BytesPerSector)
+	{
+		bResult = TRUE;
+	}
+
+	return bResult;
+}
+
+bool GetDeviceLength (HANDLE hDev, ULONGLONG &length)
+{
+	GET_LENGTH_INFORMATION lengthInfo;
+	DWORD bytesRead;
+
+	if (!DeviceIoControl (hDev, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof (lengthInfo), &bytesRead, NULL))
+		return false;
+
+	length = lengthInfo.Length.QuadPart;
+	return true;
+}
+
+BOOL GetPhysicalDriveGeometry (int driveNumber, PDISK_GEOMETRY diskGeometry)
+{
+	HANDLE hDev;
+	BOOL bResult = FALSE;
+	TCHAR devicePath[MAX_PATH];
+
+	StringCchPrintfW (devicePath, ARRAYSIZE (devicePath), L"\\\\.\\PhysicalDrive%d", driveNumber);
+
+	if ((hDev = CreateFileW (devicePath, 0, 0, NULL, OPEN_EXISTING, 0, NULL)) != INVALID_HANDLE_VALUE)
+	{
+		DWORD bytesRead = 0;
+
+		ZeroMemory (diskGeometry, sizeof (DISK_GEOMETRY));
+
+		if (	DeviceIoControl (hDev, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, diskGeometry, sizeof (DISK_GEOMETRY), &bytesRead, NULL)
+			&& (bytesRead == sizeof (DISK_GEOMETRY)) 
+			&& diskGeometry->BytesPerSector)
+		{
+			bResult = TRUE;
+		}
+
+		CloseHandle (hDev);
+	}
+
+	return bResult;
+}
+
+bool SymbolicLinkToTarget (PWSTR symlinkName, PWSTR targetName, USHORT maxTargetNameLength)
+{
+	NTSTATUS ntStatus;
+	OBJECT_ATTRIBUTES objectAttributes;
+	UNICODE_STRING fullFileName;
+	HANDLE handle;
+
+	RtlInitUnicodeString (&fullFileName, symlinkName);
+	InitializeObjectAttributes (&objectAttributes, &fullFileName, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+	ntStatus = NtOpenSymbolicLinkObject (&handle, GENERIC_READ, &objectAttributes);
+
+	if (STATUS_SUCCESS == ntStatus)
+	{
+		UNICODE_STRING target;
+		target.Buffer = targetName;
+		target.Length = 0;
+		target.MaximumLength = maxTargetNameLength;
+		memset (targetName, 0, maxTargetNameLength);
+
+		ntStatus = NtQuerySymbolicLinkObject (handle, &target, NULL);
+
+		NtClose (handle);
+	}
+
+	return STATUS_SUCCESS == ntStatus;
+}
+
+
+// Returns drive letter number assigned to device (-1 if none)
+int GetDiskDeviceDriveLetter (PWSTR deviceName)
+{
+	int i;
+	WCHAR link[MAX_PATH];
+	WCHAR target[MAX_PATH];
+	WCHAR device[MAX_PATH];
+
+	if (!SymbolicLinkToTarget (deviceName, device, sizeof(device)))
+		StringCchCopyW (device, MAX_PATH, deviceName);
+
+	for (i = 0; i < 26; i++)
+	{
+		WCHAR drive[] = { (WCHAR) i + L'A', L':', 0 };
+
+		StringCchCopyW (link, MAX_PATH, L"\\DosDevices\\");
+		StringCchCatW (link, MAX_PATH, drive);
+
+		if (	SymbolicLinkToTarget (link, target, sizeof(target))
+			&& (wcscmp (device, target) == 0)
+			)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+BOOL GetDriveLabel (int driveNo, wchar_t *label, int labelSize)
+{
+	DWORD fileSystemFlags;
+	wchar_t root[] = { L'A' + (wchar_t) driveNo, L':', L'\\', 0 };
+
+	return GetVolumeInformationW (root, label, labelSize / 2, NULL, NULL, &fileSystemFlags, NULL, 0);
+}
+
+// Returns 0 if an error occurs or the drive letter (as an upper-case char) of the system partition (e.g. 'C');
+wchar_t GetSystemDriveLetter (void)
+{
+	wchar_t systemDir [MAX_PATH];
+
+	if (GetSystemDirectory (systemDir, ARRAYSIZE (systemDir)))
+		return (wchar_t) (towupper (systemDir [0]));
+	else
+		return 0;
+}
+
+
+bool IsWindowsVista ()
+{
+   static bool bIsVista = false;
+   static bool bIsChecked = false;
+
+   if (!bIsChecked)
+   {
+      OSVERSIONINFOEXW os;
+	   os.dwOSVersionInfoSize = sizeof (OSVERSIONINFOEXW);
+
+      if (GetVersionExW ((LPOSVERSIONINFOW) &os) && os.dwMajorVersion >= 6)
+      {
+         bIsVista= true;
+      }
+
+      bIsChecked = true;
+   }
+
+   return bIsVista;
+}
+
+typedef struct
+{
+	PARTITION_INFORMATION partInfo;
+	BOOL IsGPT;
+	BOOL IsDynamic;
+}
+DISK_PARTITION_INFO_STRUCT;
+
+BOOL GetDeviceInfo (HANDLE hDev, DISK_PARTITION_INFO_STRUCT *info)
+{
+	DWORD bytesRead;
+   BOOL bResult = FALSE;
+
+   PARTITION_INFORMATION_EX pi;   
+
+   if ((bResult = DeviceIoControl (hDev, IOCTL_DISK_GET_PARTITION_INFO_EX, NULL, 0, &pi, sizeof (PARTITION_INFORMATION_EX), &bytesRead, NULL)))
+   {
+		memset (&info->partInfo, 0, sizeof (info->partInfo));
+
+		info->partInfo.PartitionLength = pi.PartitionLength;
+		info->partInfo.PartitionNumber = pi.PartitionNumber;
+		info->partInfo.StartingOffset = pi.StartingOffset;
+
+		if (pi.PartitionStyle == PARTITION_STYLE_MBR)
+		{
+			info->partInfo.PartitionType = pi.Mbr.PartitionType;
+			info->partInfo.BootIndicator = pi.Mbr.BootIndicator;
+		}
+
+		info->IsGPT = pi.PartitionStyle == PARTITION_STYLE_GPT;
+	}
+	else
+	{
+      bResult = DeviceIoControl (hDev, IOCTL_DISK_GET_PARTITION_INFO, NULL, 0, &info->partInfo, sizeof (PARTITION_INFORMATION), &bytesRead, NULL);			
+		info->IsGPT = FALSE;
+	}
+
+	if (!bResult)
+	{
+		GET_LENGTH_INFORMATION lengthInfo;
+      bResult = DeviceIoControl (hDev, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof (GET_LENGTH_INFORMATION), &bytesRead, NULL);
+
+		if (bResult)
+		{
+			memset (&info->partInfo, 0, sizeof (info->partInfo));
+			info->partInfo.PartitionLength = lengthInfo.Length;
+		}
+	}
+
+	info->IsDynamic = FALSE;
+
+	if (bResult && IsWindowsVista())
+	{
+#define IOCTL_VOLUME_IS_DYNAMIC CTL_CODE(IOCTL_VOLUME_BASE, 18, METHOD_BUFFERED, FILE_ANY_ACCESS)
+      if (!DeviceIoControl (hDev, IOCTL_VOLUME_IS_DYNAMIC, NULL, 0, &info->IsDynamic, sizeof (info->IsDynamic), &bytesRead, NULL))
+			info->IsDynamic = FALSE;
+	}
+
+   return bResult;
+}
+
+
+void UpdateDeviceInfo (HostDevice& device)
+{
+   int driveNumber = GetDiskDeviceDriveLetter ((wchar_t *) device.Path.c_str());
+
+   if (driveNumber >= 0)
+   {
+	   device.MountPoint = (wchar_t) (driveNumber + L'A');
+	   device.MountPoint += L":";
+
+	   wchar_t name[64];
+	   if (GetDriveLabel (driveNumber, name, sizeof (name)))
+		   device.Name = name;
+
+	   if (GetSystemDriveLetter() == L'A' + driveNumber)
+		   device.ContainsSystem = true;
+   }
+}
+
+IoctlBuffer::IoctlBuffer (size_t initialSize)
+	:
+	Data (NULL),
+	Size (initialSize)
+{
+}
+
+IoctlBuffer::~IoctlBuffer ()
+{
+	free (Data);
+}
+
+bool IoctlBuffer::Query (HANDLE hDev, DWORD ioControlCode, const void *input, DWORD inputSize, DWORD *bytesReturned)
+{
+	DWORD dwBytes;
+
+	for (;;)
+	{
+		if (!Data)
+		{
+			Data = (BYTE *) malloc (Size);
+			if (!Data)
+			{
+				SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+				return false;
+			}
+
+			AddInstrumentationCounter (INSTRUMENTATION_ALLOCATIONS, 1);
+			AddInstrumentationCounter (INSTRUMENTATION_ALLOCATED_BYTES, (LONG) Size);
+		}
+
+		AddInstrumentationCounter (INSTRUMENTATION_IOCTLS, 1);
+
+		if (DeviceIoControl (hDev, ioControlCode, (LPVOID) input, inputSize, Data, (DWORD) Size, &dwBytes, NULL))
+		{
+			if (bytesReturned)
+				*bytesReturned = dwBytes;
+			return true;
+		}
+
+		// Not all I/O controls report the size needed, so the buffer is doubled
+		DWORD dwError = GetLastError ();
+		if ((dwError != ERROR_INSUFFICIENT_BUFFER && dwError != ERROR_MORE_DATA) || Size * 2 > IOCTL_BUFFER_MAX_SIZE)
+			return false;
+
+		free (Data);
+		Data = NULL;
+		Size *= 2;
+
+		AddInstrumentationCounter (INSTRUMENTATION_IOCTL_RETRIES, 1);
+	}
+}
+
+bool GetVolumeExtents (HANDLE hDev, vector <HostDeviceExtent> &extents, IoctlBuffer &buffer)
+{
+	extents.clear();
+
+	if (!buffer.Query (hDev, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS))
+		return false;
+
+	PVOLUME_DISK_EXTENTS diskExtents = (PVOLUME_DISK_EXTENTS) buffer.Get();
+
+	for (DWORD i = 0; i < diskExtents->NumberOfDiskExtents; i++)
+	{
+		HostDeviceExtent extent;
+		extent.DiskNumber = diskExtents->Extents[i].DiskNumber;
+		extent.StartingOffset = diskExtents->Extents[i].StartingOffset.QuadPart;
+		extent.Length = diskExtents->Extents[i].ExtentLength.QuadPart;
+		extents.push_back (extent);
+	}
+
+	return true;
+}
+
+static void AddDeviceId (HostDevice &device, const wchar_t *format, ...)
+{
+	wchar_t id[256];
+	va_list args;
+
+	va_start (args, format);
+	HRESULT hr = StringCchVPrintfW (id, ARRAYSIZE (id), format, args);
+	va_end (args);
+
+	if (SUCCEEDED (hr))
+		device.Ids.push_back (id);
+}
+
+static void FormatGuid (const GUID &guid, wchar_t *str, size_t strCount)
+{
+	StringCchPrintfW (str, strCount, L"{%08lX-%04hX-%04hX-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+		guid.Data1, guid.Data2, guid.Data3, guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
+		guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
+}
+
+// Serial number reported by the storage device, trimmed of its padding
+static bool GetDiskSerialNumber (HANDLE hDev, IoctlBuffer &buffer, wchar_t *serial, size_t serialCount)
+{
+	STORAGE_PROPERTY_QUERY query;
+	DWORD bytesReturned;
+
+	ZeroMemory (&query, sizeof (query));
+	query.PropertyId = StorageDeviceProperty;
+	query.QueryType = PropertyStandardQuery;
+
+	if (!buffer.Query (hDev, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof (query), &bytesReturned))
+		return false;
+
+	PSTORAGE_DEVICE_DESCRIPTOR descriptor = (PSTORAGE_DEVICE_DESCRIPTOR) buffer.Get();
+
+	if (bytesReturned < sizeof (STORAGE_DEVICE_DESCRIPTOR) || descriptor->SerialNumberOffset == 0 || descriptor->SerialNumberOffset >= bytesReturned)
+		return false;
+
+	const char *begin = (const char *) descriptor + descriptor->SerialNumberOffset;
+	const char *end = (const char *) memchr (begin, 0, bytesReturned - descriptor->SerialNumberOffset);
+	if (!end)
+		return false;
+
+	while (begin < end && isspace ((unsigned char) *begin))
+		begin++;
+
+	while (end > begin && isspace ((unsigned char) end[-1]))
+		end--;
+
+	if (begin == end || (size_t) (end - begin) >= serialCount)
+		return false;
+
+	size_t i;
+	for (i = 0; begin + i < end; i++)
+		serial[i] = (wchar_t) (unsigned char) begin[i];
+	serial[i] = 0;
+
+	return true;
+}
+
+// The mount manager knows the volume GUID of a device even when it has no drive letter
+static void AddVolumeId (HostDevice &device, const wchar_t *devicePath)
+{
+	wchar_t mountPoint[MAX_PATH];
+	wchar_t volumeName[MAX_PATH];
+
+	StringCchPrintfW (mountPoint, ARRAYSIZE (mountPoint), L"\\\\?\\GLOBALROOT%s\\", devicePath);
+
+	if (GetVolumeNameForVolumeMountPointW (mountPoint, volumeName, ARRAYSIZE (volumeName)))
+	{
+		// \\?\Volume{GUID} followed by a backslash
+		const wchar_t *guid = wcschr (volumeName, L'{');
+		const wchar_t *guidEnd = guid ? wcschr (guid, L'}') : NULL;
+
+		if (guidEnd)
+			AddDeviceId (device, L"volume:%.*s", (int) (guidEnd + 1 - guid), guid);
+	}
+}
+
+static void AddDiskIds (HostDevice &disk, HANDLE hDev, PDRIVE_LAYOUT_INFORMATION_EX layout, DeviceEnumerationArena &arena)
+{
+	wchar_t str[128];
+
+	if (GetDiskSerialNumber (hDev, arena.StorageProperty, str, ARRAYSIZE (str)))
+		AddDeviceId (disk, L"disk:serial:%s", str);
+
+	if (layout && layout->PartitionStyle == PARTITION_STYLE_GPT)
+	{
+		FormatGuid (layout->Gpt.DiskId, str, ARRAYSIZE (str));
+		AddDeviceId (disk, L"disk:gpt:%s", str);
+	}
+	else if (layout && layout->PartitionStyle == PARTITION_STYLE_MBR && layout->Mbr.Signature != 0)
+		AddDeviceId (disk, L"disk:mbr:%08X", layout->Mbr.Signature);
+}
+
+static void AddPartitionIds (HostDevice &device, PDRIVE_LAYOUT_INFORMATION_EX layout, const PARTITION_INFORMATION_EX &partition)
+{
+	wchar_t str[128];
+
+	device.Ids.clear();
+
+	if (partition.PartitionStyle == PARTITION_STYLE_GPT)
+	{
+		FormatGuid (partition.Gpt.PartitionId, str, ARRAYSIZE (str));
+		AddDeviceId (device, L"partition:gpt:%s", str);
+	}
+	else if (partition.PartitionStyle == PARTITION_STYLE_MBR && layout->Mbr.Signature != 0)
+		AddDeviceId (device, L"partition:mbr:%08X:%I64u", layout->Mbr.Signature, partition.StartingOffset.QuadPart);
+
+	if (partition.PartitionNumber > 0)
+		AddVolumeId (device, device.Path.c_str());
+}
+
+// Appends the disk and its partitions, or returns false if the disk does not exist
+static bool AddHostDisk (int devNumber, vector <HostDevice> &devices, DeviceEnumerationArena &arena)
+{
+	bool bFound = false;
+	size_t dev0;
+
+	WCHAR devPath[MAX_PATH];
+	WCHAR partPath[MAX_PATH];
+	StringCchPrintfW (devPath, ARRAYSIZE (devPath), L"\\Device\\Harddisk%d\\Partition0", devNumber);
+   HANDLE hDev;
+
+   WCHAR dosDev[MAX_PATH] = {0};
+   WCHAR devName[MAX_PATH] = {0};
+
+   if (FakeDosNameForDevice ((devNumber+1),devPath, dosDev, sizeof(dosDev), devName, sizeof(devName), FALSE)
+      && ((hDev = CreateFileW (devName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL)) != INVALID_HANDLE_VALUE)
+      )
+   {
+
+		HostDevice device;
+		device.SystemNumber = devNumber;
+		device.Path = devPath;
+
+		// retrieve size using DISK_GEOMETRY
+      bool bGeometryValid = false;
+		DISK_GEOMETRY deviceGeometry = {0};
+		if (	GetDriveGeometry (hDev, &deviceGeometry)
+				||	GetPhysicalDriveGeometry (devNumber, &deviceGeometry)
+			)
+		{
+         bGeometryValid = true;
+		}
+
+      DISK_PARTITION_INFO_STRUCT info;
+		if (GetDeviceInfo (hDev, &info))
+         device.Size = info.partInfo.PartitionLength.QuadPart;
+      else if (bGeometryValid)
+			device.Size = deviceGeometry.Cylinders.QuadPart * (LONGLONG) deviceGeometry.BytesPerSector 
+				* (LONGLONG) deviceGeometry.SectorsPerTrack * (LONGLONG) deviceGeometry.TracksPerCylinder;
+
+		UpdateDeviceInfo (device);
+
+		if (bGeometryValid)
+			device.Removable = (deviceGeometry.MediaType == RemovableMedia);
+
+		devices.push_back (device);
+		dev0 = devices.size() - 1;
+		bFound = true;
+
+      PDRIVE_LAYOUT_INFORMATION_EX layout = NULL;
+      if (arena.DriveLayout.Query (hDev, IOCTL_DISK_GET_DRIVE_LAYOUT_EX))
+         layout = (PDRIVE_LAYOUT_INFORMATION_EX) arena.DriveLayout.Get();
+
+      AddDiskIds (devices[dev0], hDev, layout, arena);
+
+      if (layout)
+      {
+         for (DWORD index = 0; index < layout->PartitionCount; index++)
+         {
+            PARTITION_INFORMATION_EX& partition = layout->PartitionEntry[index];
+            DWORD partNumber = partition.PartitionNumber;
+            if (  (partition.PartitionStyle == PARTITION_STYLE_MBR)
+               && (partition.Mbr.PartitionType == PARTITION_ENTRY_UNUSED)
+               )
+            {
+               continue;
+            }
+
+            if (partNumber > 0)
+               StringCchPrintfW (partPath, ARRAYSIZE (partPath), L"\\Device\\Harddisk%d\\Partition%u", devNumber, partNumber);
+            else
+            {
+               // special case of unrecognized partition by Windows
+               StringCchPrintfW (partPath, ARRAYSIZE (partPath), L"\\Device\\Harddisk%d\\Partition??", devNumber);
+            }
+               
+            device.Path = partPath;
+            device.Size = 0;
+            device.MountPoint = L"";
+            device.Name = L"";
+
+            if (partNumber > 0)
+			      UpdateDeviceInfo (device);
+               
+			   // System creates a virtual partition1 for some storage devices without
+			   // partition table. We try to detect this case by comparing sizes of
+			   // partition0 and partition1. If they match, no partition of the device
+			   // is displayed to the user to avoid confusion. Drive letter assigned by
+			   // system to partition1 is assigned partition0
+            if (partNumber == 1 && (devices[dev0].Size == partition.PartitionLength.QuadPart))
+			   {
+				   devices[dev0].IsVirtualPartition = true;
+				   devices[dev0].MountPoint = device.MountPoint;
+				   devices[dev0].Name = device.Name;
+				   devices[dev0].Path = device.Path;
+				   AddVolumeId (devices[dev0], partPath);
+				   break;
+			   }
+
+			   device.IsPartition = true;
+			   device.SystemNumber = partNumber;
+			   device.Removable = devices[dev0].Removable;
+            device.Size = partition.PartitionLength.QuadPart;
+
+			   HostDeviceExtent extent;
+			   extent.DiskNumber = devNumber;
+			   extent.StartingOffset = partition.StartingOffset.QuadPart;
+			   extent.Length = partition.PartitionLength.QuadPart;
+			   device.Extents.assign (1, extent);
+
+			   AddPartitionIds (device, layout, partition);
+
+			   if (device.ContainsSystem)
+				   devices[dev0].ContainsSystem = true;
+
+			   devices.push_back (device);
+
+			   devices[dev0].Partitions.push_back (device);
+         }
+		}
+
+      CloseHandle (hDev);
+   }
+
+   DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, devPath);
+
+	return bFound;
+}
+
+std::vector <HostDevice> GetAvailableHostDevices (const CancellationToken *cancel)
+{
+	vector <HostDevice> devices;
+
+	// The scratch buffers of the I/O controls are shared by all the devices
+	DeviceEnumerationArena arena;
+
+	for (int devNumber = 0; devNumber < MAX_HOST_DRIVE_NUMBER; devNumber++)
+	{
+		if (IsCancelled (cancel))
+			return devices;
+
+		AddHostDisk (devNumber, devices, arena);
+	}
+
+	// Vista does not create partition links for dynamic volumes so it is necessary to scan \\Device\\HarddiskVolumeX devices
+	if (IsWindowsVista())
+	{
+		for (int devNumber = 0; devNumber < 256; devNumber++)
+		{
+			if (IsCancelled (cancel))
+				break;
+
+			WCHAR devPath[MAX_PATH];
+			StringCchPrintfW (devPath, ARRAYSIZE (devPath), L"\\Device\\HarddiskVolume%d", devNumber);
+
+         HANDLE hDev;
+
+	      WCHAR dosDev[MAX_PATH] = {0};
+	      WCHAR devName[MAX_PATH] = {0};
+
+	      if (FakeDosNameForDevice ((devNumber+1) * MAX_HOST_PARTITION_NUMBER, devPath, dosDev, sizeof(dosDev), devName, sizeof(devName), FALSE)
+            && ((hDev = CreateFileW (devName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL)) != INVALID_HANDLE_VALUE)
+            )
+	      {
+			   DISK_PARTITION_INFO_STRUCT info;
+			   if (GetDeviceInfo (hDev, &info) && info.IsDynamic)
+			   {
+				   HostDevice device;
+				   device.DynamicVolume = true;
+				   device.IsPartition = true;
+				   device.SystemNumber = devNumber;
+				   device.Path = devPath;
+				   device.Size = info.partInfo.PartitionLength.QuadPart;
+
+				   GetVolumeExtents (hDev, device.Extents, arena.VolumeExtents);
+				   AddVolumeId (device, devPath);
+				   UpdateDeviceInfo (device);
+
+				   devices.push_back (device);
+			   }
+
+            CloseHandle (hDev);
+         }
+
+         DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, devPath);
+		}
+	}
+
+	return devices;
+}
+
+bool GetHostDiskDevices (DWORD diskNumber, vector <HostDevice> &devices)
+{
+	DeviceEnumerationArena arena;
+
+	return diskNumber < MAX_HOST_DRIVE_NUMBER && AddHostDisk ((int) diskNumber, devices, arena);
+}
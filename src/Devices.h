@@ -0,0 +1,146 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Devices.h : access to disk devices and partitions
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "ErrorReport.h"
+
+class CancellationToken;
+
+#define EXCL_ACCESS_MAX_AUTO_RETRIES 500
+#define EXCL_ACCESS_AUTO_RETRY_DELAY 10
+
+#define MAX_HOST_DRIVE_NUMBER 64
+#define MAX_HOST_PARTITION_NUMBER 32
+
+// Largest output accepted from a device I/O control
+#define IOCTL_BUFFER_MAX_SIZE (16 * 1024 * 1024)
+
+// Returns true if the path has the form \Device\HarddiskN\...
+bool IsHarddiskDevicePath (const wchar_t *path);
+
+// Parses a \Device\HarddiskN\PartitionM path, M not being 0
+bool ParsePartitionPath (const wchar_t *path, DWORD &diskNumber, DWORD &partitionNumber);
+
+// Opens a device for exclusive read/write access, retrying while it is in use. When bNoBuffering is
+// true, the system cache is bypassed, in which case all transfers must be aligned on the device sector size.
+// Without bWriteThrough, writes may stay in the cache of the device until FlushFileBuffers is called.
+HANDLE OpenDeviceExclusive (LPCWSTR devName, bool bNoBuffering, bool bWriteThrough = true);
+
+// Same as OpenDeviceExclusive, reporting a failure to reporter when it is not NULL
+HANDLE OpenPartitionVolume (ErrorReporter *reporter, LPCWSTR devName, bool bNoBuffering, bool bWriteThrough = true);
+bool FakeDosNameForDevice (DWORD counter, const wchar_t *lpszDiskFile , wchar_t *lpszDosDevice , size_t cbDosDevice, wchar_t *lpszCFDevice , size_t cbCFDevice, BOOL bNameOnly);
+BOOL GetDriveGeometry (HANDLE hDev, PDISK_GEOMETRY diskGeometry);
+bool SymbolicLinkToTarget (PWSTR symlinkName, PWSTR targetName, USHORT maxTargetNameLength);
+
+// Returns the drive letter number (0 for A:) assigned to a device, or -1 if none
+int GetDiskDeviceDriveLetter (PWSTR deviceName);
+
+// Returns the drive letter (upper case) of the system partition, or 0 on error
+wchar_t GetSystemDriveLetter (void);
+
+// Returns the size in bytes of an open partition or disk
+bool GetDeviceLength (HANDLE hDev, ULONGLONG &length);
+
+// Region of a disk occupied by a partition or volume
+struct HostDeviceExtent
+{
+	DWORD DiskNumber;
+	ULONGLONG StartingOffset;
+	ULONGLONG Length;
+};
+
+// Output buffer of DeviceIoControl, reused by successive calls. It is allocated on first use
+// and grown while the output does not fit, so that it adapts to the largest output seen.
+class IoctlBuffer
+{
+public:
+	IoctlBuffer (size_t initialSize);
+	~IoctlBuffer ();
+
+	bool Query (HANDLE hDev, DWORD ioControlCode, const void *input = NULL, DWORD inputSize = 0, DWORD *bytesReturned = NULL);
+
+	void *Get () const { return Data; }
+	size_t GetSize () const { return Size; }
+
+protected:
+	BYTE *Data;
+	size_t Size;
+
+private:
+	IoctlBuffer (const IoctlBuffer &);
+	IoctlBuffer &operator= (const IoctlBuffer &);
+};
+
+// Scratch buffers of a device enumeration, sized for common disks
+struct DeviceEnumerationArena
+{
+	DeviceEnumerationArena ()
+		:
+		DriveLayout (sizeof (DRIVE_LAYOUT_INFORMATION_EX) + 16 * sizeof (PARTITION_INFORMATION_EX)),
+		VolumeExtents (sizeof (VOLUME_DISK_EXTENTS) + 8 * sizeof (DISK_EXTENT)),
+		StorageProperty (1024)
+	{
+	}
+
+	IoctlBuffer DriveLayout;
+	IoctlBuffer VolumeExtents;
+	IoctlBuffer StorageProperty;
+};
+
+// Retrieves the extents of an open volume
+bool GetVolumeExtents (HANDLE hDev, std::vector <HostDeviceExtent> &extents, IoctlBuffer &buffer);
+
+struct HostDevice
+{
+	HostDevice ()
+		:
+		Bootable (false),
+		ContainsSystem (false),
+		DynamicVolume (false),
+		Floppy (false),
+		IsPartition (false),
+		IsVirtualPartition (false),
+		Removable (false),
+		Size (0),
+		SystemNumber((DWORD) -1)
+	{
+	}
+
+	~HostDevice () { }
+
+	bool Bootable;
+	bool ContainsSystem;
+	bool DynamicVolume;
+	bool Floppy;
+	bool IsPartition;
+	bool IsVirtualPartition;
+	std::wstring MountPoint;
+	std::wstring Name;
+	std::wstring Path;
+	bool Removable;
+	ULONGLONG Size;
+	DWORD SystemNumber;
+
+	std::vector <HostDeviceExtent> Extents;		// Empty for disks
+	std::vector <std::wstring> Ids;				// Identities that do not depend on the device numbering (see DeviceId.h)
+	std::vector <HostDevice> Partitions;
+};
+
+// When cancel is not NULL, the enumeration stops before the next device once it is cancelled, returning
+// the devices found so far: the caller tells from the token that the list is partial.
+std::vector <HostDevice> GetAvailableHostDevices (const CancellationToken *cancel = NULL);
+
+// Appends a disk (\Device\HarddiskN\...) and its partitions to devices, in the order of GetAvailableHostDevices.
+// Returns false if the disk does not exist.
+bool GetHostDiskDevices (DWORD diskNumber, std::vector <HostDevice> &devices);
@@ -0,0 +1,489 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <algorithm>
+
+#include "DiskSession.h"
+#include "Checksum.h"
+#include "DeviceId.h"
+#include "Devices.h"
+#include "IoBufferPool.h"
+#include "Throttle.h"
+
+#define DISK_SESSION_HEADER_SIZE		TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE
+
+// A target opened and locked for the session
+struct SessionTarget
+{
+	SessionTarget (size_t index, const wchar_t *path)
+		:
+		Index (index),
+		Volume (INVALID_HANDLE_VALUE),
+		DiskOffset (0),
+		Errors (path)
+	{
+		DosDev[0] = 0;
+	}
+
+	size_t Index;					// In the targets of the caller
+	WCHAR DosDev[MAX_PATH];
+	HANDLE Volume;
+	ULONGLONG DiskOffset;			// Of the partition
+	ErrorCollector Errors;			// The target failed if it holds any
+	ConcealTransform Transform;		// Of the partition
+};
+
+struct SessionTargetOffsetLess
+{
+	bool operator() (const SessionTarget &a, const SessionTarget &b) const
+	{
+		return a.DiskOffset < b.DiskOffset;
+	}
+};
+
+// Headers adjacent on the disk, transferred together. Their targets are consecutive in the sorted targets,
+// and so are their slots in the buffer of the session.
+struct SessionRegion
+{
+	ULONGLONG DiskOffset;
+	DWORD Size;
+	size_t FirstTarget;
+	size_t TargetCount;
+	bool Failed;
+};
+
+// Records the last error as the failure of every target of a region
+static void FailRegion (vector <SessionTarget> &targets, SessionRegion &region, const wchar_t *operation, const wchar_t *details = NULL)
+{
+	for (size_t i = region.FirstTarget; i < region.FirstTarget + region.TargetCount; i++)
+		targets[i].Errors.Fail (operation, NULL, 0, details);
+
+	region.Failed = true;
+}
+
+static bool TransferRegion (HANDLE hDisk, const SessionRegion &region, BYTE *data, bool bWrite, IoThrottle *throttle)
+{
+	LARGE_INTEGER pos;
+	DWORD bytesTransferred;
+	BOOL bResult;
+
+	if (throttle)
+		throttle->Acquire (region.Size);
+
+	pos.QuadPart = region.DiskOffset;
+
+	if (SetFilePointerEx (hDisk, pos, NULL, FILE_BEGIN) == 0)
+		return false;
+
+	if (bWrite)
+		bResult = WriteFile (hDisk, data, region.Size, &bytesTransferred, NULL);
+	else
+		bResult = ReadFile (hDisk, data, region.Size, &bytesTransferred, NULL);
+
+	if (!bResult)
+		return false;
+
+	if (bytesTransferred != region.Size)
+	{
+		SetLastError (ERROR_HANDLE_EOF);
+		return false;
+	}
+
+	return true;
+}
+
+// Derives the transform of a target from the partitions of the disk, which are only enumerated with a key
+static bool IdentifySessionTarget (SessionTarget &target, const wstring &path, const vector <HostDevice> &partitions,
+	const ConcealTransform *transform)
+{
+	if (!transform || transform->Mode != CONCEAL_TRANSFORM_KEYSTREAM)
+	{
+		target.Transform = transform ? *transform : ConcealTransform ();
+		return true;
+	}
+
+	for (vector <HostDevice>::const_iterator It = partitions.begin(); It != partitions.end(); It++)
+	{
+		if (_wcsicmp (It->Path.c_str(), path.c_str()) != 0)
+			continue;
+
+		if (GetDeviceTransform (*It, transform, target.Transform))
+			return true;
+
+		target.Errors.Fail (L"identify", NULL);
+		return false;
+	}
+
+	SetLastError (ERROR_FILE_NOT_FOUND);
+	target.Errors.Fail (L"identify", NULL);
+	return false;
+}
+
+// Opens a partition exclusively and locks it, so that its header can be written through the disk
+static void OpenSessionTarget (SessionTarget &target, const wstring &path, DWORD diskNumber, DWORD dosDeviceCounter)
+{
+	WCHAR devName[MAX_PATH] = {0};
+	PARTITION_INFORMATION_EX partitionInfo;
+	DWORD number, partitionNumber;
+	DWORD dwResult;
+
+	if (!ParsePartitionPath (path.c_str(), number, partitionNumber) || number != diskNumber)
+	{
+		SetLastError (ERROR_INVALID_PARAMETER);
+		target.Errors.Fail (L"check partition", NULL, CONCEAL_ERROR_NO_OFFSET, L"The device is not a partition of the disk of the session.");
+		return;
+	}
+
+	if (!FakeDosNameForDevice (dosDeviceCounter, path.c_str(), target.DosDev, sizeof (target.DosDev), devName, sizeof (devName), FALSE))
+	{
+		target.DosDev[0] = 0;
+		target.Errors.Fail (L"define device name", NULL);
+		return;
+	}
+
+	// On failure, the error is reported to the target
+	target.Volume = OpenPartitionVolume (&target.Errors, devName, false);
+	if (target.Volume == INVALID_HANDLE_VALUE)
+		return;
+
+	// Writes to the disk within a mounted volume are only allowed while the volume is locked
+	if (!DeviceIoControl (target.Volume, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &dwResult, NULL))
+		target.Errors.Fail (L"lock", NULL);
+	else if (!DeviceIoControl (target.Volume, IOCTL_DISK_GET_PARTITION_INFO_EX, NULL, 0, &partitionInfo, sizeof (partitionInfo), &dwResult, NULL))
+		target.Errors.Fail (L"get partition information", NULL);
+	else if ((ULONGLONG) partitionInfo.PartitionLength.QuadPart < DISK_SESSION_HEADER_SIZE)
+	{
+		SetLastError (ERROR_HANDLE_EOF);
+		target.Errors.Fail (L"check partition", NULL);
+	}
+	else
+		target.DiskOffset = partitionInfo.StartingOffset.QuadPart;
+}
+
+// Groups the sorted targets into regions of adjacent headers
+static void BuildSessionRegions (const vector <SessionTarget> &targets, vector <SessionRegion> &regions)
+{
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		if (targets[i].Errors.HasFailed ())
+			continue;
+
+		if (!regions.empty())
+		{
+			SessionRegion &last = regions.back();
+
+			if (last.FirstTarget + last.TargetCount == i && last.DiskOffset + last.Size == targets[i].DiskOffset)
+			{
+				last.Size += DISK_SESSION_HEADER_SIZE;
+				last.TargetCount++;
+				continue;
+			}
+		}
+
+		SessionRegion region;
+		region.DiskOffset = targets[i].DiskOffset;
+		region.Size = DISK_SESSION_HEADER_SIZE;
+		region.FirstTarget = i;
+		region.TargetCount = 1;
+		region.Failed = false;
+
+		regions.push_back (region);
+	}
+}
+
+// Flushes the headers written to the disk. If the flush fails, the original headers are written back
+// and flushed, and the targets of all the regions written fail.
+static bool FlushSessionRegions (HANDLE hDisk, vector <SessionTarget> &targets, vector <SessionRegion> &regions, BYTE *buffer)
+{
+	bool bRestored = true;
+	DWORD dwError;
+	size_t r;
+
+	if (FlushFileBuffers (hDisk))
+		return true;
+
+	dwError = GetLastError ();
+
+	for (r = regions.size(); r-- > 0; )
+	{
+		SessionRegion &region = regions[r];
+
+		if (region.Failed)
+			continue;
+
+		for (size_t i = region.FirstTarget; i < region.FirstTarget + region.TargetCount; i++)
+			ApplyConcealTransform (&targets[i].Transform, buffer + i * DISK_SESSION_HEADER_SIZE, DISK_SESSION_HEADER_SIZE, 0);
+
+		if (!TransferRegion (hDisk, region, buffer + region.FirstTarget * DISK_SESSION_HEADER_SIZE, true, NULL))
+			bRestored = false;
+	}
+
+	if (!FlushFileBuffers (hDisk))
+		bRestored = false;
+
+	for (r = 0; r < regions.size(); r++)
+	{
+		if (regions[r].Failed)
+			continue;
+
+		SetLastError (dwError);
+		FailRegion (targets, regions[r], L"flush", bRestored
+			? L"The original data has been written back."
+			: L"The original data could not be written back: the beginning of the device may be partially transformed.");
+	}
+
+	return false;
+}
+
+// Reads the headers, transforms them and writes them back, then optionally reads them back
+static void ProcessSessionRegions (HANDLE hDisk, vector <SessionTarget> &targets, vector <SessionRegion> &regions,
+	vector <DiskSessionTarget> &results, BYTE *buffer, bool bVerify, IoThrottle *throttle)
+{
+	BYTE *readBackBuffer = NULL;
+	DWORD maxRegionSize = 0;
+	size_t r;
+
+	// Ascending sweep
+	for (r = 0; r < regions.size(); r++)
+	{
+		SessionRegion &region = regions[r];
+
+		if (!TransferRegion (hDisk, region, buffer + region.FirstTarget * DISK_SESSION_HEADER_SIZE, false, throttle))
+		{
+			FailRegion (targets, region, L"read");
+			continue;
+		}
+
+		maxRegionSize = max (maxRegionSize, region.Size);
+
+		for (size_t i = region.FirstTarget; i < region.FirstTarget + region.TargetCount; i++)
+		{
+			BYTE *header = buffer + i * DISK_SESSION_HEADER_SIZE;
+			DiskSessionTarget &result = results[targets[i].Index];
+
+			result.HadFileSystemBefore = GetFileSystemSignatureName (header) != NULL;
+			result.Verification.BeforeDigest = Crc32c (0, header, DISK_SESSION_HEADER_SIZE);
+
+			ApplyConcealTransform (&targets[i].Transform, header, DISK_SESSION_HEADER_SIZE, 0);
+
+			result.Verification.AfterDigest = Crc32c (0, header, DISK_SESSION_HEADER_SIZE);
+		}
+	}
+
+	// Descending sweep
+	for (r = regions.size(); r-- > 0; )
+	{
+		SessionRegion &region = regions[r];
+		BYTE *data = buffer + region.FirstTarget * DISK_SESSION_HEADER_SIZE;
+		DWORD dwError;
+		size_t i;
+
+		if (region.Failed)
+			continue;
+
+		if (TransferRegion (hDisk, region, data, true, throttle))
+		{
+			for (i = region.FirstTarget; i < region.FirstTarget + region.TargetCount; i++)
+				results[targets[i].Index].HasFileSystemNow = GetFileSystemSignatureName (buffer + i * DISK_SESSION_HEADER_SIZE) != NULL;
+
+			continue;
+		}
+
+		// The original headers are written back, as ConcealNTFS does
+		dwError = GetLastError ();
+
+		for (i = region.FirstTarget; i < region.FirstTarget + region.TargetCount; i++)
+			ApplyConcealTransform (&targets[i].Transform, buffer + i * DISK_SESSION_HEADER_SIZE, DISK_SESSION_HEADER_SIZE, 0);
+
+		for (int retry = 0; retry < CONCEAL_ROLLBACK_MAX_RETRIES; retry++)
+		{
+			Sleep (CONCEAL_ROLLBACK_RETRY_DELAY);
+
+			if (TransferRegion (hDisk, region, data, true, NULL))
+			{
+				SetLastError (dwError);
+				FailRegion (targets, region, L"write", L"The original data has been written back.");
+				break;
+			}
+		}
+
+		if (!region.Failed)
+		{
+			SetLastError (dwError);
+			FailRegion (targets, region, L"write", L"The original data could not be written back: the beginning of the device may be partially transformed.");
+		}
+	}
+
+	// The headers are written through the cache of the disk, and made stable by a single flush of the session
+	if (!FlushSessionRegions (hDisk, targets, regions, buffer))
+		return;
+
+	if (!bVerify || maxRegionSize == 0)
+		return;
+
+	// Page aligned, as the disk is opened with FILE_FLAG_NO_BUFFERING
+	readBackBuffer = AcquireIoBuffer (maxRegionSize);
+
+	for (r = 0; r < regions.size(); r++)
+	{
+		SessionRegion &region = regions[r];
+
+		if (region.Failed)
+			continue;
+
+		if (!readBackBuffer)
+		{
+			FailRegion (targets, region, L"allocate");
+			continue;
+		}
+
+		if (!TransferRegion (hDisk, region, readBackBuffer, false, throttle))
+		{
+			FailRegion (targets, region, L"read back");
+			continue;
+		}
+
+		for (size_t i = region.FirstTarget; i < region.FirstTarget + region.TargetCount; i++)
+		{
+			ConcealVerification &verification = results[targets[i].Index].Verification;
+
+			verification.ReadBackDigest = Crc32c (0, readBackBuffer + (i - region.FirstTarget) * DISK_SESSION_HEADER_SIZE, DISK_SESSION_HEADER_SIZE);
+			verification.Verified = (verification.ReadBackDigest == verification.AfterDigest);
+
+			if (!verification.Verified)
+			{
+				wchar_t details[256];
+
+				StringCchPrintfW (details, ARRAYSIZE (details), L"The data read back from the device does not match the data written to it (CRC32C expected: %.8X, read: %.8X). The device may be defective.",
+					verification.AfterDigest, verification.ReadBackDigest);
+
+				SetLastError (ERROR_CRC);
+				targets[i].Errors.Fail (L"verify", NULL, 0, details);
+			}
+		}
+	}
+
+	if (readBackBuffer)
+		ReleaseIoBuffer (readBackBuffer, maxRegionSize);
+}
+
+bool RunDiskSession (DWORD diskNumber, DWORD dosDeviceCounter, vector <DiskSessionTarget> &targets,
+	const ConcealTransform *transform, bool bVerify, IoThrottle *throttle, bool bLowPriority)
+{
+	WCHAR diskPath[MAX_PATH];
+	WCHAR diskDosDev[MAX_PATH] = {0};
+	WCHAR devName[MAX_PATH] = {0};
+	vector <SessionTarget> sessionTargets;
+	vector <SessionRegion> regions;
+	vector <HostDevice> partitions;
+	HANDLE hDisk = INVALID_HANDLE_VALUE;
+	BYTE *buffer = NULL;
+	bool bResult = true;
+	size_t i;
+
+	StringCchPrintfW (diskPath, ARRAYSIZE (diskPath), L"\\Device\\Harddisk%u\\Partition0", diskNumber);
+
+	for (i = 0; i < targets.size(); i++)
+	{
+		DiskSessionTarget &target = targets[i];
+
+		target.Success = false;
+		target.LastError = ERROR_SUCCESS;
+		target.HadFileSystemBefore = false;
+		target.HasFileSystemNow = false;
+		memset (&target.Verification, 0, sizeof (target.Verification));
+		target.Errors.clear();
+
+		sessionTargets.push_back (SessionTarget (i, target.Path.c_str()));
+	}
+
+	// Shared with the volumes of the partitions that are not targets
+	if (!FakeDosNameForDevice (dosDeviceCounter, diskPath, diskDosDev, sizeof (diskDosDev), devName, sizeof (devName), FALSE))
+	{
+		diskDosDev[0] = 0;
+
+		for (i = 0; i < sessionTargets.size(); i++)
+			sessionTargets[i].Errors.Fail (L"define device name", diskPath);
+	}
+	else
+	{
+		hDisk = CreateFileW (devName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+			FILE_FLAG_NO_BUFFERING, NULL);
+
+		if (hDisk == INVALID_HANDLE_VALUE)
+		{
+			for (i = 0; i < sessionTargets.size(); i++)
+				sessionTargets[i].Errors.Fail (L"open", diskPath);
+		}
+		else if (bLowPriority)
+			SetLowIoPriority (hDisk);
+	}
+
+	if (hDisk != INVALID_HANDLE_VALUE)
+	{
+		// The keystream of each partition is selected by its identity
+		if (transform && transform->Mode == CONCEAL_TRANSFORM_KEYSTREAM)
+			GetHostDiskDevices (diskNumber, partitions);
+
+		// Each partition is locked once, for the whole session
+		for (i = 0; i < sessionTargets.size(); i++)
+		{
+			if (IdentifySessionTarget (sessionTargets[i], targets[i].Path, partitions, transform))
+				OpenSessionTarget (sessionTargets[i], targets[i].Path, diskNumber, targets[i].DosDeviceCounter);
+		}
+
+		std::sort (sessionTargets.begin(), sessionTargets.end(), SessionTargetOffsetLess ());
+		BuildSessionRegions (sessionTargets, regions);
+
+		// One slot per target, page aligned as the disk is opened with FILE_FLAG_NO_BUFFERING
+		if (!regions.empty())
+		{
+			buffer = AcquireIoBuffer (sessionTargets.size() * DISK_SESSION_HEADER_SIZE);
+
+			if (!buffer)
+			{
+				for (size_t r = 0; r < regions.size(); r++)
+					FailRegion (sessionTargets, regions[r], L"allocate");
+			}
+			else
+				ProcessSessionRegions (hDisk, sessionTargets, regions, targets, buffer, bVerify, throttle);
+		}
+	}
+
+	for (i = 0; i < sessionTargets.size(); i++)
+	{
+		SessionTarget &sessionTarget = sessionTargets[i];
+		DiskSessionTarget &target = targets[sessionTarget.Index];
+
+		// Closing the partition unlocks it
+		if (sessionTarget.Volume != INVALID_HANDLE_VALUE)
+			CloseHandle (sessionTarget.Volume);
+
+		if (sessionTarget.DosDev[0])
+			DefineDosDevice (DDD_REMOVE_DEFINITION, sessionTarget.DosDev, target.Path.c_str());
+
+		target.Success = !sessionTarget.Errors.HasFailed ();
+		target.LastError = sessionTarget.Errors.GetLastFailure ();
+		target.Errors = sessionTarget.Errors.GetErrors ();
+
+		if (!target.Success)
+			bResult = false;
+	}
+
+	if (buffer)
+		ReleaseIoBuffer (buffer, sessionTargets.size() * DISK_SESSION_HEADER_SIZE);
+
+	if (hDisk != INVALID_HANDLE_VALUE)
+		CloseHandle (hDisk);
+
+	if (diskDosDev[0])
+		DefineDosDevice (DDD_REMOVE_DEFINITION, diskDosDev, diskPath);
+
+	return bResult;
+}
@@ -0,0 +1,57 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// DiskSession.h : transformation of the headers of several partitions of a disk in one pass
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Conceal.h"
+
+class IoThrottle;
+
+struct DiskSessionTarget
+{
+	DiskSessionTarget ()
+		:
+		DosDeviceCounter (0),
+		Success (false),
+		LastError (ERROR_SUCCESS),
+		HadFileSystemBefore (false),
+		HasFileSystemNow (false)
+	{
+		memset (&Verification, 0, sizeof (Verification));
+	}
+
+	std::wstring Path;				// \Device\HarddiskN\PartitionM on the disk of the session
+	DWORD DosDeviceCounter;			// Names the DOS device of the partition
+
+	// Set by RunDiskSession
+	bool Success;
+	DWORD LastError;
+	bool HadFileSystemBefore;
+	bool HasFileSystemNow;
+	ConcealVerification Verification;
+	std::vector <ConcealError> Errors;
+};
+
+// Applies the transformation to the first TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE bytes of several partitions of
+// a disk, with the same result as ConcealNTFS on each of them. Each partition is opened exclusively and
+// locked once for the whole session, then the headers are transferred through a single handle of the disk:
+// read in ascending order of their offset on the disk and written back in descending order, so that the heads
+// sweep the disk once each way, headers adjacent on the disk being merged into a single transfer. The writes
+// are not written through: the disk is flushed once after the descending sweep, and all the headers written
+// are restored if that flush fails. With bVerify, the headers written are read back in a last ascending pass.
+// A header that cannot be written is restored as ConcealNTFS does, and only the targets of its transfer fail.
+// dosDeviceCounter names the DOS device of the disk. With a key, each partition is transformed with its own
+// keystream (see GetDeviceTransform). When throttle is not NULL, each transfer waits until the throttle
+// allows it. Returns true if all the targets succeeded.
+bool RunDiskSession (DWORD diskNumber, DWORD dosDeviceCounter, std::vector <DiskSessionTarget> &targets,
+	const ConcealTransform *transform, bool bVerify, IoThrottle *throttle = NULL, bool bLowPriority = false);
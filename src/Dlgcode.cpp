@@ -0,0 +1,57 @@
+/*
+ Derived from source code of TrueCrypt 7.1a, which is
+ Copyright (c) 2008-2012 TrueCrypt Developers Association and which is governed
+ by the TrueCrypt License 3.0.
+
+ Modifications and additions to the original source code (contained in this file)
+ and all other portions of this file are Copyright (c) 2013-2016 IDRIX
+ and are governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "Dlgcode.h"
+
+void GetSizeString (unsigned __int64 size, wchar_t *str, size_t cbStr)
+{
+	if (size > 1024I64*1024*1024*1024*1024)
+		StringCbPrintfW (str, cbStr, L"%.2f PiB",(double)size/ (double) (1024.0*1024*1024*1024*1024));
+	else if (size > 1024I64*1024*1024*1024)
+		StringCbPrintfW (str, cbStr, L"%.2f TiB",(double)size/(double) (1024.0*1024*1024*1024));
+	else if (size > 1024I64*1024*1024)
+		StringCbPrintfW (str, cbStr, L"%.2f GiB",(double)size/(double) (1024.0*1024*1024));
+	else if (size > 1024I64*1024)
+		StringCbPrintfW (str, cbStr, L"%.2f MiB",(double)size/(double) (1024.0*1024));
+	else if (size >= 1024I64)
+		StringCbPrintfW (str, cbStr, L"%.2f KiB", (double) size/ (double) 1024.0);
+	else
+		StringCbPrintfW (str, cbStr, L"%I64d Bytes", size);
+}
+
+void Error (LPCTSTR szMsg, HWND hWnd)
+{
+   MessageBox (hWnd, szMsg, L"Error", MB_ICONERROR);
+}
+
+void GetWin32ErrorMessage (DWORD dwError, wchar_t *msg, size_t msgCount)
+{
+	DWORD len = FormatMessageW (FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, dwError,
+		MAKELANGID (LANG_NEUTRAL, SUBLANG_DEFAULT), msg, (DWORD) msgCount, NULL);
+
+	if (len == 0)
+	{
+		StringCchPrintfW (msg, msgCount, L"Error 0x%.8X", dwError);
+		return;
+	}
+
+	// System messages end with a line break, and some span several lines
+	for (DWORD i = 0; i < len; i++)
+	{
+		if (msg[i] == L'\r' || msg[i] == L'\n' || msg[i] == L'\t')
+			msg[i] = L' ';
+	}
+
+	while (len > 0 && msg[len - 1] == L' ')
+		msg[--len] = 0;
+}
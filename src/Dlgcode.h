@@ -0,0 +1,20 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Dlgcode.h : helpers shared by the dialogs and the command line operations
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+void GetSizeString (unsigned __int64 size, wchar_t *str, size_t cbStr);
+void Error (LPCTSTR szMsg, HWND hWnd);
+
+// Formats the system message of an error on a single line, or its code if there is no message
+void GetWin32ErrorMessage (DWORD dwError, wchar_t *msg, size_t msgCount);
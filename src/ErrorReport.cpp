@@ -0,0 +1,83 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+
+#include "Dlgcode.h"
+#include "ErrorReport.h"
+
+void FormatConcealError (const ConcealError &error, wchar_t *text, size_t textCount)
+{
+	wchar_t msg[512];
+	wchar_t offset[64] = L"";
+
+	GetWin32ErrorMessage (error.Code, msg, ARRAYSIZE (msg));
+
+	if (error.Offset != CONCEAL_ERROR_NO_OFFSET)
+		StringCchPrintfW (offset, ARRAYSIZE (offset), L" at offset %I64u", error.Offset);
+
+	StringCchPrintfW (text, textCount, L"%s%s%s%s: %s%s%s",
+		error.Operation, error.Device.empty() ? L"" : L" ", error.Device.c_str(), offset, msg,
+		error.Details.empty() ? L"" : L" ", error.Details.c_str());
+}
+
+void ReportLastError (ErrorReporter *reporter, const wchar_t *operation, const wchar_t *device, ULONGLONG offset, const wchar_t *details)
+{
+	DWORD dwError = GetLastError ();
+
+	if (reporter)
+	{
+		ConcealError error;
+
+		error.Code = dwError;
+		error.Operation = operation;
+		error.Offset = offset;
+
+		if (device)
+			error.Device = device;
+
+		if (details)
+			error.Details = details;
+
+		reporter->Report (error);
+	}
+
+	SetLastError (dwError);		// Preserve the original error code
+}
+
+void MessageBoxErrorReporter::Report (const ConcealError &error)
+{
+	wchar_t msg[512];
+	wchar_t text[2048];
+
+	ConcealError summary = error;
+	summary.Details.clear();
+
+	FormatConcealError (summary, msg, ARRAYSIZE (msg));
+
+	// The details come first, as they tell the user what to do
+	if (error.Details.empty())
+		StringCchCopyW (text, ARRAYSIZE (text), msg);
+	else
+		StringCchPrintfW (text, ARRAYSIZE (text), L"%s\n\n%s", error.Details.c_str(), msg);
+
+	MessageBoxW (Owner, text, error.Details.empty() ? L"System Error" : L"Error", MB_ICONERROR);
+}
+
+void ErrorCollector::Report (const ConcealError &error)
+{
+	Errors.push_back (error);
+
+	if (Errors.back().Device.empty())
+		Errors.back().Device = Device;
+}
+
+void ErrorCollector::Fail (const wchar_t *operation, const wchar_t *device, ULONGLONG offset, const wchar_t *details)
+{
+	ReportLastError (this, operation, device, offset, details);
+}
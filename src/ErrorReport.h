@@ -0,0 +1,83 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// ErrorReport.h : errors of the operations on devices and their reporting
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Offset of an error that does not relate to a position on the device
+#define CONCEAL_ERROR_NO_OFFSET		((ULONGLONG) -1)
+
+struct ConcealError
+{
+	ConcealError ()
+		:
+		Code (ERROR_SUCCESS),
+		Operation (L""),
+		Offset (CONCEAL_ERROR_NO_OFFSET)
+	{
+	}
+
+	DWORD Code;						// Win32 error code (GetLastError)
+	const wchar_t *Operation;		// Static string naming the failed operation (open, read, write, verify...)
+	std::wstring Device;			// Device or file, empty if the reporter supplies it
+	ULONGLONG Offset;				// Position on the device, or CONCEAL_ERROR_NO_OFFSET
+	std::wstring Details;			// Explanation for the user, empty if the system message says it all
+};
+
+// Formats an error on a single line: operation, device, offset, system message and details
+void FormatConcealError (const ConcealError &error, wchar_t *text, size_t textCount);
+
+// Receives the errors of the operations. The operations report their errors to it rather than to the
+// user, and still return failure with the last error set, so that they never wait for the user.
+class ErrorReporter
+{
+public:
+	virtual ~ErrorReporter () { }
+	virtual void Report (const ConcealError &error) = 0;
+};
+
+// Reports the last Win32 error of an operation, which is preserved. Does nothing if reporter is NULL.
+void ReportLastError (ErrorReporter *reporter, const wchar_t *operation, const wchar_t *device,
+	ULONGLONG offset = CONCEAL_ERROR_NO_OFFSET, const wchar_t *details = NULL);
+
+// Displays each error in a message box owned by a window
+class MessageBoxErrorReporter : public ErrorReporter
+{
+public:
+	MessageBoxErrorReporter (HWND hwndOwner) : Owner (hwndOwner) { }
+	virtual void Report (const ConcealError &error);
+
+protected:
+	HWND Owner;
+};
+
+// Keeps the errors of the operations on one device, which is recorded in errors that do not name
+// it. An instance must be used by one thread at a time.
+class ErrorCollector : public ErrorReporter
+{
+public:
+	ErrorCollector (const wchar_t *device) : Device (device) { }
+	virtual void Report (const ConcealError &error);
+
+	// Reports the last error, which is preserved, as a failure of the operations on the device
+	void Fail (const wchar_t *operation, const wchar_t *device, ULONGLONG offset = CONCEAL_ERROR_NO_OFFSET, const wchar_t *details = NULL);
+
+	// Every error reported is a failure of the device; the last one gives the code of the result
+	bool HasFailed () const { return !Errors.empty(); }
+	DWORD GetLastFailure () const { return Errors.empty() ? ERROR_SUCCESS : Errors.back().Code; }
+
+	const std::vector <ConcealError> &GetErrors () const { return Errors; }
+
+protected:
+	std::wstring Device;
+	std::vector <ConcealError> Errors;
+};
@@ -0,0 +1,127 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "ImageFile.h"
+#include "DeviceId.h"
+
+bool MapImageFile (const wchar_t *path, SIZE_T maxViewSize, MappedImage &image)
+{
+	LARGE_INTEGER fileSize;
+
+	image.File = CreateFileW (path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (image.File == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (!GetFileSizeEx (image.File, &fileSize))
+	{
+		UnmapImageFile (image);
+		return false;
+	}
+
+	// Empty files cannot be mapped
+	if (fileSize.QuadPart == 0)
+	{
+		UnmapImageFile (image);
+		SetLastError (ERROR_HANDLE_EOF);
+		return false;
+	}
+
+	image.Size = fileSize.QuadPart;
+	image.ViewSize = (image.Size < maxViewSize) ? (SIZE_T) image.Size : maxViewSize;
+
+	image.Mapping = CreateFileMappingW (image.File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (image.Mapping == NULL)
+	{
+		UnmapImageFile (image);
+		return false;
+	}
+
+	image.View = (const BYTE *) MapViewOfFile (image.Mapping, FILE_MAP_READ, 0, 0, image.ViewSize);
+	if (image.View == NULL)
+	{
+		UnmapImageFile (image);
+		return false;
+	}
+
+	// Fault the whole view in with a single I/O instead of one page fault per page.
+	// Large pages are not available for file backed sections, so regular pages are used.
+	if (PrefetchVirtualMemory)
+	{
+		WIN32_MEMORY_RANGE_ENTRY range;
+		range.VirtualAddress = (PVOID) image.View;
+		range.NumberOfBytes = image.ViewSize;
+
+		PrefetchVirtualMemory (GetCurrentProcess (), 1, &range, 0);
+	}
+
+	return true;
+}
+
+void UnmapImageFile (MappedImage &image)
+{
+	DWORD dwError = GetLastError ();
+
+	if (image.View)
+		UnmapViewOfFile (image.View);
+
+	if (image.Mapping)
+		CloseHandle (image.Mapping);
+
+	if (image.File != INVALID_HANDLE_VALUE)
+		CloseHandle (image.File);
+
+	image.View = NULL;
+	image.ViewSize = 0;
+	image.Mapping = NULL;
+	image.File = INVALID_HANDLE_VALUE;
+
+	SetLastError (dwError);		// Preserve the original error code
+}
+
+static bool ProbeMappedHeader (const BYTE *header, ConcealState &state, const wchar_t **fileSystemName, const ConcealTransform *transform)
+{
+	// The image may be truncated by another process while it is mapped, in which case
+	// touching the view raises an in-page error instead of failing a ReadFile call
+	__try
+	{
+		state = GetConcealState (header, fileSystemName, transform);
+	}
+	__except (GetExceptionCode () == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+	{
+		SetLastError (ERROR_READ_FAULT);
+		return false;
+	}
+
+	return true;
+}
+
+bool GetImageConcealState (const wchar_t *path, ConcealState &state, const wchar_t **fileSystemName, const ConcealTransform *transform)
+{
+	MappedImage image;
+	ConcealTransform imageTransform;
+	bool bResult;
+
+	state = CONCEAL_STATE_UNKNOWN;
+	if (fileSystemName)
+		*fileSystemName = NULL;
+
+	if (!GetDeviceTransform (path, transform, imageTransform))
+		return false;
+
+	if (!MapImageFile (path, TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE, image))
+		return false;
+
+	if (image.ViewSize < CONCEAL_SIGNATURE_SIZE)
+		bResult = true;
+	else
+		bResult = ProbeMappedHeader (image.View, state, fileSystemName, &imageTransform);
+
+	UnmapImageFile (image);
+	return bResult;
+}
@@ -0,0 +1,43 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// ImageFile.h : zero-copy access to disk image files through memory mapped views
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Conceal.h"
+
+struct MappedImage
+{
+	MappedImage ()
+		:
+		File (INVALID_HANDLE_VALUE),
+		Mapping (NULL),
+		View (NULL),
+		ViewSize (0),
+		Size (0)
+	{
+	}
+
+	HANDLE File;
+	HANDLE Mapping;
+	const BYTE *View;
+	SIZE_T ViewSize;
+	ULONGLONG Size;
+};
+
+// Maps a read-only view of the first maxViewSize bytes of an image file (or of the whole
+// file if it is smaller). The pages of the view are prefetched when the system supports it.
+bool MapImageFile (const wchar_t *path, SIZE_T maxViewSize, MappedImage &image);
+void UnmapImageFile (MappedImage &image);
+
+// Determines the conceal state of an image file by inspecting its mapped header in place
+bool GetImageConcealState (const wchar_t *path, ConcealState &state, const wchar_t **fileSystemName, const ConcealTransform *transform = NULL);
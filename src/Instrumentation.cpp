@@ -0,0 +1,42 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "Instrumentation.h"
+
+static volatile LONG Counters[INSTRUMENTATION_COUNTER_COUNT];
+
+void AddInstrumentationCounter (InstrumentationCounter counter, LONG value)
+{
+	InterlockedExchangeAdd (&Counters[counter], value);
+}
+
+LONG GetInstrumentationCounter (InstrumentationCounter counter)
+{
+	return InterlockedCompareExchange (&Counters[counter], 0, 0);
+}
+
+const wchar_t *GetInstrumentationCounterName (InstrumentationCounter counter)
+{
+	switch (counter)
+	{
+	case INSTRUMENTATION_ALLOCATIONS:		return L"allocations";
+	case INSTRUMENTATION_ALLOCATED_BYTES:	return L"allocated_bytes";
+	case INSTRUMENTATION_IOCTLS:			return L"ioctls";
+	case INSTRUMENTATION_IOCTL_RETRIES:		return L"ioctl_retries";
+	case INSTRUMENTATION_BUFFER_POOL_HITS:	return L"buffer_pool_hits";
+	case INSTRUMENTATION_BUFFER_POOL_MISSES:	return L"buffer_pool_misses";
+	default:								return L"unknown";
+	}
+}
+
+void ResetInstrumentationCounters ()
+{
+	for (int i = 0; i < INSTRUMENTATION_COUNTER_COUNT; i++)
+		InterlockedExchange (&Counters[i], 0);
+}
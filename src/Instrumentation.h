@@ -0,0 +1,31 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Instrumentation.h : process-wide counters of allocations, buffer reuse and device I/O controls
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+enum InstrumentationCounter
+{
+	INSTRUMENTATION_ALLOCATIONS,			// Heap allocations of scratch buffers
+	INSTRUMENTATION_ALLOCATED_BYTES,
+	INSTRUMENTATION_IOCTLS,					// DeviceIoControl calls made through an IoctlBuffer
+	INSTRUMENTATION_IOCTL_RETRIES,			// Calls repeated with a larger buffer
+	INSTRUMENTATION_BUFFER_POOL_HITS,		// Transfer buffers reused from the pool
+	INSTRUMENTATION_BUFFER_POOL_MISSES,		// Transfer buffers allocated as none of their size was free
+	INSTRUMENTATION_COUNTER_COUNT
+};
+
+// Counters are updated atomically and may be used from any thread
+void AddInstrumentationCounter (InstrumentationCounter counter, LONG value);
+LONG GetInstrumentationCounter (InstrumentationCounter counter);
+const wchar_t *GetInstrumentationCounterName (InstrumentationCounter counter);
+void ResetInstrumentationCounters ();
@@ -0,0 +1,411 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "Inventory.h"
+#include "DeviceId.h"
+
+// Longest output of one character: a JSON \u00XX escape
+#define INVENTORY_MAX_CHAR_SIZE		6
+
+static const char *GetDeviceTypeName (const HostDevice &device)
+{
+	if (device.DynamicVolume)
+		return "dynamic_volume";
+	else if (device.IsPartition)
+		return "partition";
+	else
+		return "disk";
+}
+
+bool IsInventoryVolume (const HostDevice &device)
+{
+	return device.IsPartition || device.DynamicVolume || device.Floppy || device.Partitions.empty();
+}
+
+bool GetDeviceConcealState (const wchar_t *devicePath, DWORD dosDeviceCounter, const ConcealTransform *transform, ConcealState &state, const wchar_t **fileSystemName)
+{
+	__declspec(align(TC_MAX_VOLUME_SECTOR_SIZE)) BYTE buf [TC_MAX_VOLUME_SECTOR_SIZE];
+	WCHAR dosDev[MAX_PATH] = {0};
+	WCHAR devName[MAX_PATH] = {0};
+	DWORD nbrBytesRead = 0;
+	DWORD dwError = ERROR_SUCCESS;
+	bool bResult = false;
+	ConcealTransform deviceTransform;
+	HANDLE dev;
+
+	state = CONCEAL_STATE_UNKNOWN;
+	*fileSystemName = NULL;
+
+	if (!GetDeviceTransform (devicePath, transform, deviceTransform))
+		return false;
+
+	if (!FakeDosNameForDevice (dosDeviceCounter, devicePath, dosDev, sizeof (dosDev), devName, sizeof (devName), FALSE))
+		return false;
+
+	dev = CreateFileW (devName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+	if (dev != INVALID_HANDLE_VALUE)
+	{
+		if (ReadFile (dev, buf, sizeof (buf), &nbrBytesRead, NULL))
+		{
+			if (nbrBytesRead >= CONCEAL_SIGNATURE_SIZE)
+				state = GetConcealState (buf, fileSystemName, &deviceTransform);
+
+			bResult = true;
+		}
+		else
+			dwError = GetLastError ();
+
+		CloseHandle (dev);
+	}
+	else
+		dwError = GetLastError ();
+
+	DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, devicePath);
+
+	SetLastError (dwError);
+	return bResult;
+}
+
+InventoryWriter::InventoryWriter (HANDLE hFile, InventoryFormat format)
+	:
+	File (hFile),
+	Format (format),
+	BufferUsed (0),
+	FirstDevice (true),
+	FirstField (true),
+	Failed (false),
+	LastError (ERROR_SUCCESS)
+{
+}
+
+InventoryWriter::~InventoryWriter ()
+{
+	Flush ();
+}
+
+bool InventoryWriter::Flush ()
+{
+	DWORD written;
+
+	if (!Failed && BufferUsed > 0)
+	{
+		if (!WriteFile (File, Buffer, (DWORD) BufferUsed, &written, NULL) || written != BufferUsed)
+		{
+			LastError = GetLastError ();
+			Failed = true;
+		}
+	}
+
+	// Once a write has failed, the output is discarded
+	BufferUsed = 0;
+
+	if (Failed)
+		SetLastError (LastError);
+
+	return !Failed;
+}
+
+void InventoryWriter::WriteChar (char c)
+{
+	if (BufferUsed == sizeof (Buffer))
+		Flush ();
+
+	Buffer[BufferUsed++] = c;
+}
+
+void InventoryWriter::Write (const char *str)
+{
+	while (*str)
+		WriteChar (*str++);
+}
+
+void InventoryWriter::WriteString (const wchar_t *str)
+{
+	WriteChar ('"');
+	WriteStringContent (str);
+	WriteChar ('"');
+}
+
+// Encodes UTF-16 to UTF-8 and escapes the string for the output format
+void InventoryWriter::WriteStringContent (const wchar_t *str)
+{
+	static const char hexDigits[] = "0123456789abcdef";
+
+	for (; *str; str++)
+	{
+		unsigned int c = *str;
+
+		if (BufferUsed + INVENTORY_MAX_CHAR_SIZE > sizeof (Buffer))
+			Flush ();
+
+		char *out = Buffer + BufferUsed;
+
+		if (c >= 0xD800 && c <= 0xDBFF && str[1] >= 0xDC00 && str[1] <= 0xDFFF)
+		{
+			c = 0x10000 + ((c - 0xD800) << 10) + (str[1] - 0xDC00);
+			str++;
+		}
+		else if (c >= 0xD800 && c <= 0xDFFF)
+			c = 0xFFFD;		// Unpaired surrogate
+
+		if (c == L'"')
+		{
+			// CSV doubles the quotes
+			*out++ = (Format == INVENTORY_FORMAT_JSON) ? '\\' : '"';
+			*out++ = '"';
+		}
+		else if (c == L'\\' && Format == INVENTORY_FORMAT_JSON)
+		{
+			*out++ = '\\';
+			*out++ = '\\';
+		}
+		else if (c < 0x20 && Format == INVENTORY_FORMAT_JSON)
+		{
+			*out++ = '\\';
+			*out++ = 'u';
+			*out++ = '0';
+			*out++ = '0';
+			*out++ = hexDigits[c >> 4];
+			*out++ = hexDigits[c & 0xF];
+		}
+		else if (c < 0x80)
+			*out++ = (char) c;
+		else if (c < 0x800)
+		{
+			*out++ = (char) (0xC0 | (c >> 6));
+			*out++ = (char) (0x80 | (c & 0x3F));
+		}
+		else if (c < 0x10000)
+		{
+			*out++ = (char) (0xE0 | (c >> 12));
+			*out++ = (char) (0x80 | ((c >> 6) & 0x3F));
+			*out++ = (char) (0x80 | (c & 0x3F));
+		}
+		else
+		{
+			*out++ = (char) (0xF0 | (c >> 18));
+			*out++ = (char) (0x80 | ((c >> 12) & 0x3F));
+			*out++ = (char) (0x80 | ((c >> 6) & 0x3F));
+			*out++ = (char) (0x80 | (c & 0x3F));
+		}
+
+		BufferUsed = out - Buffer;
+	}
+}
+
+// JSON: array of strings. CSV: strings separated by semicolons.
+void InventoryWriter::WriteStringList (const char *name, const vector <wstring> &strings)
+{
+	bool bJson = (Format == INVENTORY_FORMAT_JSON);
+
+	WriteName (name);
+
+	if (bJson)
+		WriteChar ('[');
+	else if (!strings.empty())
+		WriteChar ('"');
+
+	for (size_t i = 0; i < strings.size(); i++)
+	{
+		if (i > 0)
+			WriteChar (bJson ? ',' : ';');
+
+		if (bJson)
+			WriteString (strings[i].c_str());
+		else
+			WriteStringContent (strings[i].c_str());
+	}
+
+	if (bJson)
+		WriteChar (']');
+	else if (!strings.empty())
+		WriteChar ('"');
+}
+
+void InventoryWriter::WriteNumber (ULONGLONG value)
+{
+	char digits[24];
+	int count = 0;
+
+	do
+	{
+		digits[count++] = (char) ('0' + value % 10);
+		value /= 10;
+	}
+	while (value != 0);
+
+	while (count > 0)
+		WriteChar (digits[--count]);
+}
+
+void InventoryWriter::WriteBool (bool value)
+{
+	Write (value ? "true" : "false");
+}
+
+void InventoryWriter::WriteSeparator ()
+{
+	if (!FirstField)
+		WriteChar (',');
+
+	FirstField = false;
+}
+
+// Starts a field. Names are only written in JSON, CSV fields being identified by the header.
+void InventoryWriter::WriteName (const char *name)
+{
+	WriteSeparator ();
+
+	if (Format == INVENTORY_FORMAT_JSON)
+	{
+		WriteChar ('"');
+		Write (name);
+		Write ("\":");
+	}
+}
+
+void InventoryWriter::Begin ()
+{
+	if (Format == INVENTORY_FORMAT_JSON)
+		Write ("[");
+	else
+		Write ("path,type,ids,disk,partition,volume,mount_point,mount_points,label,size,removable,system,extents,filesystem,state,error\r\n");
+
+	FirstDevice = true;
+}
+
+void InventoryWriter::End ()
+{
+	if (Format == INVENTORY_FORMAT_JSON)
+		Write (FirstDevice ? "]\n" : "\n]\n");
+
+	Flush ();
+}
+
+void InventoryWriter::WriteDevice (const HostDevice &device, ConcealState state, const wchar_t *fileSystemName, DWORD probeError, const VolumeMetadata *volume)
+{
+	bool bJson = (Format == INVENTORY_FORMAT_JSON);
+	bool bVolume = IsInventoryVolume (device);
+
+	// Disks have no partition number, and dynamic volumes may span several disks
+	bool bDiskNumber = !device.DynamicVolume && (!device.IsPartition || !device.Extents.empty());
+	DWORD diskNumber = device.IsPartition ? (device.Extents.empty() ? 0 : device.Extents[0].DiskNumber) : device.SystemNumber;
+
+	if (bJson)
+		Write (FirstDevice ? "\n{" : ",\n{");
+
+	FirstDevice = false;
+	FirstField = true;
+
+	WriteName ("path");
+	WriteString (device.Path.c_str());
+
+	WriteName ("type");
+	WriteChar ('"');
+	Write (GetDeviceTypeName (device));
+	WriteChar ('"');
+
+	WriteStringList ("ids", device.Ids);
+
+	WriteName ("disk");
+	if (bDiskNumber)
+		WriteNumber (diskNumber);
+	else if (bJson)
+		Write ("null");
+
+	WriteName ("partition");
+	if (device.IsPartition && !device.DynamicVolume)
+		WriteNumber (device.SystemNumber);
+	else if (bJson)
+		Write ("null");
+
+	WriteName ("volume");
+	if (volume)
+		WriteString (volume->VolumeName.c_str());
+	else if (bJson)
+		Write ("null");
+
+	WriteName ("mount_point");
+	WriteString (device.MountPoint.c_str());
+
+	WriteStringList ("mount_points", volume ? volume->MountPoints : vector <wstring> ());
+
+	WriteName ("label");
+	if (device.Name.empty() && volume && volume->InfoValid)
+		WriteString (volume->Label.c_str());
+	else
+		WriteString (device.Name.c_str());
+
+	WriteName ("size");
+	WriteNumber (device.Size);
+
+	WriteName ("removable");
+	WriteBool (device.Removable);
+
+	WriteName ("system");
+	WriteBool (device.ContainsSystem);
+
+	// JSON: array of objects. CSV: disk:offset:length items separated by semicolons.
+	WriteName ("extents");
+	if (bJson)
+		WriteChar ('[');
+
+	for (size_t i = 0; i < device.Extents.size(); i++)
+	{
+		const HostDeviceExtent &extent = device.Extents[i];
+
+		if (i > 0)
+			WriteChar (bJson ? ',' : ';');
+
+		if (bJson)
+			Write ("{\"disk\":");
+		WriteNumber (extent.DiskNumber);
+
+		Write (bJson ? ",\"offset\":" : ":");
+		WriteNumber (extent.StartingOffset);
+
+		Write (bJson ? ",\"length\":" : ":");
+		WriteNumber (extent.Length);
+
+		if (bJson)
+			WriteChar ('}');
+	}
+
+	if (bJson)
+		WriteChar (']');
+
+	// The filesystem recognized from the header is also known when concealed, but only
+	// a few filesystems are recognized
+	WriteName ("filesystem");
+	if (bVolume && probeError == ERROR_SUCCESS && fileSystemName)
+		WriteString (fileSystemName);
+	else if (volume && volume->InfoValid)
+		WriteString (volume->FileSystem.c_str());
+	else if (bJson)
+		Write ("null");
+
+	WriteName ("state");
+	if (!bVolume)
+	{
+		if (bJson)
+			Write ("null");
+	}
+	else if (probeError != ERROR_SUCCESS)
+		Write ("\"error\"");
+	else
+		WriteString (GetConcealStateName (state));
+
+	WriteName ("error");
+	if (bVolume && probeError != ERROR_SUCCESS)
+		WriteNumber (probeError);
+	else if (bJson)
+		Write ("null");
+
+	Write (bJson ? "}" : "\r\n");
+}
@@ -0,0 +1,78 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Inventory.h : machine-readable export of the host devices
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Conceal.h"
+#include "Devices.h"
+#include "VolumeMetadata.h"
+
+#define INVENTORY_WRITER_BUFFER_SIZE	(64 * 1024)
+
+enum InventoryFormat
+{
+	INVENTORY_FORMAT_JSON,			// An array of objects, one device per line
+	INVENTORY_FORMAT_CSV			// RFC 4180, with a header line
+};
+
+// Buffered UTF-8 output. Wide strings are encoded and escaped directly into the buffer,
+// so that no intermediate string is built for a field.
+class InventoryWriter
+{
+public:
+	InventoryWriter (HANDLE hFile, InventoryFormat format);
+	~InventoryWriter ();
+
+	void Begin ();
+	void End ();
+
+	// state and fileSystemName are only written for volumes (partitions, dynamic volumes, and disks
+	// without partitions). probeError is the error of the conceal state probe, or ERROR_SUCCESS.
+	// volume (optional) provides the volume name and mount points, and the label and filesystem
+	// when they are not known otherwise.
+	void WriteDevice (const HostDevice &device, ConcealState state, const wchar_t *fileSystemName, DWORD probeError, const VolumeMetadata *volume);
+
+	// Returns false if a write to the file failed, in which case GetLastError gives the error
+	bool Flush ();
+
+protected:
+	void Write (const char *str);
+	void WriteChar (char c);
+	void WriteString (const wchar_t *str);
+	void WriteStringContent (const wchar_t *str);
+	void WriteStringList (const char *name, const std::vector <std::wstring> &strings);
+	void WriteNumber (ULONGLONG value);
+	void WriteBool (bool value);
+	void WriteSeparator ();
+	void WriteName (const char *name);
+
+	HANDLE File;
+	InventoryFormat Format;
+	char Buffer[INVENTORY_WRITER_BUFFER_SIZE];
+	size_t BufferUsed;
+	bool FirstDevice;
+	bool FirstField;
+	bool Failed;
+	DWORD LastError;
+
+private:
+	InventoryWriter (const InventoryWriter &);
+	InventoryWriter &operator= (const InventoryWriter &);
+};
+
+// Returns true if the conceal state of the device is probed and exported
+bool IsInventoryVolume (const HostDevice &device);
+
+// Determines the conceal state of a partition or volume (\Device\...) by reading its header.
+// The device is opened for reading only and shared with other readers and writers.
+bool GetDeviceConcealState (const wchar_t *devicePath, DWORD dosDeviceCounter, const ConcealTransform *transform, ConcealState &state, const wchar_t **fileSystemName);
@@ -0,0 +1,241 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "IoBufferPool.h"
+#include "Instrumentation.h"
+
+#define IO_BUFFER_POOL_MIN_SHIFT		16
+#define IO_BUFFER_POOL_MAX_SHIFT		30
+#define IO_BUFFER_POOL_CLASS_COUNT		(IO_BUFFER_POOL_MAX_SHIFT - IO_BUFFER_POOL_MIN_SHIFT + 1)
+
+enum
+{
+	LARGE_PAGES_UNKNOWN,
+	LARGE_PAGES_AVAILABLE,
+	LARGE_PAGES_UNAVAILABLE
+};
+
+// The free buffers of each class are linked through an SLIST_ENTRY stored at their beginning
+class IoBufferPool
+{
+public:
+	IoBufferPool ()
+		:
+		CachedBytes (0),
+		LargePages (LARGE_PAGES_UNKNOWN)
+	{
+		for (int i = 0; i < IO_BUFFER_POOL_CLASS_COUNT; i++)
+			InitializeSListHead (&FreeBuffers[i]);
+	}
+
+	~IoBufferPool ()
+	{
+		Trim ();
+	}
+
+	BYTE *Acquire (SIZE_T size);
+	void Release (BYTE *buffer, SIZE_T size);
+	void Trim ();
+
+protected:
+	BYTE *Allocate (SIZE_T size);
+	SIZE_T GetLargePageSize ();
+
+	SLIST_HEADER FreeBuffers[IO_BUFFER_POOL_CLASS_COUNT];
+	volatile LONG CachedBytes;
+	volatile LONG LargePages;
+
+private:
+	IoBufferPool (const IoBufferPool &);
+	IoBufferPool &operator= (const IoBufferPool &);
+};
+
+static IoBufferPool Pool;
+
+// Returns the index of the class of a size, or -1 if the size is not pooled
+static int GetIoBufferClass (SIZE_T size, SIZE_T &classSize)
+{
+	if (size > IO_BUFFER_POOL_MAX_SIZE)
+	{
+		classSize = size;
+		return -1;
+	}
+
+	for (int i = 0; i < IO_BUFFER_POOL_CLASS_COUNT; i++)
+	{
+		classSize = (SIZE_T) 1 << (IO_BUFFER_POOL_MIN_SHIFT + i);
+		if (size <= classSize)
+			return i;
+	}
+
+	return -1;
+}
+
+// Large pages need the lock memory privilege, which is only granted to the accounts allowed to use it
+static bool EnableLockMemoryPrivilege ()
+{
+	TOKEN_PRIVILEGES privileges;
+	HANDLE hToken;
+	bool bResult = false;
+
+	if (!OpenProcessToken (GetCurrentProcess (), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+		return false;
+
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	// AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED when the privilege is not held
+	if (LookupPrivilegeValueW (NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges (hToken, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError () == ERROR_SUCCESS)
+	{
+		bResult = true;
+	}
+
+	CloseHandle (hToken);
+	return bResult;
+}
+
+// Returns 0 if large pages cannot be used
+SIZE_T IoBufferPool::GetLargePageSize ()
+{
+	if (!GetLargePageMinimum)
+		return 0;
+
+	if (LargePages == LARGE_PAGES_UNKNOWN)
+	{
+		// Threads racing here reach the same result
+		InterlockedExchange (&LargePages, (GetLargePageMinimum () != 0 && EnableLockMemoryPrivilege ()) ? LARGE_PAGES_AVAILABLE : LARGE_PAGES_UNAVAILABLE);
+	}
+
+	return LargePages == LARGE_PAGES_AVAILABLE ? GetLargePageMinimum () : 0;
+}
+
+BYTE *IoBufferPool::Allocate (SIZE_T size)
+{
+	SIZE_T largePageSize = GetLargePageSize ();
+	BYTE *buffer = NULL;
+
+	if (largePageSize != 0 && size >= largePageSize && (size % largePageSize) == 0)
+		buffer = (BYTE *) VirtualAlloc (NULL, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+
+	// Large pages may also fail when physical memory is fragmented
+	if (!buffer)
+		buffer = (BYTE *) VirtualAlloc (NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	if (buffer)
+	{
+		AddInstrumentationCounter (INSTRUMENTATION_ALLOCATIONS, 1);
+		AddInstrumentationCounter (INSTRUMENTATION_ALLOCATED_BYTES, (LONG) size);
+	}
+
+	return buffer;
+}
+
+BYTE *IoBufferPool::Acquire (SIZE_T size)
+{
+	SIZE_T classSize;
+	int bufferClass = GetIoBufferClass (size, classSize);
+
+	if (bufferClass >= 0)
+	{
+		PSLIST_ENTRY entry = InterlockedPopEntrySList (&FreeBuffers[bufferClass]);
+
+		if (entry)
+		{
+			InterlockedExchangeAdd (&CachedBytes, - (LONG) classSize);
+			AddInstrumentationCounter (INSTRUMENTATION_BUFFER_POOL_HITS, 1);
+			return (BYTE *) entry;
+		}
+	}
+
+	AddInstrumentationCounter (INSTRUMENTATION_BUFFER_POOL_MISSES, 1);
+	return Allocate (classSize);
+}
+
+void IoBufferPool::Release (BYTE *buffer, SIZE_T size)
+{
+	SIZE_T classSize;
+	int bufferClass = GetIoBufferClass (size, classSize);
+
+	if (!buffer)
+		return;
+
+	if (bufferClass >= 0)
+	{
+		if (InterlockedExchangeAdd (&CachedBytes, (LONG) classSize) + classSize <= IO_BUFFER_POOL_MAX_CACHED_BYTES)
+		{
+			InterlockedPushEntrySList (&FreeBuffers[bufferClass], (PSLIST_ENTRY) buffer);
+			return;
+		}
+
+		InterlockedExchangeAdd (&CachedBytes, - (LONG) classSize);
+	}
+
+	VirtualFree (buffer, 0, MEM_RELEASE);
+}
+
+void IoBufferPool::Trim ()
+{
+	for (int i = 0; i < IO_BUFFER_POOL_CLASS_COUNT; i++)
+	{
+		PSLIST_ENTRY entry = InterlockedFlushSList (&FreeBuffers[i]);
+
+		while (entry)
+		{
+			PSLIST_ENTRY next = entry->Next;
+
+			InterlockedExchangeAdd (&CachedBytes, - (LONG) ((SIZE_T) 1 << (IO_BUFFER_POOL_MIN_SHIFT + i)));
+			VirtualFree (entry, 0, MEM_RELEASE);
+
+			entry = next;
+		}
+	}
+}
+
+BYTE *AcquireIoBuffer (SIZE_T size)
+{
+	BYTE *buffer = Pool.Acquire (size);
+
+	if (!buffer)
+		SetLastError (ERROR_NOT_ENOUGH_MEMORY);
+
+	return buffer;
+}
+
+void ReleaseIoBuffer (BYTE *buffer, SIZE_T size)
+{
+	Pool.Release (buffer, size);
+}
+
+void TrimIoBufferPool ()
+{
+	Pool.Trim ();
+}
+
+bool IoBuffer::Acquire (SIZE_T size)
+{
+	Release ();
+
+	Data = AcquireIoBuffer (size);
+	if (!Data)
+		return false;
+
+	Size = size;
+	return true;
+}
+
+void IoBuffer::Release ()
+{
+	if (Data)
+		ReleaseIoBuffer (Data, Size);
+
+	Data = NULL;
+	Size = 0;
+}
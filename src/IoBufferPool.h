@@ -0,0 +1,56 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// IoBufferPool.h : process-wide pool of page aligned transfer buffers
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Buffers are pooled by size class, each class being a power of two between these sizes.
+// Larger buffers are allocated and freed on each use.
+#define IO_BUFFER_POOL_MIN_SIZE				(64 * 1024)
+#define IO_BUFFER_POOL_MAX_SIZE				(1024 * 1024 * 1024)
+
+// Buffers returned once the pool holds this many bytes are freed
+#define IO_BUFFER_POOL_MAX_CACHED_BYTES		(256 * 1024 * 1024)
+
+// Returns a buffer of at least size bytes aligned on a page, and therefore on any sector, taken from
+// the pool without locking when a buffer of its size class is free. Buffers of classes larger than
+// the large page size are backed by large pages when the process may lock memory.
+// Returns NULL with the last error set on failure.
+BYTE *AcquireIoBuffer (SIZE_T size);
+
+// Returns a buffer obtained from AcquireIoBuffer with the same size to the pool
+void ReleaseIoBuffer (BYTE *buffer, SIZE_T size);
+
+// Frees all the buffers held by the pool
+void TrimIoBufferPool ();
+
+// Buffer borrowed from the pool for the lifetime of the object
+class IoBuffer
+{
+public:
+	IoBuffer () : Data (NULL), Size (0) { }
+	~IoBuffer () { Release (); }
+
+	bool Acquire (SIZE_T size);
+	void Release ();
+
+	BYTE *Get () const { return Data; }
+	SIZE_T GetSize () const { return Size; }
+
+protected:
+	BYTE *Data;
+	SIZE_T Size;
+
+private:
+	IoBuffer (const IoBuffer &);
+	IoBuffer &operator= (const IoBuffer &);
+};
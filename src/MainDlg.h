@@ -20,6 +20,9 @@ public:
 
 	BEGIN_MSG_MAP(CMainDlg)
 		MESSAGE_HANDLER(WM_INITDIALOG, OnInitDialog)
+		MESSAGE_HANDLER(WM_DEVICECHANGE, OnDeviceChange)
+		MESSAGE_HANDLER(WM_TIMER, OnTimer)
+		MESSAGE_HANDLER(WM_DESTROY, OnDestroy)
 		COMMAND_ID_HANDLER(ID_APP_ABOUT, OnAppAbout)
 		COMMAND_ID_HANDLER(IDOK, OnOK)
 		COMMAND_ID_HANDLER(IDCANCEL, OnCancel)
@@ -46,6 +49,8 @@ public:
       SetDlgItemText (IDC_HELP_TEXT, L"This tool applies VeraCrypt XOR based concealing transformation to the first 8 KB of the selected device.\nWhen applied the first time on a NTFS formatted drive, it will prevent Windows and applicatins from using it.\nApplying it a second time reverts the concealing of the first 8 KB of the drive, making it usable as before.");
       GetDlgItem(IDC_DEVICE).SendMessageW(EM_LIMITTEXT, MAX_PATH,0);
 
+		WatchHostDevices ();
+
 		return TRUE;
 	}
 
@@ -68,6 +73,10 @@ public:
 		EndDialog(wID);
 		return 0;
 	}
+	void WatchHostDevices ();
+	LRESULT OnDeviceChange(UINT /*uMsg*/, WPARAM wParam, LPARAM lParam, BOOL& /*bHandled*/);
+	LRESULT OnTimer(UINT /*uMsg*/, WPARAM wParam, LPARAM /*lParam*/, BOOL& bHandled);
+	LRESULT OnDestroy(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/, BOOL& bHandled);
    LRESULT OnBnClickedSelectDevice(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/);
    LRESULT OnBnClickedApply(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/);
 };
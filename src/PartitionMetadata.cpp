@@ -0,0 +1,287 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <stddef.h>
+
+#include "PartitionMetadata.h"
+#include "Devices.h"
+
+// PARTITION_BASIC_DATA_GUID, which is only defined by diskguid.h with INITGUID
+static const GUID BasicDataPartitionGuid = { 0xebd0a0a2L, 0xb9e5, 0x4433, { 0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7 } };
+
+const wchar_t *GetMetadataStateName (MetadataState state)
+{
+	switch (state)
+	{
+	case METADATA_STATE_VISIBLE:	return L"visible";
+	case METADATA_STATE_HIDDEN:		return L"hidden";
+	default:						return L"unsupported";
+	}
+}
+
+static MetadataState GetPartitionMetadataState (const PARTITION_INFORMATION_EX &partition)
+{
+	if (partition.PartitionStyle == PARTITION_STYLE_GPT)
+	{
+		// The attributes are only defined for basic data partitions
+		if (!IsEqualGUID (partition.Gpt.PartitionType, BasicDataPartitionGuid))
+			return METADATA_STATE_UNSUPPORTED;
+
+		return (partition.Gpt.Attributes & GPT_BASIC_DATA_ATTRIBUTE_HIDDEN) ? METADATA_STATE_HIDDEN : METADATA_STATE_VISIBLE;
+	}
+
+	if (partition.PartitionStyle != PARTITION_STYLE_MBR)
+		return METADATA_STATE_UNSUPPORTED;
+
+	switch (partition.Mbr.PartitionType & ~MBR_PARTITION_TYPE_HIDDEN_FLAG)
+	{
+	case PARTITION_FAT_12:
+	case PARTITION_FAT_16:
+	case PARTITION_HUGE:
+	case PARTITION_IFS:
+	case PARTITION_FAT32:
+	case PARTITION_FAT32_XINT13:
+	case PARTITION_XINT13:
+		return (partition.Mbr.PartitionType & MBR_PARTITION_TYPE_HIDDEN_FLAG) ? METADATA_STATE_HIDDEN : METADATA_STATE_VISIBLE;
+
+	default:
+		return METADATA_STATE_UNSUPPORTED;
+	}
+}
+
+static void SetPartitionMetadataState (PARTITION_INFORMATION_EX &partition, bool bHidden)
+{
+	if (partition.PartitionStyle == PARTITION_STYLE_GPT)
+	{
+		if (bHidden)
+			partition.Gpt.Attributes |= GPT_BASIC_DATA_ATTRIBUTE_HIDDEN | GPT_BASIC_DATA_ATTRIBUTE_NO_DRIVE_LETTER;
+		else
+			partition.Gpt.Attributes &= ~(GPT_BASIC_DATA_ATTRIBUTE_HIDDEN | GPT_BASIC_DATA_ATTRIBUTE_NO_DRIVE_LETTER);
+	}
+	else if (bHidden)
+		partition.Mbr.PartitionType |= MBR_PARTITION_TYPE_HIDDEN_FLAG;
+	else
+		partition.Mbr.PartitionType &= (BYTE) ~MBR_PARTITION_TYPE_HIDDEN_FLAG;
+
+	// Only the entries marked are written to an MBR
+	partition.RewritePartition = TRUE;
+}
+
+static PARTITION_INFORMATION_EX *FindPartition (PDRIVE_LAYOUT_INFORMATION_EX layout, DWORD partitionNumber)
+{
+	for (DWORD i = 0; i < layout->PartitionCount; i++)
+	{
+		if (layout->PartitionEntry[i].PartitionNumber == partitionNumber)
+			return &layout->PartitionEntry[i];
+	}
+
+	return NULL;
+}
+
+// The partition holding Windows, or the active partition starting it on an MBR disk
+static bool IsSystemPartition (const wstring &path, const PARTITION_INFORMATION_EX &partition)
+{
+	wchar_t systemDrive = GetSystemDriveLetter ();
+	int driveNumber;
+
+	if (partition.PartitionStyle == PARTITION_STYLE_MBR && partition.Mbr.BootIndicator)
+		return true;
+
+	driveNumber = GetDiskDeviceDriveLetter ((PWSTR) path.c_str());
+	return driveNumber >= 0 && systemDrive == L'A' + driveNumber;
+}
+
+// Records the last error as the failure of the targets given by their index
+static void FailTargets (vector <ErrorCollector> &errors, const vector <size_t> &indexes, const wchar_t *operation, const wchar_t *device)
+{
+	for (vector <size_t>::const_iterator It = indexes.begin(); It != indexes.end(); It++)
+		errors[*It].Fail (operation, device);
+}
+
+// Updates the targets of a disk, given by their index in targets, with one write of its partition table. The
+// errors of each target are recorded at the same index in errors.
+static void ApplyDiskMetadata (DWORD diskNumber, const vector <size_t> &indexes, vector <MetadataTarget> &targets,
+	vector <ErrorCollector> &errors, bool bConceal, DWORD dosDeviceCounter)
+{
+	WCHAR diskPath[MAX_PATH];
+	WCHAR dosDev[MAX_PATH] = {0};
+	WCHAR devName[MAX_PATH] = {0};
+	IoctlBuffer layoutBuffer (sizeof (DRIVE_LAYOUT_INFORMATION_EX) + 16 * sizeof (PARTITION_INFORMATION_EX));
+	PDRIVE_LAYOUT_INFORMATION_EX layout;
+	MetadataState requestedState = bConceal ? METADATA_STATE_HIDDEN : METADATA_STATE_VISIBLE;
+	vector <size_t> changed;
+	DWORD dwResult;
+	HANDLE hDisk;
+
+	StringCchPrintfW (diskPath, ARRAYSIZE (diskPath), L"\\Device\\Harddisk%u\\Partition0", diskNumber);
+
+	if (!FakeDosNameForDevice (dosDeviceCounter, diskPath, dosDev, sizeof (dosDev), devName, sizeof (devName), FALSE))
+	{
+		FailTargets (errors, indexes, L"define device name", diskPath);
+		return;
+	}
+
+	// Shared, as the other volumes of the disk may be in use
+	hDisk = CreateFileW (devName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hDisk == INVALID_HANDLE_VALUE)
+	{
+		FailTargets (errors, indexes, L"open", diskPath);
+		DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, diskPath);
+		return;
+	}
+
+	if (!layoutBuffer.Query (hDisk, IOCTL_DISK_GET_DRIVE_LAYOUT_EX))
+	{
+		FailTargets (errors, indexes, L"read partition table", diskPath);
+		goto done;
+	}
+
+	layout = (PDRIVE_LAYOUT_INFORMATION_EX) layoutBuffer.Get();
+
+	for (DWORD i = 0; i < layout->PartitionCount; i++)
+		layout->PartitionEntry[i].RewritePartition = FALSE;
+
+	for (vector <size_t>::const_iterator It = indexes.begin(); It != indexes.end(); It++)
+	{
+		MetadataTarget &target = targets[*It];
+		PARTITION_INFORMATION_EX *partition;
+		DWORD number, partitionNumber;
+
+		ParsePartitionPath (target.Path.c_str(), number, partitionNumber);
+
+		partition = FindPartition (layout, partitionNumber);
+		if (!partition)
+		{
+			SetLastError (ERROR_FILE_NOT_FOUND);
+			errors[*It].Fail (L"find partition", diskPath);
+			continue;
+		}
+
+		target.StateBefore = GetPartitionMetadataState (*partition);
+
+		if (target.StateBefore == METADATA_STATE_UNSUPPORTED)
+		{
+			SetLastError (ERROR_NOT_SUPPORTED);
+			errors[*It].Fail (L"check partition", NULL, CONCEAL_ERROR_NO_OFFSET, L"Only GPT basic data partitions and MBR partitions of a FAT or NTFS type can be hidden.");
+		}
+		else if (bConceal && IsSystemPartition (target.Path, *partition))
+		{
+			SetLastError (ERROR_ACCESS_DENIED);
+			errors[*It].Fail (L"check partition", NULL, CONCEAL_ERROR_NO_OFFSET, L"The partition holding or starting Windows cannot be hidden.");
+		}
+		else if (target.StateBefore == requestedState)
+		{
+			target.Success = true;
+			target.StateAfter = target.StateBefore;
+		}
+		else
+		{
+			SetPartitionMetadataState (*partition, bConceal);
+			changed.push_back (*It);
+		}
+	}
+
+	if (changed.empty())
+		goto done;
+
+	// The whole table is written at once, the GPT headers and their backups with it
+	if (!DeviceIoControl (hDisk, IOCTL_DISK_SET_DRIVE_LAYOUT_EX, layout,
+		(DWORD) (offsetof (DRIVE_LAYOUT_INFORMATION_EX, PartitionEntry) + layout->PartitionCount * sizeof (PARTITION_INFORMATION_EX)),
+		NULL, 0, &dwResult, NULL))
+	{
+		FailTargets (errors, changed, L"write partition table", diskPath);
+		goto done;
+	}
+
+	DeviceIoControl (hDisk, IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &dwResult, NULL);
+
+	if (!layoutBuffer.Query (hDisk, IOCTL_DISK_GET_DRIVE_LAYOUT_EX))
+	{
+		FailTargets (errors, changed, L"read back partition table", diskPath);
+		goto done;
+	}
+
+	layout = (PDRIVE_LAYOUT_INFORMATION_EX) layoutBuffer.Get();
+
+	for (vector <size_t>::const_iterator It = changed.begin(); It != changed.end(); It++)
+	{
+		MetadataTarget &target = targets[*It];
+		PARTITION_INFORMATION_EX *partition;
+		DWORD number, partitionNumber;
+
+		ParsePartitionPath (target.Path.c_str(), number, partitionNumber);
+
+		partition = FindPartition (layout, partitionNumber);
+		target.StateAfter = partition ? GetPartitionMetadataState (*partition) : METADATA_STATE_UNSUPPORTED;
+
+		if (target.StateAfter != requestedState)
+		{
+			SetLastError (ERROR_CRC);
+			errors[*It].Fail (L"verify", diskPath, CONCEAL_ERROR_NO_OFFSET, L"The partition table read back does not hold the new state.");
+		}
+		else
+		{
+			target.Success = true;
+			target.Changed = true;
+		}
+	}
+
+done:
+	CloseHandle (hDisk);
+	DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, diskPath);
+}
+
+bool ApplyPartitionMetadata (vector <MetadataTarget> &targets, bool bConceal, DWORD dosDeviceCounter)
+{
+	map <DWORD, vector <size_t> > disks;
+	vector <ErrorCollector> errors;
+	bool bResult = true;
+
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		MetadataTarget &target = targets[i];
+		DWORD diskNumber, partitionNumber;
+
+		target.Success = false;
+		target.Changed = false;
+		target.LastError = ERROR_SUCCESS;
+		target.StateBefore = METADATA_STATE_UNSUPPORTED;
+		target.StateAfter = METADATA_STATE_UNSUPPORTED;
+		target.Errors.clear();
+
+		errors.push_back (ErrorCollector (target.Path.c_str()));
+
+		if (ParsePartitionPath (target.Path.c_str(), diskNumber, partitionNumber))
+			disks[diskNumber].push_back (i);
+		else
+		{
+			SetLastError (ERROR_INVALID_PARAMETER);
+			errors[i].Fail (L"check partition", NULL, CONCEAL_ERROR_NO_OFFSET, L"The device is not a partition.");
+		}
+	}
+
+	for (map <DWORD, vector <size_t> >::const_iterator It = disks.begin(); It != disks.end(); It++)
+		ApplyDiskMetadata (It->first, It->second, targets, errors, bConceal, dosDeviceCounter);
+
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		MetadataTarget &target = targets[i];
+
+		if (errors[i].HasFailed ())
+			target.Success = false;
+
+		target.LastError = errors[i].GetLastFailure ();
+		target.Errors = errors[i].GetErrors ();
+
+		if (!target.Success)
+			bResult = false;
+	}
+
+	return bResult;
+}
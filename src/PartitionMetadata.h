@@ -0,0 +1,69 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// PartitionMetadata.h : conceal of partitions through the partition table of their disk
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "ErrorReport.h"
+
+// Attributes of GPT basic data partitions, only defined by winioctl.h from Windows Vista on
+#ifndef GPT_BASIC_DATA_ATTRIBUTE_HIDDEN
+#define GPT_BASIC_DATA_ATTRIBUTE_HIDDEN				0x4000000000000000ULL
+#define GPT_BASIC_DATA_ATTRIBUTE_NO_DRIVE_LETTER	0x8000000000000000ULL
+#endif
+
+// Bit distinguishing the hidden variant of an MBR partition type (0x07 and 0x17 for NTFS...)
+#define MBR_PARTITION_TYPE_HIDDEN_FLAG		0x10
+
+enum MetadataState
+{
+	METADATA_STATE_UNSUPPORTED,		// Neither a GPT basic data partition nor an MBR partition of a FAT or NTFS type
+	METADATA_STATE_VISIBLE,
+	METADATA_STATE_HIDDEN
+};
+
+struct MetadataTarget
+{
+	MetadataTarget ()
+		:
+		Success (false),
+		Changed (false),
+		LastError (ERROR_SUCCESS),
+		StateBefore (METADATA_STATE_UNSUPPORTED),
+		StateAfter (METADATA_STATE_UNSUPPORTED)
+	{
+	}
+
+	std::wstring Path;				// \Device\HarddiskN\PartitionM
+
+	// Set by ApplyPartitionMetadata
+	bool Success;
+	bool Changed;					// False if the partition was already in the requested state
+	DWORD LastError;
+	MetadataState StateBefore;
+	MetadataState StateAfter;
+	std::vector <ConcealError> Errors;
+};
+
+const wchar_t *GetMetadataStateName (MetadataState state);
+
+// Hides (bConceal) or reveals partitions by editing the partition table of their disk instead of their
+// data: GPT basic data partitions get the hidden and no drive letter attributes, MBR partitions of a FAT
+// or NTFS type get the hidden variant of their type. All the targets on a disk are updated with a single
+// IOCTL_DISK_SET_DRIVE_LAYOUT_EX, with which the disk driver rewrites the primary and backup GPT with
+// their CRCs, and the table is then read back. Windows applies the change when the volume is mounted
+// again (disk rescan, reconnection or reboot).
+// A target fails with ERROR_NOT_SUPPORTED if its type cannot be hidden, and with ERROR_ACCESS_DENIED if
+// it holds Windows or is the active MBR partition. If the table of a disk cannot be written, all the
+// targets of the disk that needed a change fail. dosDeviceCounter names the DOS device of the disks.
+// Returns true if all the targets succeeded.
+bool ApplyPartitionMetadata (std::vector <MetadataTarget> &targets, bool bConceal, DWORD dosDeviceCounter);
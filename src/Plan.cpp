@@ -0,0 +1,192 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "ConcealRange.h"
+#include "DeviceId.h"
+#include "Devices.h"
+#include "IoBufferPool.h"
+#include "Plan.h"
+
+const wchar_t *GetConcealActionName (ConcealAction action)
+{
+	switch (action)
+	{
+	case CONCEAL_ACTION_CONCEAL:	return L"conceal";
+	case CONCEAL_ACTION_REVEAL:		return L"reveal";
+	default:						return L"transform";
+	}
+}
+
+// Reads at the given offset and returns the duration of the read in milliseconds, or a negative value
+static double TimeRead (HANDLE dev, ULONGLONG offset, void *buffer, DWORD size, DWORD &nbrBytesRead)
+{
+	LARGE_INTEGER frequency, start, end, pos;
+
+	pos.QuadPart = offset;
+
+	if (SetFilePointerEx (dev, pos, NULL, FILE_BEGIN) == 0)
+		return -1;
+
+	QueryPerformanceFrequency (&frequency);
+	QueryPerformanceCounter (&start);
+
+	if (ReadFile (dev, buffer, size, &nbrBytesRead, NULL) == 0)
+		return -1;
+
+	QueryPerformanceCounter (&end);
+
+	return (double) (end.QuadPart - start.QuadPart) * 1000.0 / (double) frequency.QuadPart;
+}
+
+static bool ProbeTarget (HANDLE dev, ULONGLONG length, const ConcealTransform *transform, PlanEntry &entry)
+{
+	// The cache is bypassed so that the measured latency is the one of the device
+	__declspec(align(TC_MAX_VOLUME_SECTOR_SIZE)) BYTE buf [TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE];
+	DWORD nbrBytesRead;
+	double totalMs = 0;
+	int samples = 0;
+
+	// The first sample is the header. The others are spread over the device, as the device itself
+	// would serve a region read again from its cache, and skipped if the device is too small.
+	for (int i = 0; i < PLAN_LATENCY_SAMPLES; i++)
+	{
+		ULONGLONG offset = (length / PLAN_LATENCY_SAMPLES * i) / sizeof (buf) * sizeof (buf);
+
+		if (i != 0 && (offset < (ULONGLONG) i * sizeof (buf) || offset + sizeof (buf) > length))
+			continue;
+
+		double ms = TimeRead (dev, offset, buf, sizeof (buf), nbrBytesRead);
+		if (ms < 0)
+			return false;
+
+		if (i == 0 && nbrBytesRead >= CONCEAL_SIGNATURE_SIZE)
+			entry.State = GetConcealState (buf, &entry.FileSystem, transform);
+
+		totalMs += ms;
+		samples++;
+	}
+
+	entry.LatencyMs = totalMs / samples;
+	return true;
+}
+
+// Measures the throughput of a large read at the beginning of a range
+static bool ProbeThroughput (HANDLE dev, ULONGLONG rangeOffset, ULONGLONG rangeSize, PlanEntry &entry)
+{
+	DWORD sampleSize = (DWORD) min (rangeSize, (ULONGLONG) PLAN_THROUGHPUT_SAMPLE_SIZE);
+	BYTE *buffer = AcquireIoBuffer (sampleSize);
+	DWORD nbrBytesRead;
+	double ms;
+
+	if (!buffer)
+		return false;
+
+	ms = TimeRead (dev, rangeOffset, buffer, sampleSize, nbrBytesRead);
+	ReleaseIoBuffer (buffer, sampleSize);
+
+	if (ms < 0)
+		return false;
+
+	// Below the resolution of the counter, the read is assumed to take as long as a header read
+	if (ms == 0)
+		ms = entry.LatencyMs;
+
+	entry.ThroughputMBps = (ms > 0) ? nbrBytesRead / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
+	return true;
+}
+
+bool PlanConcealTarget (const wchar_t *target, DWORD dosDeviceCounter, bool bVerify, ULONGLONG rangeOffset, ULONGLONG rangeSize,
+	const ConcealTransform *transform, PlanEntry &entry)
+{
+	WCHAR dosDev[MAX_PATH] = {0};
+	WCHAR devName[MAX_PATH] = {0};
+	bool bDevice = IsHarddiskDevicePath (target);
+	bool bRange = (rangeSize != 0);
+	ConcealTransform deviceTransform;
+	HANDLE dev;
+
+	entry.Target = target;
+	entry.Success = false;
+
+	if (!GetDeviceTransform (target, transform, deviceTransform))
+	{
+		entry.LastError = GetLastError ();
+		return false;
+	}
+
+	if (bDevice && !FakeDosNameForDevice (dosDeviceCounter, target, dosDev, sizeof (dosDev), devName, sizeof (devName), FALSE))
+	{
+		entry.LastError = GetLastError ();
+		return false;
+	}
+
+	dev = CreateFileW (bDevice ? devName : target, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+	if (dev != INVALID_HANDLE_VALUE)
+	{
+		ULONGLONG length = 0;
+		LARGE_INTEGER fileSize;
+
+		if (!GetDeviceLength (dev, length) && GetFileSizeEx (dev, &fileSize))
+			length = fileSize.QuadPart;
+
+		if (rangeSize == PLAN_RANGE_SIZE_ALL)
+			rangeSize = (length > rangeOffset) ? (length - rangeOffset) / CONCEAL_RANGE_ALIGNMENT * CONCEAL_RANGE_ALIGNMENT : 0;
+
+		if (bRange && length != 0 && (rangeOffset > length || rangeSize > length - rangeOffset))
+			SetLastError (ERROR_HANDLE_EOF);
+		else if (ProbeTarget (dev, length, &deviceTransform, entry))
+			entry.Success = (rangeSize == 0) || ProbeThroughput (dev, rangeOffset, rangeSize, entry);
+
+		entry.LastError = entry.Success ? ERROR_SUCCESS : GetLastError ();
+		CloseHandle (dev);
+	}
+	else
+		entry.LastError = GetLastError ();
+
+	if (bDevice)
+		DefineDosDevice (DDD_REMOVE_DEFINITION, dosDev, target);
+
+	if (!entry.Success)
+		return false;
+
+	switch (entry.State)
+	{
+	case CONCEAL_STATE_VISIBLE:		entry.Action = CONCEAL_ACTION_CONCEAL; break;
+	case CONCEAL_STATE_CONCEALED:	entry.Action = CONCEAL_ACTION_REVEAL; break;
+	default:						entry.Action = CONCEAL_ACTION_TRANSFORM; break;
+	}
+
+	// A range is read and written once, in large transfers that cost their size at the measured throughput.
+	// Its state is the one of the header only when it starts at the beginning of the target.
+	if (bRange)
+	{
+		if (rangeOffset != 0)
+		{
+			entry.State = CONCEAL_STATE_UNKNOWN;
+			entry.FileSystem = NULL;
+			entry.Action = CONCEAL_ACTION_TRANSFORM;
+		}
+
+		entry.BytesToRead = rangeSize;
+		entry.BytesToWrite = rangeSize;
+		entry.EstimatedMs = (entry.ThroughputMBps > 0) ? (double) (entry.BytesToRead + entry.BytesToWrite) / (1024.0 * 1024.0) / entry.ThroughputMBps * 1000.0 : 0;
+
+		return true;
+	}
+
+	// One read and one write of the region, plus one read back when verifying. Writes go
+	// through to the device, so they are estimated to cost as much as a read.
+	int ioCount = bVerify ? 3 : 2;
+
+	entry.BytesToRead = (bVerify ? 2 : 1) * TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE;
+	entry.BytesToWrite = TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE;
+	entry.EstimatedMs = ioCount * entry.LatencyMs;
+
+	return true;
+}
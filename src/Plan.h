@@ -0,0 +1,75 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Plan.h : dry-run planning of conceal operations
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Conceal.h"
+
+// Number of reads of the size of a header used to measure the latency of a device, spread over the
+// device so that none of them is served by the cache of the device
+#define PLAN_LATENCY_SAMPLES			3
+
+// Size of the read used to measure the throughput of a device when planning a range
+#define PLAN_THROUGHPUT_SAMPLE_SIZE		(1024 * 1024)
+
+// Range size standing for the rest of the device after the range offset
+#define PLAN_RANGE_SIZE_ALL				((ULONGLONG) -1)
+
+enum ConcealAction
+{
+	CONCEAL_ACTION_CONCEAL,			// A visible filesystem would be concealed
+	CONCEAL_ACTION_REVEAL,			// A concealed filesystem would be restored
+	CONCEAL_ACTION_TRANSFORM		// No filesystem is recognized, the transformation would still be applied
+};
+
+struct PlanEntry
+{
+	PlanEntry ()
+		:
+		Success (false),
+		LastError (ERROR_SUCCESS),
+		State (CONCEAL_STATE_UNKNOWN),
+		FileSystem (NULL),
+		Action (CONCEAL_ACTION_TRANSFORM),
+		BytesToRead (0),
+		BytesToWrite (0),
+		LatencyMs (0),
+		ThroughputMBps (0),
+		EstimatedMs (0)
+	{
+	}
+
+	std::wstring Target;
+	bool Success;
+	DWORD LastError;
+	ConcealState State;
+	const wchar_t *FileSystem;
+	ConcealAction Action;
+	ULONGLONG BytesToRead;
+	ULONGLONG BytesToWrite;
+	double LatencyMs;				// Average measured latency of one header read
+	double ThroughputMBps;			// Measured throughput of a large read, when planning a range
+	double EstimatedMs;				// Estimated duration of the operation
+};
+
+const wchar_t *GetConcealActionName (ConcealAction action);
+
+// Determines what applying the transformation to a partition (\Device\HarddiskN\PartitionM) or an image
+// file would do, without writing anything. The target is opened for reading only and shared with
+// other readers and writers, so this is safe on live systems and concurrently with other planners.
+// A concealed filesystem is only recognized if it was concealed with the given transform.
+// When rangeSize is not 0, the transformation of rangeSize bytes from rangeOffset (/apply /size) is planned
+// instead of the one of the header, and its duration is estimated from the measured throughput of the device.
+// Fails with ERROR_HANDLE_EOF if the range does not fit in the target.
+bool PlanConcealTarget (const wchar_t *target, DWORD dosDeviceCounter, bool bVerify, ULONGLONG rangeOffset, ULONGLONG rangeSize,
+	const ConcealTransform *transform, PlanEntry &entry);
@@ -0,0 +1,73 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "Progress.h"
+
+ProgressRing::ProgressRing ()
+	:
+	Head (0),
+	Tail (0),
+	Dropped (0)
+{
+	ZeroMemory (Events, sizeof (Events));
+}
+
+bool ProgressRing::Post (ProgressEventType type, ULONGLONG completed, ULONGLONG total, DWORD lastError)
+{
+	DWORD head = (DWORD) Head;
+	DWORD tail = (DWORD) InterlockedCompareExchange (&Tail, 0, 0);
+	LARGE_INTEGER now;
+
+	if (head - tail >= PROGRESS_RING_CAPACITY)
+	{
+		InterlockedIncrement (&Dropped);
+		return false;
+	}
+
+	ProgressEvent &event = Events[head % PROGRESS_RING_CAPACITY];
+
+	QueryPerformanceCounter (&now);
+
+	event.Type = type;
+	event.Completed = completed;
+	event.Total = total;
+	event.LastError = lastError;
+	event.Time = now.QuadPart;
+
+	// Publishes the event, the interlocked operation being a full barrier
+	InterlockedExchange (&Head, (LONG) (head + 1));
+	return true;
+}
+
+bool ProgressRing::Read (ProgressEvent &event)
+{
+	DWORD tail = (DWORD) Tail;
+	DWORD head = (DWORD) InterlockedCompareExchange (&Head, 0, 0);
+
+	if (tail == head)
+		return false;
+
+	event = Events[tail % PROGRESS_RING_CAPACITY];
+
+	// Hands the slot back to the producer once it has been copied
+	InterlockedExchange (&Tail, (LONG) (tail + 1));
+	return true;
+}
+
+double GetProgressThroughput (const ProgressEvent &from, const ProgressEvent &to)
+{
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceFrequency (&frequency);
+
+	if (to.Time <= from.Time || to.Completed < from.Completed)
+		return 0;
+
+	return (double) (to.Completed - from.Completed) * (double) frequency.QuadPart / (double) (to.Time - from.Time);
+}
@@ -0,0 +1,64 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Progress.h : progress events passed from a worker to a reader without blocking the worker
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Events held by a ring, a power of two
+#define PROGRESS_RING_CAPACITY		64
+
+enum ProgressEventType
+{
+	PROGRESS_EVENT_STARTED,
+	PROGRESS_EVENT_ADVANCED,
+	PROGRESS_EVENT_COMPLETED,
+	PROGRESS_EVENT_FAILED
+};
+
+struct ProgressEvent
+{
+	ProgressEventType Type;
+	ULONGLONG Completed;			// Bytes of the operation done so far
+	ULONGLONG Total;
+	DWORD LastError;				// Of a PROGRESS_EVENT_FAILED event
+	LONGLONG Time;					// QueryPerformanceCounter value when the event was posted
+};
+
+// Ring of events with a single producer (the worker) and a single consumer (the thread displaying
+// the progress), neither of which ever waits for the other. The producer posts an event per batch
+// of work; an event posted while the ring is full is dropped and counted, the consumer only missing
+// an intermediate state, as the final state of an operation is read from its result.
+class ProgressRing
+{
+public:
+	ProgressRing ();
+
+	// Producer side
+	bool Post (ProgressEventType type, ULONGLONG completed, ULONGLONG total, DWORD lastError = ERROR_SUCCESS);
+
+	// Consumer side, returning false if no event is pending
+	bool Read (ProgressEvent &event);
+	LONG GetDroppedCount () const { return Dropped; }
+
+protected:
+	ProgressEvent Events[PROGRESS_RING_CAPACITY];
+	volatile LONG Head;				// Count of events posted, only modified by the producer
+	volatile LONG Tail;				// Count of events read, only modified by the consumer
+	volatile LONG Dropped;
+
+private:
+	ProgressRing (const ProgressRing &);
+	ProgressRing &operator= (const ProgressRing &);
+};
+
+// Returns the throughput in bytes per second between two progress events of the same operation
+double GetProgressThroughput (const ProgressEvent &from, const ProgressEvent &to);
@@ -0,0 +1,116 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "FakeDevice.h"
+
+FakeBlockDevice::FakeBlockDevice (size_t size, DWORD sectorSize)
+	:
+	Data (size),
+	SectorSize (sectorSize),
+	ReadCount (0),
+	WriteCount (0),
+	AccessMicroseconds (100),
+	BytesPerMicrosecond (200),
+	ElapsedMicroseconds (0)
+{
+}
+
+void FakeBlockDevice::SetLatency (DWORD accessMicroseconds, DWORD bytesPerMicrosecond)
+{
+	AccessMicroseconds = accessMicroseconds;
+	BytesPerMicrosecond = bytesPerMicrosecond ? bytesPerMicrosecond : 1;
+}
+
+bool FakeBlockDevice::Read (ULONGLONG offset, void *buffer, DWORD size, DWORD &bytesTransferred)
+{
+	return Transfer (false, offset, (BYTE *) buffer, size, bytesTransferred);
+}
+
+bool FakeBlockDevice::Write (ULONGLONG offset, const void *buffer, DWORD size, DWORD &bytesTransferred)
+{
+	return Transfer (true, offset, (BYTE *) buffer, size, bytesTransferred);
+}
+
+bool FakeBlockDevice::Transfer (bool bWrite, ULONGLONG offset, BYTE *buffer, DWORD size, DWORD &bytesTransferred)
+{
+	DWORD index = bWrite ? WriteCount++ : ReadCount++;
+	DWORD dwError = ERROR_SUCCESS;
+	DWORD count;
+
+	bytesTransferred = 0;
+	ElapsedMicroseconds += AccessMicroseconds + size / BytesPerMicrosecond;
+
+	// Like a device opened with FILE_FLAG_NO_BUFFERING
+	if ((offset % SectorSize) != 0 || (size % SectorSize) != 0)
+	{
+		SetLastError (ERROR_INVALID_PARAMETER);
+		return false;
+	}
+
+	if (offset + size > Data.size())
+	{
+		SetLastError (ERROR_SECTOR_NOT_FOUND);
+		return false;
+	}
+
+	count = size;
+
+	for (vector <FakeFault>::const_iterator It = Faults.begin(); It != Faults.end(); It++)
+	{
+		if (It->OnWrite != bWrite || It->Transfer != index)
+			continue;
+
+		switch (It->Type)
+		{
+		case FAKE_FAULT_FAIL:
+			count = 0;
+			dwError = It->Error;
+			break;
+
+		case FAKE_FAULT_TORN:
+			count = min (count, It->Sectors * SectorSize);
+			dwError = It->Error;
+			break;
+
+		case FAKE_FAULT_BAD_SECTOR:
+			BadSectors.push_back (*It);
+			break;
+
+		case FAKE_FAULT_DELAY:
+			ElapsedMicroseconds += (ULONGLONG) It->DelayMs * 1000;
+			break;
+		}
+	}
+
+	for (vector <FakeFault>::const_iterator It = BadSectors.begin(); It != BadSectors.end(); It++)
+	{
+		ULONGLONG sectorOffset = (ULONGLONG) It->Sectors * SectorSize;
+
+		if (sectorOffset >= offset && sectorOffset < offset + size)
+		{
+			count = min (count, (DWORD) (sectorOffset - offset));
+			dwError = It->Error;
+		}
+	}
+
+	if (bWrite)
+		memcpy (&Data[(size_t) offset], buffer, count);
+	else
+		memcpy (buffer, &Data[(size_t) offset], count);
+
+	bytesTransferred = count;
+
+	if (dwError != ERROR_SUCCESS)
+	{
+		SetLastError (dwError);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,77 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// FakeDevice.h : in-memory device injecting scripted faults, with a simulated clock
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "BlockDevice.h"
+
+enum FakeFaultType
+{
+	FAKE_FAULT_FAIL,				// The transfer fails without transferring anything
+	FAKE_FAULT_TORN,				// The first Sectors sectors are transferred, then the transfer fails
+	FAKE_FAULT_BAD_SECTOR,			// From then on, every transfer reaching sector Sectors stops there and fails
+	FAKE_FAULT_DELAY				// The transfer succeeds after DelayMs more milliseconds
+};
+
+struct FakeFault
+{
+	FakeFault ()
+		:
+		Type (FAKE_FAULT_FAIL),
+		OnWrite (true),
+		Transfer (0),
+		Sectors (0),
+		DelayMs (0),
+		Error (ERROR_IO_DEVICE)
+	{
+	}
+
+	FakeFaultType Type;
+	bool OnWrite;					// Applies to the writes, or else to the reads
+	DWORD Transfer;					// Index of the read or write triggering the fault, from 0
+	DWORD Sectors;
+	DWORD DelayMs;
+	DWORD Error;					// Last error set by a failed transfer
+};
+
+class FakeBlockDevice : public BlockDevice
+{
+public:
+	FakeBlockDevice (size_t size, DWORD sectorSize);
+
+	// Each transfer takes accessMicroseconds plus its size divided by bytesPerMicrosecond (100 us and 200 by default)
+	void SetLatency (DWORD accessMicroseconds, DWORD bytesPerMicrosecond);
+	void AddFault (const FakeFault &fault) { Faults.push_back (fault); }
+
+	virtual bool Read (ULONGLONG offset, void *buffer, DWORD size, DWORD &bytesTransferred);
+	virtual bool Write (ULONGLONG offset, const void *buffer, DWORD size, DWORD &bytesTransferred);
+	virtual void Pause (DWORD milliseconds) { ElapsedMicroseconds += (ULONGLONG) milliseconds * 1000; }
+
+	std::vector <BYTE> &GetData () { return Data; }
+	ULONGLONG GetElapsedMicroseconds () const { return ElapsedMicroseconds; }
+	DWORD GetReadCount () const { return ReadCount; }
+	DWORD GetWriteCount () const { return WriteCount; }
+
+protected:
+	bool Transfer (bool bWrite, ULONGLONG offset, BYTE *buffer, DWORD size, DWORD &bytesTransferred);
+
+	std::vector <BYTE> Data;
+	DWORD SectorSize;
+	std::vector <FakeFault> Faults;
+	std::vector <FakeFault> BadSectors;		// FAKE_FAULT_BAD_SECTOR faults already triggered
+	DWORD ReadCount;
+	DWORD WriteCount;
+	DWORD AccessMicroseconds;
+	DWORD BytesPerMicrosecond;
+	ULONGLONG ElapsedMicroseconds;
+};
@@ -0,0 +1,203 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+
+#include "Conceal.h"
+#include "ConcealRange.h"
+#include "FakeDevice.h"
+#include "Simulation.h"
+
+// xorshift32, so that a run only depends on its seed
+class SimulationRandom
+{
+public:
+	SimulationRandom (DWORD seed) : State (seed * 2654435761U + 1) { if (!State) State = 1; }
+
+	DWORD Next (DWORD bound)
+	{
+		State ^= State << 13;
+		State ^= State >> 17;
+		State ^= State << 5;
+		return bound ? State % bound : 0;
+	}
+
+protected:
+	DWORD State;
+};
+
+static const DWORD SimulationErrors[] = { ERROR_IO_DEVICE, ERROR_CRC, ERROR_SECTOR_NOT_FOUND, ERROR_WRITE_FAULT, ERROR_READ_FAULT };
+
+static void SimulateConceal (DWORD seed, ConcealSimulationResult &result)
+{
+	SimulationRandom random (seed);
+	DWORD sectorSize = random.Next (2) ? 512 : 4096;
+	FakeBlockDevice device (CONCEAL_SIMULATION_DEVICE_SIZE, sectorSize);
+	vector <BYTE> &data = device.GetData ();
+	bool bHeaderBadSector = false;
+
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (BYTE) random.Next (256);
+
+	// Half of the devices hold a filesystem
+	bool bFileSystem = random.Next (2) != 0;
+	if (bFileSystem)
+		memcpy (&data[0], "\xEB\x52\x90NTFS    ", CONCEAL_SIGNATURE_SIZE);
+
+	vector <BYTE> original (data);
+
+	DWORD faultCount = random.Next (CONCEAL_SIMULATION_MAX_FAULTS + 1);
+	for (DWORD i = 0; i < faultCount; i++)
+	{
+		FakeFault fault;
+
+		fault.Type = (FakeFaultType) random.Next (FAKE_FAULT_DELAY + 1);
+		fault.OnWrite = random.Next (4) != 0;
+		fault.Transfer = random.Next (fault.OnWrite ? 3 : 2);
+		fault.Sectors = random.Next (TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE / sectorSize + 2);
+		fault.DelayMs = random.Next (500);
+		fault.Error = SimulationErrors[random.Next (ARRAYSIZE (SimulationErrors))];
+
+		if (fault.Type == FAKE_FAULT_BAD_SECTOR && fault.Sectors * sectorSize < TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE)
+			bHeaderBadSector = true;
+
+		device.AddFault (fault);
+	}
+
+	device.SetLatency (50 + random.Next (200), 100 + random.Next (400));
+
+	bool bVerify = random.Next (2) != 0;
+	bool bHadFileSystemBefore = false, bHasFileSystemNow = false;
+	ConcealVerification verification;
+	ErrorCollector errors (L"simulated");
+
+	SetLastError (ERROR_SUCCESS);
+
+	bool bSuccess = ConcealNTFS (device, bHadFileSystemBefore, bHasFileSystemNow, bVerify ? &verification : NULL, NULL, &errors);
+	DWORD dwError = GetLastError ();
+
+	vector <BYTE> expected (original);
+	ApplyConcealTransform (NULL, &expected[0], TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE, 0);
+
+	// Nothing may be written beyond the transformed region
+	bool bTailUnchanged = memcmp (&data[TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE], &original[TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE],
+		data.size() - TC_INITIAL_NTFS_CONCEAL_PORTION_SIZE) == 0;
+
+	result.Iterations++;
+	result.SimulatedMicroseconds += device.GetElapsedMicroseconds ();
+
+	if (bSuccess)
+	{
+		if (data == expected && bHadFileSystemBefore == bFileSystem && !bHasFileSystemNow && (!bVerify || verification.Verified))
+		{
+			result.Succeeded++;
+			return;
+		}
+	}
+	else if (dwError != ERROR_SUCCESS && !errors.GetErrors().empty())
+	{
+		if (data == original)
+		{
+			result.Unchanged++;
+			return;
+		}
+
+		if (data == expected)
+		{
+			result.Written++;
+			return;
+		}
+
+		if (bHeaderBadSector && bTailUnchanged)
+		{
+			result.Unrecovered++;
+			return;
+		}
+	}
+
+	if (result.Violations++ == 0)
+		result.FirstViolation = seed;
+}
+
+// Writes a batch of several blocks, the write of the block failedBlock failing or being torn. A batch
+// failing at a block must leave every one of its blocks, the failed one included, as it was.
+static void SimulateConcealBatch (DWORD seed, ConcealSimulationResult &result)
+{
+	SimulationRandom random (~seed);
+	DWORD sectorSize = random.Next (2) ? 512 : 4096;
+	FakeBlockDevice device (CONCEAL_SIMULATION_DEVICE_SIZE, sectorSize);
+	vector <BYTE> &data = device.GetData ();
+
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (BYTE) random.Next (256);
+
+	vector <BYTE> original (data);
+
+	// The last block may be shorter than the others
+	DWORD blockSize = CONCEAL_RANGE_ALIGNMENT * (1 + random.Next (2));
+	DWORD blockCount = 2 + random.Next (CONCEAL_SIMULATION_MAX_BATCH_BLOCKS - 1);
+	DWORD count = (blockCount - 1) * blockSize + sectorSize * (1 + random.Next (blockSize / sectorSize));
+	ULONGLONG offset = (ULONGLONG) sectorSize * random.Next ((DWORD) (data.size() - count) / sectorSize + 1);
+
+	// One run in blockCount + 1 writes the whole batch
+	DWORD failedBlock = random.Next (blockCount + 1);
+	if (failedBlock < blockCount)
+	{
+		FakeFault fault;
+
+		fault.Type = random.Next (2) ? FAKE_FAULT_TORN : FAKE_FAULT_FAIL;
+		fault.Transfer = failedBlock;
+		fault.Sectors = random.Next (min (blockSize, count - failedBlock * blockSize) / sectorSize);
+		fault.Error = SimulationErrors[random.Next (ARRAYSIZE (SimulationErrors))];
+
+		device.AddFault (fault);
+	}
+
+	vector <BYTE> batch (original.begin() + (size_t) offset, original.begin() + (size_t) (offset + count));
+	ApplyConcealTransform (NULL, &batch[0], count, offset);
+
+	vector <BYTE> expected (original);
+	memcpy (&expected[(size_t) offset], &batch[0], count);
+
+	ErrorCollector errors (L"simulated");
+
+	SetLastError (ERROR_SUCCESS);
+
+	bool bSuccess = WriteConcealBatch (device, offset, &batch[0], count, blockSize, NULL, false, &errors);
+	DWORD dwError = GetLastError ();
+
+	result.SimulatedMicroseconds += device.GetElapsedMicroseconds ();
+
+	if (bSuccess)
+	{
+		if (failedBlock == blockCount && data == expected)
+		{
+			result.BatchWritten++;
+			return;
+		}
+	}
+	else if (failedBlock < blockCount && dwError != ERROR_SUCCESS && !errors.GetErrors().empty() && data == original)
+	{
+		result.BatchRestored++;
+		return;
+	}
+
+	if (result.Violations++ == 0)
+		result.FirstViolation = seed;
+}
+
+void RunConcealSimulation (DWORD iterations, DWORD seed, ConcealSimulationResult &result)
+{
+	result = ConcealSimulationResult ();
+
+	for (DWORD i = 0; i < iterations; i++)
+	{
+		SimulateConceal (seed + i, result);
+		SimulateConcealBatch (seed + i, result);
+	}
+}
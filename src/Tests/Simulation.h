@@ -0,0 +1,58 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Simulation.h : conceal operations run on simulated faulty devices
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Size of each simulated device
+#define CONCEAL_SIMULATION_DEVICE_SIZE		(64 * 1024)
+
+// Most faults scheduled for one run
+#define CONCEAL_SIMULATION_MAX_FAULTS		4
+
+// Most blocks of a simulated range batch
+#define CONCEAL_SIMULATION_MAX_BATCH_BLOCKS	6
+
+struct ConcealSimulationResult
+{
+	ConcealSimulationResult ()
+		:
+		Iterations (0),
+		Succeeded (0),
+		Unchanged (0),
+		Written (0),
+		Unrecovered (0),
+		BatchWritten (0),
+		BatchRestored (0),
+		Violations (0),
+		FirstViolation (0),
+		SimulatedMicroseconds (0)
+	{
+	}
+
+	DWORD Iterations;
+	DWORD Succeeded;				// Transformed and, when verified, read back identical
+	DWORD Unchanged;				// Failed, and the device holds its original data
+	DWORD Written;					// Failed after the transformed data was written (read back failure)
+	DWORD Unrecovered;				// Failed, and a bad sector prevented writing the original data back
+	DWORD BatchWritten;				// Range batch written whole, transformed
+	DWORD BatchRestored;			// Range batch failing at one of its blocks, all of its blocks holding their original data
+	DWORD Violations;				// Any other outcome, including a failure without an error
+	DWORD FirstViolation;			// Seed of the first run with a violation
+	ULONGLONG SimulatedMicroseconds;	// Time the runs would take on the simulated devices
+};
+
+// Runs ConcealNTFS on iterations in-memory devices, the run i injecting faults (failed, torn and slow
+// transfers, bad sectors) drawn from seed + i. Each run also writes a range batch of several blocks with
+// WriteConcealBatch to another device, failing or tearing one of its block writes drawn from the same seed.
+// A run is reproduced by giving its seed with one iteration.
+void RunConcealSimulation (DWORD iterations, DWORD seed, ConcealSimulationResult &result);
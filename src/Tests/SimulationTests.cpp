@@ -0,0 +1,93 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+// SimulationTests.cpp : console test running the conceal operations on simulated faulty devices,
+// built from the sources of ConcealDrive.exe. Exits with 1 if a run breaks the rules of the
+// simulation, giving its seed, which /seed <seed> /iterations 1 replays alone.
+//
+
+#include "stdafx.h"
+#include <errno.h>
+
+#include "Simulation.h"
+
+CAppModule _Module;
+
+// The simulated devices use neither the native API nor the functions of the recent systems
+RTLINITUNICODESTRING RtlInitUnicodeString = NULL;
+NTOPENSYMBOLICLINKOBJECT NtOpenSymbolicLinkObject = NULL;
+NTQUERYSYMBOLICLINKOBJECT NtQuerySymbolicLinkObject = NULL;
+NTCLOSE NtClose = NULL;
+PREFETCHVIRTUALMEMORY PrefetchVirtualMemory = NULL;
+GETVOLUMEINFORMATIONBYHANDLEW GetVolumeInformationByHandle = NULL;
+SETFILEINFORMATIONBYHANDLE SetFileInformationByHandle = NULL;
+GETLARGEPAGEMINIMUM GetLargePageMinimum = NULL;
+
+static bool ParseNumberArgument (const wchar_t *arg, DWORD &value)
+{
+	wchar_t *end;
+	unsigned long number;
+
+	if (*arg < L'0' || *arg > L'9')
+		return false;
+
+	errno = 0;
+	number = wcstoul (arg, &end, 10);
+
+	if (errno == ERANGE || *end != 0)
+		return false;
+
+	value = number;
+	return true;
+}
+
+int wmain (int argc, wchar_t **argv)
+{
+	ConcealSimulationResult result;
+	LARGE_INTEGER frequency, start, end;
+	DWORD iterations = 10000, seed = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((_wcsicmp (argv[i], L"/iterations") == 0 || _wcsicmp (argv[i], L"/seed") == 0) && i + 1 < argc)
+		{
+			DWORD *value = (_wcsicmp (argv[i], L"/iterations") == 0) ? &iterations : &seed;
+
+			if (!ParseNumberArgument (argv[++i], *value))
+			{
+				fwprintf (stderr, L"Invalid number: %s\n", argv[i]);
+				return 2;
+			}
+		}
+		else
+		{
+			fwprintf (stderr, L"Usage: ConcealDriveTests [/iterations <count>] [/seed <number>]\n");
+			return 2;
+		}
+	}
+
+	QueryPerformanceFrequency (&frequency);
+	QueryPerformanceCounter (&start);
+
+	RunConcealSimulation (iterations, seed, result);
+
+	QueryPerformanceCounter (&end);
+
+	wprintf (L"iterations\tsucceeded\tunchanged\twritten\tunrecovered\tbatch_written\tbatch_restored\tviolations\tsimulated_ms\tduration_ms\n");
+	wprintf (L"%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%I64u\t%.3f\n", result.Iterations, result.Succeeded, result.Unchanged, result.Written,
+		result.Unrecovered, result.BatchWritten, result.BatchRestored, result.Violations, result.SimulatedMicroseconds / 1000,
+		(double) (end.QuadPart - start.QuadPart) * 1000.0 / (double) frequency.QuadPart);
+
+	if (result.Violations != 0)
+	{
+		wprintf (L"violation\tseed %u\n", result.FirstViolation);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include "Throttle.h"
+
+TokenBucket::TokenBucket (ULONGLONG rate)
+	:
+	Rate ((double) rate),
+	Burst ((double) rate * IO_THROTTLE_BURST_MS / 1000),
+	Tokens ((double) rate * IO_THROTTLE_BURST_MS / 1000)
+{
+	InitializeCriticalSection (&Lock);
+	QueryPerformanceFrequency (&Frequency);
+	QueryPerformanceCounter (&LastRefill);
+}
+
+TokenBucket::~TokenBucket ()
+{
+	DeleteCriticalSection (&Lock);
+}
+
+DWORD TokenBucket::Take (ULONGLONG amount)
+{
+	LARGE_INTEGER now;
+	DWORD waitMs = 0;
+
+	if (Rate == 0)
+		return 0;
+
+	EnterCriticalSection (&Lock);
+
+	QueryPerformanceCounter (&now);
+
+	Tokens += Rate * (double) (now.QuadPart - LastRefill.QuadPart) / (double) Frequency.QuadPart;
+	if (Tokens > Burst)
+		Tokens = Burst;
+
+	LastRefill = now;
+
+	// Consumers waiting at the same time are served in turn, each one adding to the debt
+	Tokens -= (double) amount;
+	if (Tokens < 0)
+		waitMs = (DWORD) (-Tokens * 1000 / Rate + 0.5);
+
+	LeaveCriticalSection (&Lock);
+	return waitMs;
+}
+
+IoThrottle::IoThrottle (const IoThrottleLimits &limits, IoThrottle *global)
+	:
+	Bytes (limits.BytesPerSecond),
+	Operations (limits.OperationsPerSecond),
+	Global (global)
+{
+}
+
+void IoThrottle::Acquire (DWORD size)
+{
+	DWORD bytesWait = Bytes.Take (size);
+	DWORD operationsWait = Operations.Take (1);
+
+	if (bytesWait != 0 || operationsWait != 0)
+		Sleep (max (bytesWait, operationsWait));
+
+	if (Global)
+		Global->Acquire (size);
+}
+
+bool ThrottledBlockDevice::Read (ULONGLONG offset, void *buffer, DWORD size, DWORD &bytesTransferred)
+{
+	if (!Throttle)
+		return Device.Read (offset, buffer, size, bytesTransferred);
+
+	bytesTransferred = 0;
+
+	while (bytesTransferred < size)
+	{
+		DWORD chunk = min (size - bytesTransferred, (DWORD) IO_THROTTLE_MAX_TRANSFER);
+		DWORD chunkTransferred;
+
+		Throttle->Acquire (chunk);
+
+		bool bResult = Device.Read (offset + bytesTransferred, (BYTE *) buffer + bytesTransferred, chunk, chunkTransferred);
+		bytesTransferred += chunkTransferred;
+
+		if (!bResult)
+			return false;
+
+		// End of the device
+		if (chunkTransferred < chunk)
+			break;
+	}
+
+	return true;
+}
+
+bool ThrottledBlockDevice::Write (ULONGLONG offset, const void *buffer, DWORD size, DWORD &bytesTransferred)
+{
+	if (!Throttle)
+		return Device.Write (offset, buffer, size, bytesTransferred);
+
+	bytesTransferred = 0;
+
+	while (bytesTransferred < size)
+	{
+		DWORD chunk = min (size - bytesTransferred, (DWORD) IO_THROTTLE_MAX_TRANSFER);
+		DWORD chunkTransferred;
+
+		Throttle->Acquire (chunk);
+
+		bool bResult = Device.Write (offset + bytesTransferred, (const BYTE *) buffer + bytesTransferred, chunk, chunkTransferred);
+		bytesTransferred += chunkTransferred;
+
+		if (!bResult)
+			return false;
+
+		if (chunkTransferred < chunk)
+			break;
+	}
+
+	return true;
+}
+
+bool SetLowIoPriority (HANDLE hDev)
+{
+	FILE_IO_PRIORITY_HINT_INFO priorityHint;
+
+	if (!SetFileInformationByHandle)
+	{
+		SetLastError (ERROR_CALL_NOT_IMPLEMENTED);
+		return false;
+	}
+
+	priorityHint.PriorityHint = IoPriorityHintLow;
+	return SetFileInformationByHandle (hDev, FileIoPriorityHintInfo, &priorityHint, sizeof (priorityHint)) != FALSE;
+}
@@ -0,0 +1,97 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Throttle.h : limits on the bandwidth and I/O rate of the transforms
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "BlockDevice.h"
+
+// Largest transfer issued at a time under a throttle, so that other I/O to the disk is never queued behind a long transfer
+#define IO_THROTTLE_MAX_TRANSFER		(1024 * 1024)
+
+// Tokens a bucket may accumulate while it is not used, in milliseconds of its rate
+#define IO_THROTTLE_BURST_MS			100
+
+// Refilled at a constant rate. A consumer takes what it needs even beyond the tokens available and waits until the
+// debt is repaid, so that transfers larger than the burst are not starved. May be used by several threads.
+class TokenBucket
+{
+public:
+	// A rate of 0 (tokens per second) is unlimited
+	TokenBucket (ULONGLONG rate);
+	~TokenBucket ();
+
+	// Returns the time (ms) to wait before using the tokens taken
+	DWORD Take (ULONGLONG amount);
+
+protected:
+	CRITICAL_SECTION Lock;
+	double Rate;
+	double Burst;
+	double Tokens;
+	LARGE_INTEGER Frequency;
+	LARGE_INTEGER LastRefill;
+
+private:
+	TokenBucket (const TokenBucket &);
+	TokenBucket &operator= (const TokenBucket &);
+};
+
+struct IoThrottleLimits
+{
+	IoThrottleLimits ()
+		:
+		BytesPerSecond (0),
+		OperationsPerSecond (0)
+	{
+	}
+
+	bool IsLimited () const { return BytesPerSecond != 0 || OperationsPerSecond != 0; }
+
+	ULONGLONG BytesPerSecond;		// 0 for no limit
+	ULONGLONG OperationsPerSecond;	// 0 for no limit
+};
+
+// Limits of a device, optionally shared with other devices through a global throttle
+class IoThrottle
+{
+public:
+	IoThrottle (const IoThrottleLimits &limits, IoThrottle *global = NULL);
+
+	// Waits until a transfer of size bytes is allowed by this throttle and the global one
+	void Acquire (DWORD size);
+
+protected:
+	TokenBucket Bytes;
+	TokenBucket Operations;
+	IoThrottle *Global;
+};
+
+// Device whose transfers are throttled, in chunks of up to IO_THROTTLE_MAX_TRANSFER bytes. Without
+// a throttle (NULL), the transfers are passed to the device unchanged.
+class ThrottledBlockDevice : public BlockDevice
+{
+public:
+	ThrottledBlockDevice (BlockDevice &device, IoThrottle *throttle) : Device (device), Throttle (throttle) { }
+
+	virtual bool Read (ULONGLONG offset, void *buffer, DWORD size, DWORD &bytesTransferred);
+	virtual bool Write (ULONGLONG offset, const void *buffer, DWORD size, DWORD &bytesTransferred);
+	virtual void Pause (DWORD milliseconds) { Device.Pause (milliseconds); }
+
+protected:
+	BlockDevice &Device;
+	IoThrottle *Throttle;
+};
+
+// Asks the system to process the I/O of an open device or file with a low priority, so that it yields
+// to the other I/O of the disk. Returns false on systems older than Windows Vista.
+bool SetLowIoPriority (HANDLE hDev);
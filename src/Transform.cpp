@@ -0,0 +1,306 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <emmintrin.h>
+
+#include "Conceal.h"
+#include "Transform.h"
+
+#define CHACHA20_BLOCK_SIZE		64
+#define CHACHA20_PARALLEL_BLOCKS	4
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA20_QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32 (d, 16); \
+	c += d; b ^= c; b = ROTL32 (b, 12); \
+	a += b; d ^= a; d = ROTL32 (d, 8); \
+	c += d; b ^= c; b = ROTL32 (b, 7);
+
+#define SSE2_ROTL32(v, n) _mm_or_si128 (_mm_slli_epi32 (v, n), _mm_srli_epi32 (v, 32 - (n)))
+
+#define SSE2_CHACHA20_QUARTERROUND(a, b, c, d) \
+	a = _mm_add_epi32 (a, b); d = _mm_xor_si128 (d, a); d = SSE2_ROTL32 (d, 16); \
+	c = _mm_add_epi32 (c, d); b = _mm_xor_si128 (b, c); b = SSE2_ROTL32 (b, 12); \
+	a = _mm_add_epi32 (a, b); d = _mm_xor_si128 (d, a); d = SSE2_ROTL32 (d, 8); \
+	c = _mm_add_epi32 (c, d); b = _mm_xor_si128 (b, c); b = SSE2_ROTL32 (b, 7);
+
+static const unsigned __int32 ChaCha20Constants[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };	// "expand 32-byte k"
+
+static bool Sse2Supported = false;
+static volatile bool TransformInitialized = false;
+
+static void InitTransform ()
+{
+#ifdef _M_X64
+	Sse2Supported = true;
+#else
+	Sse2Supported = IsProcessorFeaturePresent (PF_XMMI64_INSTRUCTIONS_AVAILABLE) != FALSE;
+#endif
+	MemoryBarrier ();
+	TransformInitialized = true;
+}
+
+static void XorBuffer (BYTE *data, const BYTE *key, size_t size)
+{
+	if (Sse2Supported)
+	{
+		for (; size >= 64; size -= 64, data += 64, key += 64)
+		{
+			__m128i d0 = _mm_loadu_si128 ((const __m128i *) data);
+			__m128i d1 = _mm_loadu_si128 ((const __m128i *) (data + 16));
+			__m128i d2 = _mm_loadu_si128 ((const __m128i *) (data + 32));
+			__m128i d3 = _mm_loadu_si128 ((const __m128i *) (data + 48));
+
+			_mm_storeu_si128 ((__m128i *) data, _mm_xor_si128 (d0, _mm_loadu_si128 ((const __m128i *) key)));
+			_mm_storeu_si128 ((__m128i *) (data + 16), _mm_xor_si128 (d1, _mm_loadu_si128 ((const __m128i *) (key + 16))));
+			_mm_storeu_si128 ((__m128i *) (data + 32), _mm_xor_si128 (d2, _mm_loadu_si128 ((const __m128i *) (key + 32))));
+			_mm_storeu_si128 ((__m128i *) (data + 48), _mm_xor_si128 (d3, _mm_loadu_si128 ((const __m128i *) (key + 48))));
+		}
+
+		for (; size >= 16; size -= 16, data += 16, key += 16)
+			_mm_storeu_si128 ((__m128i *) data, _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) data), _mm_loadu_si128 ((const __m128i *) key)));
+	}
+
+	while (size-- > 0)
+		*data++ ^= *key++;
+}
+
+static void XorConstant (BYTE *data, size_t size, BYTE constant)
+{
+	if (Sse2Supported)
+	{
+		__m128i c = _mm_set1_epi8 ((char) constant);
+
+		for (; size >= 64; size -= 64, data += 64)
+		{
+			_mm_storeu_si128 ((__m128i *) data, _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) data), c));
+			_mm_storeu_si128 ((__m128i *) (data + 16), _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (data + 16)), c));
+			_mm_storeu_si128 ((__m128i *) (data + 32), _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (data + 32)), c));
+			_mm_storeu_si128 ((__m128i *) (data + 48), _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (data + 48)), c));
+		}
+	}
+
+	while (size-- > 0)
+		*data++ ^= constant;
+}
+
+static void XorPattern (BYTE *data, size_t size, const BYTE *pattern, size_t patternSize, ULONGLONG offset)
+{
+	// The period holds a whole number of patterns and of 16-byte blocks, so that every
+	// period of the data is XORed with the same bytes starting at the same phase
+	BYTE expanded[CONCEAL_MAX_PATTERN_SIZE * 16 * 2];
+	size_t periodSize = patternSize * 16;
+	size_t phase = (size_t) (offset % patternSize);
+
+	for (size_t i = 0; i < periodSize * 2; i += patternSize)
+		memcpy (expanded + i, pattern, patternSize);
+
+	while (size > 0)
+	{
+		size_t count = (size < periodSize) ? size : periodSize;
+
+		XorBuffer (data, expanded + phase, count);
+		data += count;
+		size -= count;
+	}
+
+	SecureZeroMemory (expanded, sizeof (expanded));
+}
+
+// Original ChaCha20 with a 64-bit block counter (words 12 and 13) and a 64-bit nonce (words 14 and 15),
+// so that the keystream covers the whole device and each block is addressed by offset / 64
+static void ChaCha20Block (const unsigned __int32 *key, const unsigned __int32 *nonce, ULONGLONG counter, BYTE *out)
+{
+	unsigned __int32 input[16], x[16];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		input[i] = ChaCha20Constants[i];
+
+	for (i = 0; i < 8; i++)
+		input[4 + i] = key[i];
+
+	input[12] = (unsigned __int32) counter;
+	input[13] = (unsigned __int32) (counter >> 32);
+	input[14] = nonce[0];
+	input[15] = nonce[1];
+
+	memcpy (x, input, sizeof (x));
+
+	for (i = 0; i < 10; i++)
+	{
+		CHACHA20_QUARTERROUND (x[0], x[4], x[8], x[12]);
+		CHACHA20_QUARTERROUND (x[1], x[5], x[9], x[13]);
+		CHACHA20_QUARTERROUND (x[2], x[6], x[10], x[14]);
+		CHACHA20_QUARTERROUND (x[3], x[7], x[11], x[15]);
+		CHACHA20_QUARTERROUND (x[0], x[5], x[10], x[15]);
+		CHACHA20_QUARTERROUND (x[1], x[6], x[11], x[12]);
+		CHACHA20_QUARTERROUND (x[2], x[7], x[8], x[13]);
+		CHACHA20_QUARTERROUND (x[3], x[4], x[9], x[14]);
+	}
+
+	for (i = 0; i < 16; i++)
+		x[i] += input[i];
+
+	memcpy (out, x, CHACHA20_BLOCK_SIZE);	// Words are serialized in little-endian order
+
+	SecureZeroMemory (input, sizeof (input));
+	SecureZeroMemory (x, sizeof (x));
+}
+
+// Computes CHACHA20_PARALLEL_BLOCKS consecutive blocks at once, one block per SSE2 lane
+static void ChaCha20Blocks4 (const unsigned __int32 *key, const unsigned __int32 *nonce, ULONGLONG counter, BYTE *out)
+{
+	__m128i x[16], input[16];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		input[i] = _mm_set1_epi32 ((int) ChaCha20Constants[i]);
+
+	for (i = 0; i < 8; i++)
+		input[4 + i] = _mm_set1_epi32 ((int) key[i]);
+
+	input[12] = _mm_set_epi32 ((int) (counter + 3), (int) (counter + 2), (int) (counter + 1), (int) counter);
+	input[13] = _mm_set_epi32 ((int) ((counter + 3) >> 32), (int) ((counter + 2) >> 32), (int) ((counter + 1) >> 32), (int) (counter >> 32));
+	input[14] = _mm_set1_epi32 ((int) nonce[0]);
+	input[15] = _mm_set1_epi32 ((int) nonce[1]);
+
+	for (i = 0; i < 16; i++)
+		x[i] = input[i];
+
+	for (i = 0; i < 10; i++)
+	{
+		SSE2_CHACHA20_QUARTERROUND (x[0], x[4], x[8], x[12]);
+		SSE2_CHACHA20_QUARTERROUND (x[1], x[5], x[9], x[13]);
+		SSE2_CHACHA20_QUARTERROUND (x[2], x[6], x[10], x[14]);
+		SSE2_CHACHA20_QUARTERROUND (x[3], x[7], x[11], x[15]);
+		SSE2_CHACHA20_QUARTERROUND (x[0], x[5], x[10], x[15]);
+		SSE2_CHACHA20_QUARTERROUND (x[1], x[6], x[11], x[12]);
+		SSE2_CHACHA20_QUARTERROUND (x[2], x[7], x[8], x[13]);
+		SSE2_CHACHA20_QUARTERROUND (x[3], x[4], x[9], x[14]);
+	}
+
+	// Transpose each group of four words so that every block is stored contiguously
+	for (i = 0; i < 16; i += 4)
+	{
+		__m128i a = _mm_add_epi32 (x[i], input[i]);
+		__m128i b = _mm_add_epi32 (x[i + 1], input[i + 1]);
+		__m128i c = _mm_add_epi32 (x[i + 2], input[i + 2]);
+		__m128i d = _mm_add_epi32 (x[i + 3], input[i + 3]);
+
+		__m128i t0 = _mm_unpacklo_epi32 (a, b);
+		__m128i t1 = _mm_unpacklo_epi32 (c, d);
+		__m128i t2 = _mm_unpackhi_epi32 (a, b);
+		__m128i t3 = _mm_unpackhi_epi32 (c, d);
+
+		_mm_storeu_si128 ((__m128i *) (out + i * 4), _mm_unpacklo_epi64 (t0, t1));
+		_mm_storeu_si128 ((__m128i *) (out + CHACHA20_BLOCK_SIZE + i * 4), _mm_unpackhi_epi64 (t0, t1));
+		_mm_storeu_si128 ((__m128i *) (out + 2 * CHACHA20_BLOCK_SIZE + i * 4), _mm_unpacklo_epi64 (t2, t3));
+		_mm_storeu_si128 ((__m128i *) (out + 3 * CHACHA20_BLOCK_SIZE + i * 4), _mm_unpackhi_epi64 (t2, t3));
+	}
+
+	SecureZeroMemory (x, sizeof (x));
+	SecureZeroMemory (input, sizeof (input));
+}
+
+static void XorKeystream (BYTE *data, size_t size, const BYTE *key, const BYTE *nonce, ULONGLONG offset)
+{
+	BYTE keystream[CHACHA20_BLOCK_SIZE * CHACHA20_PARALLEL_BLOCKS];
+	unsigned __int32 keyWords[CONCEAL_KEY_SIZE / 4];
+	unsigned __int32 nonceWords[CONCEAL_NONCE_SIZE / 4];
+	ULONGLONG counter = offset / CHACHA20_BLOCK_SIZE;
+	size_t skip = (size_t) (offset % CHACHA20_BLOCK_SIZE);
+
+	memcpy (keyWords, key, sizeof (keyWords));	// Key and nonce words are read in little-endian order
+	memcpy (nonceWords, nonce, sizeof (nonceWords));
+
+	while (size > 0)
+	{
+		size_t keystreamSize, count;
+
+		if (Sse2Supported && skip + size > CHACHA20_BLOCK_SIZE)
+		{
+			ChaCha20Blocks4 (keyWords, nonceWords, counter, keystream);
+			keystreamSize = CHACHA20_BLOCK_SIZE * CHACHA20_PARALLEL_BLOCKS;
+		}
+		else
+		{
+			ChaCha20Block (keyWords, nonceWords, counter, keystream);
+			keystreamSize = CHACHA20_BLOCK_SIZE;
+		}
+
+		count = keystreamSize - skip;
+		if (count > size)
+			count = size;
+
+		XorBuffer (data, keystream + skip, count);
+
+		data += count;
+		size -= count;
+		counter += keystreamSize / CHACHA20_BLOCK_SIZE;
+		skip = 0;
+	}
+
+	SecureZeroMemory (keystream, sizeof (keystream));
+	SecureZeroMemory (keyWords, sizeof (keyWords));
+}
+
+void ApplyConcealTransform (const ConcealTransform *transform, void *data, size_t size, ULONGLONG offset)
+{
+	if (!TransformInitialized)
+		InitTransform ();
+
+	if (!transform || transform->Mode == CONCEAL_TRANSFORM_CONSTANT)
+	{
+		XorConstant ((BYTE *) data, size, TC_NTFS_CONCEAL_CONSTANT);
+		return;
+	}
+
+	switch (transform->Mode)
+	{
+	case CONCEAL_TRANSFORM_PATTERN:
+		if (transform->PatternSize > 0 && transform->PatternSize <= CONCEAL_MAX_PATTERN_SIZE)
+			XorPattern ((BYTE *) data, size, transform->Pattern, transform->PatternSize, offset);
+		break;
+
+	case CONCEAL_TRANSFORM_KEYSTREAM:
+		XorKeystream ((BYTE *) data, size, transform->Key, transform->Nonce, offset);
+		break;
+	}
+}
+
+void SetConcealTransformDevice (ConcealTransform &transform, const wchar_t *deviceId)
+{
+	// FNV-1a: the nonce only needs to differ between devices, not to be secret
+	ULONGLONG hash = 0xcbf29ce484222325ULL;
+
+	for (; *deviceId; deviceId++)
+	{
+		wchar_t c = (wchar_t) towupper (*deviceId);
+
+		hash ^= (BYTE) c;
+		hash *= 0x100000001b3ULL;
+		hash ^= (BYTE) (c >> 8);
+		hash *= 0x100000001b3ULL;
+	}
+
+	for (int i = 0; i < CONCEAL_NONCE_SIZE; i++)
+		transform.Nonce[i] = (BYTE) (hash >> (i * 8));
+}
+
+const wchar_t *GetConcealTransformName (const ConcealTransform *transform)
+{
+	switch (transform ? transform->Mode : CONCEAL_TRANSFORM_CONSTANT)
+	{
+	case CONCEAL_TRANSFORM_PATTERN:		return L"pattern";
+	case CONCEAL_TRANSFORM_KEYSTREAM:	return L"chacha20";
+	default:							return L"constant";
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// Transform.h : self-inverse XOR transforms used to conceal device regions
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#define CONCEAL_MAX_PATTERN_SIZE	64
+#define CONCEAL_KEY_SIZE			32		// ChaCha20 key
+#define CONCEAL_NONCE_SIZE			8		// ChaCha20 nonce, selecting the keystream of a device
+
+enum ConcealTransformMode
+{
+	CONCEAL_TRANSFORM_CONSTANT,			// XOR with TC_NTFS_CONCEAL_CONSTANT (default)
+	CONCEAL_TRANSFORM_PATTERN,			// XOR with a repeating pattern of up to CONCEAL_MAX_PATTERN_SIZE bytes
+	CONCEAL_TRANSFORM_KEYSTREAM			// XOR with the ChaCha20 keystream of a key and of the nonce of the device
+};
+
+struct ConcealTransform
+{
+	ConcealTransform ()
+		:
+		Mode (CONCEAL_TRANSFORM_CONSTANT),
+		PatternSize (0)
+	{
+		ZeroMemory (Pattern, sizeof (Pattern));
+		ZeroMemory (Key, sizeof (Key));
+		ZeroMemory (Nonce, sizeof (Nonce));
+	}
+
+	~ConcealTransform ()
+	{
+		// Wipe the key material
+		SecureZeroMemory (Pattern, sizeof (Pattern));
+		SecureZeroMemory (Key, sizeof (Key));
+	}
+
+	ConcealTransformMode Mode;
+	BYTE Pattern[CONCEAL_MAX_PATTERN_SIZE];
+	size_t PatternSize;
+	BYTE Key[CONCEAL_KEY_SIZE];
+	BYTE Nonce[CONCEAL_NONCE_SIZE];		// Set for each device by SetConcealTransformDevice
+};
+
+// XORs data located at the given byte offset of the device with the keystream of the transform
+// (the constant transform is used if transform is NULL). Applying the same transform at the same
+// offset twice restores the original data, and regions may be processed in any order or size.
+void ApplyConcealTransform (const ConcealTransform *transform, void *data, size_t size, ULONGLONG offset);
+
+// Derives the nonce of the transform from the identity of a device (compared without regard to case),
+// so that devices transformed with the same key are not XORed with the same keystream
+void SetConcealTransformDevice (ConcealTransform &transform, const wchar_t *deviceId);
+
+const wchar_t *GetConcealTransformName (const ConcealTransform *transform);
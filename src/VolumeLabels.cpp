@@ -0,0 +1,437 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <process.h>
+#include <algorithm>
+#include <deque>
+#include <set>
+
+#include "Devices.h"
+#include "VolumeLabels.h"
+
+#define VOLUME_LABEL_WATCHDOG_INTERVAL	250		// ms
+
+struct VolumeLabelRequest
+{
+	wstring DevicePath;
+	DWORD Generation;
+};
+
+struct VolumeLabelWorker
+{
+	VolumeLabelWorker ()
+		:
+		Busy (false),
+		TimedOut (false),
+		CallStart (0)
+	{
+	}
+
+	bool Busy;
+	bool TimedOut;
+	DWORD CallStart;
+	VolumeLabelRequest Request;
+	wstring CacheKey;
+};
+
+struct VolumeLabelCacheEntry
+{
+	VolumeLabelResult Result;
+	DWORD Time;
+};
+
+// All the state is protected by ResolverLock. It lives as long as the process, because
+// a worker blocked on an unresponsive device may return at any time.
+static CRITICAL_SECTION ResolverLock;
+static HANDLE RequestSemaphore = NULL;
+static bool ResolverStarted = false;
+static HWND NotifyWindow = NULL;
+static bool NotificationPosted = false;
+static DWORD Generation = 0;
+static std::deque <VolumeLabelRequest> Requests;
+static vector <VolumeLabelResult> Results;
+static vector <VolumeLabelWorker *> Workers;
+static map <wstring, VolumeLabelCacheEntry> Cache;	// Indexed by volume GUID path, or device path for volumes without GUID
+static std::set <wstring> StuckVolumes;				// Cache keys of the queries that timed out and have not returned
+static map <wstring, wstring> VolumeGuidPaths;		// Volume GUID paths indexed by volume device name
+static bool VolumeGuidPathsLoaded = false;
+static DWORD VolumeGuidPathsVersion = 0;			// Incremented whenever the volume list must be read again
+
+static void LoadVolumeGuidPaths (map <wstring, wstring> &guidPaths)
+{
+	wchar_t volumeName[MAX_PATH];
+	wchar_t target[MAX_PATH];
+	HANDLE hFind;
+
+	guidPaths.clear();
+
+	hFind = FindFirstVolumeW (volumeName, ARRAYSIZE (volumeName));
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		// QueryDosDevice expects the volume name without the \\?\ prefix and the trailing backslash
+		size_t len = wcslen (volumeName);
+
+		if (len > 5 && volumeName[len - 1] == L'\\')
+		{
+			volumeName[len - 1] = 0;
+
+			if (QueryDosDeviceW (volumeName + 4, target, ARRAYSIZE (target)))
+				guidPaths[target] = wstring (volumeName) + L"\\";
+		}
+	}
+	while (FindNextVolumeW (hFind, volumeName, ARRAYSIZE (volumeName)));
+
+	FindVolumeClose (hFind);
+}
+
+static wstring GetVolumeDeviceName (const wstring &devicePath)
+{
+	wchar_t target[MAX_PATH];
+
+	// Partitions (\Device\HarddiskN\PartitionM) are links to volume devices
+	if (!SymbolicLinkToTarget ((PWSTR) devicePath.c_str(), target, sizeof (target) - sizeof (wchar_t)))
+		StringCchCopyW (target, ARRAYSIZE (target), devicePath.c_str());
+
+	return target;
+}
+
+// Called with the lock held
+static wstring GetVolumeGuidPath (const wstring &volumeDevice)
+{
+	map <wstring, wstring>::const_iterator It = VolumeGuidPaths.find (volumeDevice);
+	return (It != VolumeGuidPaths.end()) ? It->second : wstring();
+}
+
+static size_t CountAvailableWorkers ()
+{
+	size_t count = 0;
+
+	for (vector <VolumeLabelWorker *>::const_iterator It = Workers.begin(); It != Workers.end(); It++)
+	{
+		if (!(*It)->Busy || !(*It)->TimedOut)
+			count++;
+	}
+
+	return count;
+}
+
+static void AddResult (const VolumeLabelResult &result, DWORD generation)
+{
+	if (generation != Generation)
+		return;
+
+	Results.push_back (result);
+
+	// A single notification is pending at any time, however many results arrive
+	if (!NotificationPosted && NotifyWindow)
+		NotificationPosted = PostMessage (NotifyWindow, WM_VOLUME_LABELS_RESOLVED, 0, 0) != 0;
+}
+
+static unsigned __stdcall VolumeLabelWorkerProc (void *param);
+
+static void StartWorker ()
+{
+	VolumeLabelWorker *worker = new VolumeLabelWorker;
+	HANDLE hThread;
+
+	Workers.push_back (worker);
+
+	hThread = (HANDLE) _beginthreadex (NULL, 0, VolumeLabelWorkerProc, worker, 0, NULL);
+	if (hThread)
+		CloseHandle (hThread);
+	else
+	{
+		Workers.pop_back();
+		delete worker;
+	}
+}
+
+static unsigned __stdcall VolumeLabelWorkerProc (void *param)
+{
+	VolumeLabelWorker *worker = (VolumeLabelWorker *) param;
+
+	for (;;)
+	{
+		wchar_t label[MAX_PATH + 1];
+		wchar_t fileSystem[MAX_PATH + 1];
+		wstring rootPath;
+		wstring volumeDevice;
+		VolumeLabelResult result;
+		bool bGuidPathsLoaded;
+		DWORD guidPathsVersion;
+		bool bExit = false;
+
+		WaitForSingleObject (RequestSemaphore, INFINITE);
+
+		EnterCriticalSection (&ResolverLock);
+
+		if (Requests.empty())
+		{
+			LeaveCriticalSection (&ResolverLock);
+			continue;
+		}
+
+		worker->Request = Requests.front();
+		Requests.pop_front();
+
+		bGuidPathsLoaded = VolumeGuidPathsLoaded;
+		guidPathsVersion = VolumeGuidPathsVersion;
+
+		LeaveCriticalSection (&ResolverLock);
+
+		// The mount manager is queried without the lock, which the dialog takes to request labels and take
+		// the results. The volume list is read once per dialog session, unless invalidated while being read.
+		if (!bGuidPathsLoaded)
+		{
+			map <wstring, wstring> guidPaths;
+
+			LoadVolumeGuidPaths (guidPaths);
+
+			EnterCriticalSection (&ResolverLock);
+
+			if (!VolumeGuidPathsLoaded && VolumeGuidPathsVersion == guidPathsVersion)
+			{
+				VolumeGuidPaths.swap (guidPaths);
+				VolumeGuidPathsLoaded = true;
+			}
+
+			LeaveCriticalSection (&ResolverLock);
+		}
+
+		volumeDevice = GetVolumeDeviceName (worker->Request.DevicePath);
+
+		EnterCriticalSection (&ResolverLock);
+
+		rootPath = GetVolumeGuidPath (volumeDevice);
+		worker->CacheKey = rootPath.empty() ? worker->Request.DevicePath : rootPath;
+
+		map <wstring, VolumeLabelCacheEntry>::iterator cached = Cache.find (worker->CacheKey);
+		if (cached != Cache.end() && GetTickCount () - cached->second.Time > VOLUME_LABEL_CACHE_LIFETIME)
+		{
+			Cache.erase (cached);
+			cached = Cache.end();
+		}
+
+		if (cached != Cache.end() || StuckVolumes.find (worker->CacheKey) != StuckVolumes.end())
+		{
+			// A volume still blocking a worker is not queried by another one
+			if (cached != Cache.end())
+				result = cached->second.Result;
+			else
+				result.Status = VOLUME_LABEL_TIMED_OUT;
+
+			result.DevicePath = worker->Request.DevicePath;
+			AddResult (result, worker->Request.Generation);
+
+			LeaveCriticalSection (&ResolverLock);
+			continue;
+		}
+
+		worker->Busy = true;
+		worker->TimedOut = false;
+		worker->CallStart = GetTickCount ();
+
+		LeaveCriticalSection (&ResolverLock);
+
+		if (rootPath.empty())
+			rootPath = L"\\\\?\\GLOBALROOT" + worker->Request.DevicePath + L"\\";
+
+		// May block for a long time on slow or failing media
+		result.DevicePath = worker->Request.DevicePath;
+		if (GetVolumeInformationW (rootPath.c_str(), label, ARRAYSIZE (label), NULL, NULL, NULL, fileSystem, ARRAYSIZE (fileSystem)))
+		{
+			result.Status = VOLUME_LABEL_RESOLVED;
+			result.Label = label;
+			result.FileSystem = fileSystem;
+		}
+
+		EnterCriticalSection (&ResolverLock);
+
+		// A failure may be transient (volume being mounted or dismounted), so it is not cached
+		if (result.Status == VOLUME_LABEL_RESOLVED)
+		{
+			VolumeLabelCacheEntry &entry = Cache[worker->CacheKey];
+
+			entry.Result = result;
+			entry.Time = GetTickCount ();
+		}
+
+		if (worker->TimedOut)
+			StuckVolumes.erase (worker->CacheKey);
+
+		AddResult (result, worker->Request.Generation);
+
+		worker->Busy = false;
+		worker->CallStart = 0;
+
+		// This worker has been replaced while it was blocked
+		if (worker->TimedOut && CountAvailableWorkers () > VOLUME_LABEL_WORKER_COUNT)
+		{
+			Workers.erase (std::find (Workers.begin(), Workers.end(), worker));
+			bExit = true;
+		}
+
+		LeaveCriticalSection (&ResolverLock);
+
+		if (bExit)
+		{
+			delete worker;
+			return 0;
+		}
+	}
+}
+
+// Reports the calls exceeding the timeout and replaces their workers, so that an
+// unresponsive device cannot delay the resolution of the other volumes
+static unsigned __stdcall VolumeLabelWatchdogProc (void *param)
+{
+	for (;;)
+	{
+		Sleep (VOLUME_LABEL_WATCHDOG_INTERVAL);
+
+		EnterCriticalSection (&ResolverLock);
+
+		DWORD now = GetTickCount ();
+
+		for (vector <VolumeLabelWorker *>::iterator It = Workers.begin(); It != Workers.end(); It++)
+		{
+			VolumeLabelWorker *worker = *It;
+
+			if (worker->Busy && !worker->TimedOut && now - worker->CallStart > VOLUME_LABEL_TIMEOUT)
+			{
+				VolumeLabelResult result;
+
+				worker->TimedOut = true;
+
+				// The device is not queried again until the call returns
+				StuckVolumes.insert (worker->CacheKey);
+
+				result.Status = VOLUME_LABEL_TIMED_OUT;
+				result.DevicePath = worker->Request.DevicePath;
+				AddResult (result, worker->Request.Generation);
+			}
+		}
+
+		while (CountAvailableWorkers () < VOLUME_LABEL_WORKER_COUNT
+			&& Workers.size() < VOLUME_LABEL_WORKER_COUNT + VOLUME_LABEL_MAX_STUCK_WORKERS)
+		{
+			size_t count = Workers.size();
+
+			StartWorker ();
+			if (Workers.size() == count)
+				break;
+		}
+
+		LeaveCriticalSection (&ResolverLock);
+	}
+
+	return 0;
+}
+
+void StartVolumeLabelResolver (HWND hwndNotify)
+{
+	if (!ResolverStarted)
+	{
+		HANDLE hThread;
+
+		RequestSemaphore = CreateSemaphoreW (NULL, 0, MAXLONG, NULL);
+		if (!RequestSemaphore)
+			return;
+
+		InitializeCriticalSection (&ResolverLock);
+
+		EnterCriticalSection (&ResolverLock);
+
+		for (int i = 0; i < VOLUME_LABEL_WORKER_COUNT; i++)
+			StartWorker ();
+
+		LeaveCriticalSection (&ResolverLock);
+
+		hThread = (HANDLE) _beginthreadex (NULL, 0, VolumeLabelWatchdogProc, NULL, 0, NULL);
+		if (hThread)
+			CloseHandle (hThread);
+
+		ResolverStarted = true;
+	}
+
+	EnterCriticalSection (&ResolverLock);
+
+	NotifyWindow = hwndNotify;
+	NotificationPosted = false;
+	VolumeGuidPathsLoaded = false;		// Volumes may have been added or removed
+	VolumeGuidPathsVersion++;
+
+	LeaveCriticalSection (&ResolverLock);
+}
+
+void StopVolumeLabelResolver ()
+{
+	if (!ResolverStarted)
+		return;
+
+	EnterCriticalSection (&ResolverLock);
+
+	NotifyWindow = NULL;
+	NotificationPosted = false;
+	Generation++;
+	Requests.clear();
+	Results.clear();
+
+	LeaveCriticalSection (&ResolverLock);
+}
+
+void InvalidateVolumeLabels ()
+{
+	if (!ResolverStarted)
+		return;
+
+	EnterCriticalSection (&ResolverLock);
+
+	Cache.clear();
+	VolumeGuidPathsLoaded = false;
+	VolumeGuidPathsVersion++;
+
+	LeaveCriticalSection (&ResolverLock);
+}
+
+void RequestVolumeLabel (const wstring &devicePath)
+{
+	VolumeLabelRequest request;
+
+	if (!ResolverStarted)
+		return;
+
+	request.DevicePath = devicePath;
+
+	EnterCriticalSection (&ResolverLock);
+
+	request.Generation = Generation;
+	Requests.push_back (request);
+
+	LeaveCriticalSection (&ResolverLock);
+
+	ReleaseSemaphore (RequestSemaphore, 1, NULL);
+}
+
+void TakeVolumeLabelResults (vector <VolumeLabelResult> &results)
+{
+	if (!ResolverStarted)
+		return;
+
+	EnterCriticalSection (&ResolverLock);
+
+	results.insert (results.end(), Results.begin(), Results.end());
+	Results.clear();
+	NotificationPosted = false;
+
+	LeaveCriticalSection (&ResolverLock);
+}
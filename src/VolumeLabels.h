@@ -0,0 +1,61 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// VolumeLabels.h : asynchronous resolution of volume labels and filesystems
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Posted to the notification window when results are available (see TakeVolumeLabelResults)
+#define WM_VOLUME_LABELS_RESOLVED		(WM_APP + 1)
+
+#define VOLUME_LABEL_WORKER_COUNT		4
+#define VOLUME_LABEL_MAX_STUCK_WORKERS	8			// Workers blocked beyond the timeout, which are replaced
+#define VOLUME_LABEL_TIMEOUT			3000		// ms
+#define VOLUME_LABEL_CACHE_LIFETIME		30000		// ms, after which a volume may have been relabeled
+
+enum VolumeLabelStatus
+{
+	VOLUME_LABEL_RESOLVED,
+	VOLUME_LABEL_FAILED,
+	VOLUME_LABEL_TIMED_OUT		// The query did not complete in time. A late result may still follow.
+};
+
+struct VolumeLabelResult
+{
+	VolumeLabelResult ()
+		:
+		Status (VOLUME_LABEL_FAILED)
+	{
+	}
+
+	std::wstring DevicePath;
+	VolumeLabelStatus Status;
+	std::wstring Label;
+	std::wstring FileSystem;
+};
+
+// Starts the workers on the first call and directs the notifications to hwndNotify. Labels resolved
+// are cached by volume GUID for VOLUME_LABEL_CACHE_LIFETIME. Failed queries are not cached, and
+// a volume whose query timed out is only queried again once that query has returned.
+void StartVolumeLabelResolver (HWND hwndNotify);
+
+// Discards the cached labels, as the volumes may have been formatted or replaced (device changes)
+void InvalidateVolumeLabels ();
+
+// Discards the pending requests and stops notifying the window. Workers blocked on an
+// unresponsive device are not waited for.
+void StopVolumeLabelResolver ();
+
+// Queues the resolution of the label of a partition or volume (\Device\...)
+void RequestVolumeLabel (const std::wstring &devicePath);
+
+// Moves the results available since the previous call to results
+void TakeVolumeLabelResults (std::vector <VolumeLabelResult> &results);
@@ -0,0 +1,197 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+#include "stdafx.h"
+#include <process.h>
+
+#include "Instrumentation.h"
+#include "VolumeMetadata.h"
+
+static void SetMetadataError (VolumeMetadata &metadata, DWORD error)
+{
+	if (metadata.LastError == ERROR_SUCCESS)
+		metadata.LastError = error;
+}
+
+static void GetVolumeMountPoints (const wchar_t *volumeName, VolumeMetadata &metadata, VolumeMetadataScratch &scratch)
+{
+	DWORD charCount;
+
+	if (scratch.PathNames.size() < MAX_PATH)
+	{
+		scratch.PathNames.resize (MAX_PATH);
+		AddInstrumentationCounter (INSTRUMENTATION_ALLOCATIONS, 1);
+		AddInstrumentationCounter (INSTRUMENTATION_ALLOCATED_BYTES, MAX_PATH * sizeof (wchar_t));
+	}
+
+	while (!GetVolumePathNamesForVolumeNameW (volumeName, &scratch.PathNames[0], (DWORD) scratch.PathNames.size(), &charCount))
+	{
+		if (GetLastError () != ERROR_MORE_DATA || charCount <= scratch.PathNames.size())
+		{
+			SetMetadataError (metadata, GetLastError ());
+			return;
+		}
+
+		scratch.PathNames.resize (charCount);
+		AddInstrumentationCounter (INSTRUMENTATION_ALLOCATIONS, 1);
+		AddInstrumentationCounter (INSTRUMENTATION_ALLOCATED_BYTES, charCount * sizeof (wchar_t));
+	}
+
+	// The list is terminated by an empty string
+	for (const wchar_t *path = &scratch.PathNames[0]; *path; path += wcslen (path) + 1)
+		metadata.MountPoints.push_back (path);
+}
+
+bool GetVolumeMetadata (const wchar_t *volumeName, VolumeMetadata &metadata, VolumeMetadataScratch &scratch)
+{
+	wchar_t label[MAX_PATH + 1];
+	wchar_t fileSystem[MAX_PATH + 1];
+	wchar_t devicePath[MAX_PATH];
+	HANDLE hVolume;
+
+	metadata = VolumeMetadata();
+	metadata.VolumeName = volumeName;
+
+	// The mount manager answers these without accessing the volume
+	metadata.DriveType = GetDriveTypeW (volumeName);
+	GetVolumeMountPoints (volumeName, metadata, scratch);
+
+	// The volume device is opened without the trailing backslash, which would open its root directory.
+	// No access right is requested, so that this does not require administrator rights.
+	StringCchCopyW (devicePath, ARRAYSIZE (devicePath), volumeName);
+	size_t len = wcslen (devicePath);
+	if (len > 0 && devicePath[len - 1] == L'\\')
+		devicePath[len - 1] = 0;
+
+	hVolume = CreateFileW (devicePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hVolume == INVALID_HANDLE_VALUE)
+	{
+		SetMetadataError (metadata, GetLastError ());
+		return false;
+	}
+
+	if (!GetVolumeExtents (hVolume, metadata.Extents, scratch.Extents))
+		SetMetadataError (metadata, GetLastError ());
+
+	// Before Vista, the volume information can only be queried by path, which opens the volume again
+	if ((GetVolumeInformationByHandle
+			&& GetVolumeInformationByHandle (hVolume, label, ARRAYSIZE (label), &metadata.SerialNumber, &metadata.MaxComponentLength,
+				&metadata.FileSystemFlags, fileSystem, ARRAYSIZE (fileSystem)))
+		|| GetVolumeInformationW (volumeName, label, ARRAYSIZE (label), &metadata.SerialNumber, &metadata.MaxComponentLength,
+			&metadata.FileSystemFlags, fileSystem, ARRAYSIZE (fileSystem)))
+	{
+		metadata.InfoValid = true;
+		metadata.Label = label;
+		metadata.FileSystem = fileSystem;
+	}
+	else
+		SetMetadataError (metadata, GetLastError ());
+
+	CloseHandle (hVolume);
+	return metadata.LastError == ERROR_SUCCESS;
+}
+
+struct VolumeMetadataJob
+{
+	vector <VolumeMetadata> *Volumes;
+	vector <wstring> *VolumeNames;
+	volatile LONG NextVolume;
+};
+
+// Each thread takes the next volume not yet queried, so that the threads stay busy
+// whatever the time taken by each volume
+static unsigned __stdcall VolumeMetadataThreadProc (void *param)
+{
+	VolumeMetadataJob *job = (VolumeMetadataJob *) param;
+	VolumeMetadataScratch scratch;
+	LONG index;
+
+	while ((index = InterlockedIncrement (&job->NextVolume) - 1) < (LONG) job->VolumeNames->size())
+		GetVolumeMetadata ((*job->VolumeNames)[index].c_str(), (*job->Volumes)[index], scratch);
+
+	return 0;
+}
+
+bool CollectVolumeMetadata (vector <VolumeMetadata> &volumes)
+{
+	vector <wstring> volumeNames;
+	wchar_t volumeName[MAX_PATH];
+	HANDLE hFind;
+
+	volumes.clear();
+
+	hFind = FindFirstVolumeW (volumeName, ARRAYSIZE (volumeName));
+	if (hFind == INVALID_HANDLE_VALUE)
+		return false;
+
+	do
+	{
+		volumeNames.push_back (volumeName);
+	}
+	while (FindNextVolumeW (hFind, volumeName, ARRAYSIZE (volumeName)));
+
+	FindVolumeClose (hFind);
+
+	volumes.resize (volumeNames.size());
+
+	VolumeMetadataJob job;
+	job.Volumes = &volumes;
+	job.VolumeNames = &volumeNames;
+	job.NextVolume = 0;
+
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo (&systemInfo);
+
+	size_t threadCount = min ((size_t) systemInfo.dwNumberOfProcessors * 2, (size_t) VOLUME_METADATA_MAX_THREADS);
+	threadCount = min (threadCount, volumeNames.size());
+
+	// The calling thread takes part in the collection
+	vector <HANDLE> threads;
+	for (size_t i = 1; i < threadCount; i++)
+	{
+		HANDLE hThread = (HANDLE) _beginthreadex (NULL, 0, VolumeMetadataThreadProc, &job, 0, NULL);
+		if (hThread)
+			threads.push_back (hThread);
+	}
+
+	VolumeMetadataThreadProc (&job);
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		WaitForSingleObject (threads[i], INFINITE);
+		CloseHandle (threads[i]);
+	}
+
+	return true;
+}
+
+const VolumeMetadata *FindVolumeMetadata (const vector <VolumeMetadata> &volumes, const HostDevice &device)
+{
+	if (device.Extents.empty())
+		return NULL;
+
+	for (vector <VolumeMetadata>::const_iterator It = volumes.begin(); It != volumes.end(); It++)
+	{
+		if (It->Extents.size() != device.Extents.size())
+			continue;
+
+		bool bMatch = true;
+
+		for (size_t i = 0; bMatch && i < device.Extents.size(); i++)
+		{
+			bMatch = It->Extents[i].DiskNumber == device.Extents[i].DiskNumber
+				&& It->Extents[i].StartingOffset == device.Extents[i].StartingOffset
+				&& It->Extents[i].Length == device.Extents[i].Length;
+		}
+
+		if (bMatch)
+			return &*It;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,70 @@
+/*
+ Copyright (c) 2013-2016 IDRIX. All rights reserved.
+
+ Governed by the Apache License 2.0 the full text of which is
+ contained in the file License.txt included in VeraCrypt binary and source
+ code distribution packages.
+*/
+
+
+// VolumeMetadata.h : collection of the metadata of the volumes of the system
+//
+/////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "Devices.h"
+
+// Upper bound of the number of threads used to collect the metadata of all the volumes
+#define VOLUME_METADATA_MAX_THREADS		8
+
+struct VolumeMetadata
+{
+	VolumeMetadata ()
+		:
+		InfoValid (false),
+		SerialNumber (0),
+		FileSystemFlags (0),
+		MaxComponentLength (0),
+		DriveType (DRIVE_UNKNOWN),
+		LastError (ERROR_SUCCESS)
+	{
+	}
+
+	std::wstring VolumeName;				// Volume GUID path, with a trailing backslash
+	bool InfoValid;							// Label, FileSystem, SerialNumber, FileSystemFlags and MaxComponentLength are set
+	std::wstring Label;
+	std::wstring FileSystem;
+	DWORD SerialNumber;
+	DWORD FileSystemFlags;
+	DWORD MaxComponentLength;
+	UINT DriveType;
+	std::vector <std::wstring> MountPoints;	// Drive letters and folders (C:\, D:\Mount\)
+	std::vector <HostDeviceExtent> Extents;
+	DWORD LastError;						// Error of the first query that failed, or ERROR_SUCCESS
+};
+
+// Buffers reused by the successive calls of a thread to GetVolumeMetadata
+struct VolumeMetadataScratch
+{
+	VolumeMetadataScratch ()
+		:
+		Extents (sizeof (VOLUME_DISK_EXTENTS) + 8 * sizeof (DISK_EXTENT))
+	{
+	}
+
+	std::vector <wchar_t> PathNames;
+	IoctlBuffer Extents;
+};
+
+// Gathers the metadata of a volume (\\?\Volume{GUID}\) using a single handle. The queries are
+// independent, so the metadata is partially filled when one of them fails, in which case
+// false is returned and metadata.LastError is set.
+bool GetVolumeMetadata (const wchar_t *volumeName, VolumeMetadata &metadata, VolumeMetadataScratch &scratch);
+
+// Gathers the metadata of all the volumes of the system, querying several volumes in parallel
+// so that a slow device does not delay the others. Returns false if the volumes cannot be enumerated.
+bool CollectVolumeMetadata (std::vector <VolumeMetadata> &volumes);
+
+// Returns the volume occupying exactly the extents of the device, or NULL
+const VolumeMetadata *FindVolumeMetadata (const std::vector <VolumeMetadata> &volumes, const HostDevice &device);
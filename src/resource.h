@@ -6,13 +6,13 @@
 #define IDR_MAINFRAME                   128
 #define IDD_MAINDLG                     129
 #define IDD_DEVICE                      201
-#define IDD_DPI                         202
 #define IDC_DEVICE                      1000
 #define IDC_SELECT_DEVICE               1001
 #define IDC_APPLY                       1002
 #define IDC_HELP_TEXT                   1003
 #define IDC_DEVICELIST                  1004
-#define IDC_ASPECT_RATIO_CALIBRATION_BOX 1005
+#define IDC_VERIFY                      1006
+#define IDC_DEVICE_FILTER               1007
 
 // Next default values for new objects
 // 
@@ -20,7 +20,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        203
 #define _APS_NEXT_COMMAND_VALUE         32775
-#define _APS_NEXT_CONTROL_VALUE         1006
+#define _APS_NEXT_CONTROL_VALUE         1008
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
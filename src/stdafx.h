@@ -91,6 +91,68 @@ extern NTOPENSYMBOLICLINKOBJECT NtOpenSymbolicLinkObject;
 extern NTQUERYSYMBOLICLINKOBJECT NtQuerySymbolicLinkObject;
 extern NTCLOSE NtClose;
 
+#if _WIN32_WINNT < 0x0602
+typedef struct _WIN32_MEMORY_RANGE_ENTRY {
+    PVOID VirtualAddress;
+    SIZE_T NumberOfBytes;
+} WIN32_MEMORY_RANGE_ENTRY, *PWIN32_MEMORY_RANGE_ENTRY;
+#endif
+
+// Available starting from Windows 8 (NULL on older versions)
+typedef BOOL (WINAPI *PREFETCHVIRTUALMEMORY)(
+_In_  HANDLE hProcess,
+_In_  ULONG_PTR NumberOfEntries,
+_In_  PWIN32_MEMORY_RANGE_ENTRY VirtualAddresses,
+_In_  ULONG Flags
+);
+
+extern PREFETCHVIRTUALMEMORY PrefetchVirtualMemory;
+
+// Available starting from Windows Vista (NULL on older versions)
+typedef BOOL (WINAPI *GETVOLUMEINFORMATIONBYHANDLEW)(
+_In_       HANDLE hFile,
+_Out_opt_  LPWSTR lpVolumeNameBuffer,
+_In_       DWORD nVolumeNameSize,
+_Out_opt_  LPDWORD lpVolumeSerialNumber,
+_Out_opt_  LPDWORD lpMaximumComponentLength,
+_Out_opt_  LPDWORD lpFileSystemFlags,
+_Out_opt_  LPWSTR lpFileSystemNameBuffer,
+_In_       DWORD nFileSystemNameSize
+);
+
+extern GETVOLUMEINFORMATIONBYHANDLEW GetVolumeInformationByHandle;
+
+#if _WIN32_WINNT < 0x0600
+typedef enum _PRIORITY_HINT {
+    IoPriorityHintVeryLow = 0,
+    IoPriorityHintLow,
+    IoPriorityHintNormal,
+    MaximumIoPriorityHintType
+} PRIORITY_HINT;
+
+typedef struct _FILE_IO_PRIORITY_HINT_INFO {
+    PRIORITY_HINT PriorityHint;
+} FILE_IO_PRIORITY_HINT_INFO, *PFILE_IO_PRIORITY_HINT_INFO;
+
+// Value of FILE_INFO_BY_HANDLE_CLASS
+#define FileIoPriorityHintInfo		12
+#endif
+
+// Available starting from Windows Vista (NULL on older versions)
+typedef BOOL (WINAPI *SETFILEINFORMATIONBYHANDLE)(
+_In_  HANDLE hFile,
+_In_  int FileInformationClass,
+_In_  LPVOID lpFileInformation,
+_In_  DWORD dwBufferSize
+);
+
+extern SETFILEINFORMATIONBYHANDLE SetFileInformationByHandle;
+
+// Available starting from Windows Vista (NULL on older versions)
+typedef SIZE_T (WINAPI *GETLARGEPAGEMINIMUM)(VOID);
+
+extern GETLARGEPAGEMINIMUM GetLargePageMinimum;
+
 
 
 #if defined _M_IX86